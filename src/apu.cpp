@@ -0,0 +1,675 @@
+#include "apu.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define MAX_FRAME_SAMPLES (SAMPLE_RATE / 20)
+
+// Output per step of each channel's level, the slopes of the hardware mixer at 0 scaled to 16 bits
+#define PULSE_WEIGHT 246
+#define TRIANGLE_WEIGHT 279
+#define NOISE_WEIGHT 162
+#define DMC_WEIGHT 110
+
+#define FRAME_QUARTER 0x01
+#define FRAME_HALF 0x02
+#define FRAME_IRQ 0x04
+#define FOUR_STEP_PERIOD 29830
+#define FIVE_STEP_PERIOD 37282
+
+typedef struct frame_step {
+    uint32_t cycle;     // CPU cycles since the start of the sequence
+    uint8_t actions;
+} FrameStep;
+
+static const FrameStep four_step_sequence[4] = {
+    {7457, FRAME_QUARTER}, {14913, FRAME_QUARTER | FRAME_HALF},
+    {22371, FRAME_QUARTER}, {29829, FRAME_QUARTER | FRAME_HALF | FRAME_IRQ},
+};
+
+static const FrameStep five_step_sequence[5] = {
+    {7457, FRAME_QUARTER}, {14913, FRAME_QUARTER | FRAME_HALF},
+    {22371, FRAME_QUARTER}, {29829, 0}, {37281, FRAME_QUARTER | FRAME_HALF},
+};
+
+static const uint8_t length_table[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const uint8_t duty_cycles[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const uint8_t triangle_levels[32] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+/** NTSC periods in CPU cycles */
+static const uint16_t noise_periods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const uint16_t dmc_rates[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+};
+
+APU::APU(): pulses(), triangle(), noise(), dmc(), blip(CPU_CLOCK_RATE, SAMPLE_RATE, MAX_FRAME_SAMPLES) {
+    cpu = nullptr;
+    event = -1;
+    irq = false;
+    irq_handler = nullptr;
+    irq_context = nullptr;
+    time = 0;
+    frame_start = 0;
+    reset();
+}
+
+void APU::attach(CPU& cpu) {
+    this->cpu = &cpu;
+    cpu.get_bus().map_io(0x4000, 0x4013, nullptr, write_register, this);
+    cpu.get_bus().map_io(0x4015, 0x4015, read_register, write_register, this);
+    cpu.get_bus().map_io(0x4017, 0x4017, nullptr, write_register, this);
+    event = cpu.get_scheduler().add_source(on_event, this);
+    time = cpu.get_cycles();
+    frame_start = time;
+    reset();
+}
+
+/** Power up state: everything silent and the frame counter restarted */
+void APU::reset() {
+    mix(pulses[0].output, 0, time);
+    mix(pulses[1].output, 0, time);
+    mix(triangle.output, 0, time);
+    mix(noise.output, 0, time);
+    mix(dmc.output, 0, time);
+    memset(pulses, 0, sizeof(pulses));
+    memset(&triangle, 0, sizeof(triangle));
+    memset(&noise, 0, sizeof(noise));
+    memset(&dmc, 0, sizeof(dmc));
+    pulses[0].negate_offset = 1;
+    noise.shift = 1;
+    dmc.bits = 8;
+    dmc.silence = true;
+    pulses[0].next = pulses[1].next = triangle.next = noise.next = dmc.next = time + 1;
+
+    five_step = false;
+    irq_inhibit = false;
+    frame_irq = false;
+    dmc_irq = false;
+    frame_step = 0;
+    sequence_start = time;
+    update_irq();
+    schedule_event();
+}
+
+void APU::set_irq_handler(IrqHandler handler, void* context) {
+    irq_handler = handler;
+    irq_context = context;
+}
+
+bool APU::irq_pending() {
+    return irq;
+}
+
+void APU::update_irq() {
+    bool asserted = frame_irq || dmc_irq;
+    if(asserted == irq)
+        return;
+    irq = asserted;
+    if(irq_handler != nullptr)
+        irq_handler(irq_context, asserted);
+}
+
+/** Register handlers, which bring the APU up to the CPU before the access. Both can move the IRQ event */
+uint8_t APU::read_register(void* apu, uint16_t addr) {
+    APU* self = (APU*)apu;
+    self->run(self->cpu->get_cycles());
+    uint8_t value = self->read(addr);
+    self->schedule_event();
+    return value;
+}
+
+void APU::write_register(void* apu, uint16_t addr, uint8_t value) {
+    APU* self = (APU*)apu;
+    self->run(self->cpu->get_cycles());
+    self->write(addr, value);
+    self->schedule_event();
+}
+
+/** The only readable register, $4015: length counters and IRQ flags. Reading acknowledges the frame IRQ */
+uint8_t APU::read(uint16_t addr) {
+    uint8_t status = (pulses[0].length ? 0x01 : 0x00) | (pulses[1].length ? 0x02 : 0x00)
+                     | (triangle.length ? 0x04 : 0x00) | (noise.length ? 0x08 : 0x00)
+                     | (dmc.remaining ? 0x10 : 0x00) | (frame_irq ? 0x40 : 0x00) | (dmc_irq ? 0x80 : 0x00);
+    frame_irq = false;
+    update_irq();
+    return status;
+}
+
+void APU::write(uint16_t addr, uint8_t value) {
+    switch(addr) {
+        case 0x4000: case 0x4004: {
+            Pulse& pulse = pulses[(addr >> 2) & 0x01];
+            pulse.duty = value >> 6;
+            pulse.envelope.loop = value & 0x20;
+            pulse.envelope.constant = value & 0x10;
+            pulse.envelope.period = value & 0x0F;
+            break;
+        }
+        case 0x4001: case 0x4005: {
+            Pulse& pulse = pulses[(addr >> 2) & 0x01];
+            pulse.sweep_enabled = value & 0x80;
+            pulse.sweep_period = (value >> 4) & 0x07;
+            pulse.sweep_negate = value & 0x08;
+            pulse.sweep_shift = value & 0x07;
+            pulse.sweep_reload = true;
+            break;
+        }
+        case 0x4002: case 0x4006: {
+            Pulse& pulse = pulses[(addr >> 2) & 0x01];
+            pulse.timer = (pulse.timer & 0x0700) | value;
+            break;
+        }
+        case 0x4003: case 0x4007: {
+            Pulse& pulse = pulses[(addr >> 2) & 0x01];
+            pulse.timer = (pulse.timer & 0x00FF) | ((value & 0x07) << 8);
+            if(pulse.enabled)
+                pulse.length = length_table[value >> 3];
+            pulse.step = 0;
+            pulse.envelope.start = true;
+            break;
+        }
+        case 0x4008:
+            triangle.control = value & 0x80;
+            triangle.linear_period = value & 0x7F;
+            break;
+        case 0x400A:
+            triangle.timer = (triangle.timer & 0x0700) | value;
+            break;
+        case 0x400B:
+            triangle.timer = (triangle.timer & 0x00FF) | ((value & 0x07) << 8);
+            if(triangle.enabled)
+                triangle.length = length_table[value >> 3];
+            triangle.linear_reload = true;
+            break;
+        case 0x400C:
+            noise.envelope.loop = value & 0x20;
+            noise.envelope.constant = value & 0x10;
+            noise.envelope.period = value & 0x0F;
+            break;
+        case 0x400E:
+            noise.short_mode = value & 0x80;
+            noise.period = value & 0x0F;
+            break;
+        case 0x400F:
+            if(noise.enabled)
+                noise.length = length_table[value >> 3];
+            noise.envelope.start = true;
+            break;
+        case 0x4010:
+            dmc.irq_enabled = value & 0x80;
+            dmc.loop = value & 0x40;
+            dmc.rate = value & 0x0F;
+            if(!dmc.irq_enabled) {
+                dmc_irq = false;
+                update_irq();
+            }
+            break;
+        case 0x4011:
+            dmc.level = value & 0x7F;
+            mix(dmc.output, dmc.level * DMC_WEIGHT, time);
+            break;
+        case 0x4012:
+            dmc.sample_addr = 0xC000 | (value << 6);
+            break;
+        case 0x4013:
+            dmc.sample_length = (value << 4) + 1;
+            break;
+        case 0x4015:
+            pulses[0].enabled = value & 0x01;
+            pulses[1].enabled = value & 0x02;
+            triangle.enabled = value & 0x04;
+            noise.enabled = value & 0x08;
+            if(!pulses[0].enabled)
+                pulses[0].length = 0;
+            if(!pulses[1].enabled)
+                pulses[1].length = 0;
+            if(!triangle.enabled)
+                triangle.length = 0;
+            if(!noise.enabled)
+                noise.length = 0;
+            if(!(value & 0x10)) {
+                dmc.remaining = 0;
+            } else if(dmc.remaining == 0) {
+                dmc.addr = dmc.sample_addr;
+                dmc.remaining = dmc.sample_length;
+                fetch_sample();
+            }
+            dmc_irq = false;
+            update_irq();
+            break;
+        case 0x4017:
+            // A new sequence starts from the write, the five step one with its first clocks
+            five_step = value & 0x80;
+            irq_inhibit = value & 0x40;
+            if(irq_inhibit) {
+                frame_irq = false;
+                update_irq();
+            }
+            sequence_start = time;
+            frame_step = 0;
+            if(five_step) {
+                clock_quarter_frame();
+                clock_half_frame();
+            }
+            break;
+    }
+    update_outputs(time);
+}
+
+/** Sends a channel's new level to the buffer if it changed */
+void APU::mix(int& output, int level, uint64_t cycle) {
+    if(level == output)
+        return;
+    blip.add_delta(cycle - frame_start, level - output);
+    output = level;
+}
+
+int APU::sweep_target(Pulse& pulse) {
+    int change = pulse.timer >> pulse.sweep_shift;
+    if(pulse.sweep_negate)
+        return pulse.timer - change - pulse.negate_offset;
+    return pulse.timer + change;
+}
+
+/** Envelope volume, 0 while the length counter, a too short period or the sweep mutes the channel */
+int APU::pulse_volume(Pulse& pulse) {
+    if(pulse.length == 0 || pulse.timer < 8 || sweep_target(pulse) > 0x07FF)
+        return 0;
+    return pulse.envelope.constant ? pulse.envelope.period : pulse.envelope.decay;
+}
+
+int APU::noise_volume() {
+    if(noise.length == 0)
+        return 0;
+    return noise.envelope.constant ? noise.envelope.period : noise.envelope.decay;
+}
+
+void APU::run_pulse(Pulse& pulse, uint64_t cycle) {
+    if(pulse.next > cycle)
+        return;
+    uint32_t period = (pulse.timer + 1) * 2;
+    int volume = pulse_volume(pulse);
+    if(volume == 0) {
+        uint64_t steps = (cycle - pulse.next) / period + 1;
+        pulse.step = (pulse.step + steps) & 0x07;
+        pulse.next += steps * period;
+        return;
+    }
+    int level = volume * PULSE_WEIGHT;
+    const uint8_t* duty = duty_cycles[pulse.duty];
+    while(pulse.next <= cycle) {
+        pulse.step = (pulse.step + 1) & 0x07;
+        mix(pulse.output, duty[pulse.step] ? level : 0, pulse.next);
+        pulse.next += period;
+    }
+}
+
+/** The sequencer holds its level while either counter is 0, and at ultrasonic periods */
+void APU::run_triangle(uint64_t cycle) {
+    if(triangle.next > cycle)
+        return;
+    uint32_t period = triangle.timer + 1;
+    if(triangle.length == 0 || triangle.linear == 0 || triangle.timer < 2) {
+        triangle.next += ((cycle - triangle.next) / period + 1) * period;
+        return;
+    }
+    while(triangle.next <= cycle) {
+        triangle.step = (triangle.step + 1) & 0x1F;
+        mix(triangle.output, triangle_levels[triangle.step] * TRIANGLE_WEIGHT, triangle.next);
+        triangle.next += period;
+    }
+}
+
+/** The shift register is left alone while the channel is silent, it only picks the next bits */
+void APU::run_noise(uint64_t cycle) {
+    if(noise.next > cycle)
+        return;
+    uint32_t period = noise_periods[noise.period];
+    int volume = noise_volume();
+    if(volume == 0) {
+        noise.next += ((cycle - noise.next) / period + 1) * period;
+        return;
+    }
+    int level = volume * NOISE_WEIGHT;
+    int tap = noise.short_mode ? 6 : 1;
+    while(noise.next <= cycle) {
+        uint16_t feedback = (noise.shift ^ (noise.shift >> tap)) & 0x01;
+        noise.shift = (noise.shift >> 1) | (feedback << 14);
+        mix(noise.output, noise.shift & 0x01 ? 0 : level, noise.next);
+        noise.next += period;
+    }
+}
+
+/**
+ * Each timer clock moves the level by 2 in the direction of the next bit
+ * of the sample. Every 8 bits the shifter takes the buffered byte and the
+ * next one is fetched. With nothing to play only the bit counter moves.
+ */
+void APU::run_dmc(uint64_t cycle) {
+    if(dmc.next > cycle)
+        return;
+    uint32_t period = dmc_rates[dmc.rate];
+    if(dmc.silence && !dmc.buffer_full) {
+        uint64_t steps = (cycle - dmc.next) / period + 1;
+        dmc.bits = (dmc.bits + 7 - steps % 8) % 8 + 1;
+        dmc.next += steps * period;
+        return;
+    }
+    while(dmc.next <= cycle) {
+        if(!dmc.silence) {
+            if(dmc.shifter & 0x01) {
+                if(dmc.level <= 125)
+                    dmc.level += 2;
+            } else if(dmc.level >= 2) {
+                dmc.level -= 2;
+            }
+            dmc.shifter >>= 1;
+            mix(dmc.output, dmc.level * DMC_WEIGHT, dmc.next);
+        }
+        if(--dmc.bits == 0) {
+            dmc.bits = 8;
+            dmc.silence = !dmc.buffer_full;
+            if(dmc.buffer_full) {
+                dmc.shifter = dmc.buffer;
+                dmc.buffer_full = false;
+                fetch_sample();
+            }
+        }
+        dmc.next += period;
+    }
+}
+
+/** Refills the sample buffer from the CPU's bus. The cycles the DMA steals from the CPU are not charged */
+void APU::fetch_sample() {
+    if(dmc.buffer_full || dmc.remaining == 0 || cpu == nullptr)
+        return;
+    dmc.buffer = cpu->get_bus().read8(dmc.addr);
+    dmc.buffer_full = true;
+    dmc.addr = dmc.addr == 0xFFFF ? 0x8000 : dmc.addr + 1;
+    if(--dmc.remaining > 0)
+        return;
+    if(dmc.loop) {
+        dmc.addr = dmc.sample_addr;
+        dmc.remaining = dmc.sample_length;
+    } else if(dmc.irq_enabled) {
+        dmc_irq = true;
+        update_irq();
+    }
+}
+
+void APU::run_channels(uint64_t cycle) {
+    run_pulse(pulses[0], cycle);
+    run_pulse(pulses[1], cycle);
+    run_triangle(cycle);
+    run_noise(cycle);
+    run_dmc(cycle);
+}
+
+/** Levels can also change between timer clocks, when the volume or a muting condition does */
+void APU::update_outputs(uint64_t cycle) {
+    for(Pulse& pulse : pulses)
+        mix(pulse.output, duty_cycles[pulse.duty][pulse.step] ? pulse_volume(pulse) * PULSE_WEIGHT : 0, cycle);
+    mix(noise.output, noise.shift & 0x01 ? 0 : noise_volume() * NOISE_WEIGHT, cycle);
+}
+
+uint64_t APU::frame_step_cycle() {
+    const FrameStep* sequence = five_step ? five_step_sequence : four_step_sequence;
+    return sequence_start + sequence[frame_step].cycle;
+}
+
+void APU::clock_frame_counter() {
+    const FrameStep& step = five_step ? five_step_sequence[frame_step] : four_step_sequence[frame_step];
+    if(step.actions & FRAME_QUARTER)
+        clock_quarter_frame();
+    if(step.actions & FRAME_HALF)
+        clock_half_frame();
+    if((step.actions & FRAME_IRQ) && !irq_inhibit) {
+        frame_irq = true;
+        update_irq();
+    }
+    frame_step++;
+    if(five_step && frame_step == 5) {
+        frame_step = 0;
+        sequence_start += FIVE_STEP_PERIOD;
+    } else if(!five_step && frame_step == 4) {
+        frame_step = 0;
+        sequence_start += FOUR_STEP_PERIOD;
+    }
+    update_outputs(time);
+}
+
+/** Envelopes and the triangle's linear counter */
+void APU::clock_quarter_frame() {
+    clock_envelope(pulses[0].envelope);
+    clock_envelope(pulses[1].envelope);
+    clock_envelope(noise.envelope);
+    if(triangle.linear_reload)
+        triangle.linear = triangle.linear_period;
+    else if(triangle.linear > 0)
+        triangle.linear--;
+    if(!triangle.control)
+        triangle.linear_reload = false;
+}
+
+/** Length counters and sweeps */
+void APU::clock_half_frame() {
+    for(Pulse& pulse : pulses) {
+        if(pulse.length > 0 && !pulse.envelope.loop)
+            pulse.length--;
+        clock_sweep(pulse);
+    }
+    if(triangle.length > 0 && !triangle.control)
+        triangle.length--;
+    if(noise.length > 0 && !noise.envelope.loop)
+        noise.length--;
+}
+
+void APU::clock_envelope(Envelope& envelope) {
+    if(envelope.start) {
+        envelope.start = false;
+        envelope.decay = 15;
+        envelope.divider = envelope.period;
+    } else if(envelope.divider > 0) {
+        envelope.divider--;
+    } else {
+        envelope.divider = envelope.period;
+        if(envelope.decay > 0)
+            envelope.decay--;
+        else if(envelope.loop)
+            envelope.decay = 15;
+    }
+}
+
+void APU::clock_sweep(Pulse& pulse) {
+    int target = sweep_target(pulse);
+    if(pulse.sweep_divider == 0 && pulse.sweep_enabled && pulse.sweep_shift > 0
+       && pulse.timer >= 8 && target <= 0x07FF)
+        pulse.timer = target;
+    if(pulse.sweep_divider == 0 || pulse.sweep_reload) {
+        pulse.sweep_divider = pulse.sweep_period;
+        pulse.sweep_reload = false;
+    } else {
+        pulse.sweep_divider--;
+    }
+}
+
+/**
+ * CPU cycle of the fetch that empties a non looping sample: the shifter
+ * takes the buffered byte when its bits run out, which fetches the next
+ * one, and after that a byte goes every 8 timer clocks.
+ */
+uint64_t APU::dmc_end_cycle() {
+    uint64_t period = dmc_rates[dmc.rate];
+    return dmc.next + (dmc.bits - 1) * period + (uint64_t)(dmc.remaining - 1) * 8 * period;
+}
+
+/**
+ * The APU only needs to be run on time for its IRQs. Everything else the
+ * CPU can see goes through $4015, which catches up first.
+ */
+void APU::schedule_event() {
+    if(cpu == nullptr)
+        return;
+    uint64_t next = NO_EVENT;
+    if(!five_step && !irq_inhibit && !frame_irq)
+        next = sequence_start + four_step_sequence[3].cycle;
+    if(dmc.irq_enabled && !dmc.loop && !dmc_irq && dmc.remaining > 0)
+        next = std::min(next, dmc_end_cycle());
+    cpu->get_scheduler().schedule(event, next);
+}
+
+void APU::on_event(void* apu, uint64_t now) {
+    APU* self = (APU*)apu;
+    self->run(now);
+    self->schedule_event();
+}
+
+/** Frame counter steps in between are run in order with the channels */
+void APU::run(uint64_t cycle) {
+    if(cycle <= time)
+        return;
+    for(uint64_t step = frame_step_cycle(); step <= cycle; step = frame_step_cycle()) {
+        run_channels(step);
+        time = step;
+        clock_frame_counter();
+    }
+    run_channels(cycle);
+    time = cycle;
+}
+
+void APU::end_frame(uint64_t cycle) {
+    run(cycle);
+    blip.end_frame(cycle - frame_start);
+    frame_start = cycle;
+    samples.resize(blip.samples_available());
+    blip.read_samples(samples.data(), samples.size());
+}
+
+const int16_t* APU::get_samples() {
+    return samples.data();
+}
+
+size_t APU::get_sample_count() {
+    return samples.size();
+}
+
+template<typename State> void APU::serialize_envelope(State& state, Envelope& envelope) {
+    state.value(envelope.start);
+    state.value(envelope.loop);
+    state.value(envelope.constant);
+    state.value(envelope.period);
+    state.value(envelope.divider);
+    state.value(envelope.decay);
+}
+
+template<typename State> void APU::serialize_pulse(State& state, Pulse& pulse) {
+    state.value(pulse.enabled);
+    state.value(pulse.duty);
+    state.value(pulse.step);
+    state.value(pulse.timer);
+    state.value(pulse.length);
+    serialize_envelope(state, pulse.envelope);
+    state.value(pulse.sweep_enabled);
+    state.value(pulse.sweep_negate);
+    state.value(pulse.sweep_reload);
+    state.value(pulse.negate_offset);
+    state.value(pulse.sweep_period);
+    state.value(pulse.sweep_shift);
+    state.value(pulse.sweep_divider);
+    state.value(pulse.next);
+    state.value(pulse.output);
+}
+
+template<typename State> void APU::serialize(State& state) {
+    serialize_pulse(state, pulses[0]);
+    serialize_pulse(state, pulses[1]);
+
+    state.value(triangle.enabled);
+    state.value(triangle.control);
+    state.value(triangle.step);
+    state.value(triangle.timer);
+    state.value(triangle.length);
+    state.value(triangle.linear);
+    state.value(triangle.linear_period);
+    state.value(triangle.linear_reload);
+    state.value(triangle.next);
+    state.value(triangle.output);
+
+    state.value(noise.enabled);
+    state.value(noise.short_mode);
+    state.value(noise.period);
+    state.value(noise.shift);
+    state.value(noise.length);
+    serialize_envelope(state, noise.envelope);
+    state.value(noise.next);
+    state.value(noise.output);
+
+    state.value(dmc.irq_enabled);
+    state.value(dmc.loop);
+    state.value(dmc.rate);
+    state.value(dmc.level);
+    state.value(dmc.sample_addr);
+    state.value(dmc.sample_length);
+    state.value(dmc.addr);
+    state.value(dmc.remaining);
+    state.value(dmc.buffer);
+    state.value(dmc.buffer_full);
+    state.value(dmc.shifter);
+    state.value(dmc.bits);
+    state.value(dmc.silence);
+    state.value(dmc.next);
+    state.value(dmc.output);
+
+    state.value(five_step);
+    state.value(irq_inhibit);
+    state.value(frame_irq);
+    state.value(dmc_irq);
+    state.value(irq);
+    state.value(frame_step);
+    state.value(sequence_start);
+    state.value(time);
+    state.value(frame_start);
+}
+
+void APU::save_state(StateWriter& state) {
+    serialize(state);
+    blip.save_state(state);
+}
+
+/**
+ * The IRQ line is restored without calling the handler, the CPU restores its
+ * own side. The CPU is loaded first, and the APU's times have to be behind
+ * its cycle count by no more than the BlipBuffer and the frame counter's
+ * sequence can span.
+ */
+void APU::load_state(StateReader& state) {
+    serialize(state);
+    blip.load_state(state);
+    if(noise.period > 15 || dmc.rate > 15 || pulses[0].duty > 3 || pulses[1].duty > 3)
+        state.fail();
+    if(pulses[0].step > 7 || pulses[1].step > 7 || triangle.step > 31)
+        state.fail();
+    if(frame_step < 0 || frame_step > (five_step ? 4 : 3))
+        state.fail();
+    uint64_t cycles = cpu != nullptr ? cpu->get_cycles() : time;
+    if(frame_start > time || time > cycles || cycles - frame_start > blip.get_max_time())
+        state.fail();
+    if(sequence_start > time + FIVE_STEP_PERIOD || time > sequence_start + FIVE_STEP_PERIOD)
+        state.fail();
+}
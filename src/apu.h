@@ -0,0 +1,180 @@
+#ifndef NESEMU_APU_H
+#define NESEMU_APU_H
+
+#include <cstdint>
+#include <vector>
+
+#include "blip_buffer.h"
+#include "cpu.h"
+
+#define CPU_CLOCK_RATE 1789773
+#define SAMPLE_RATE 44100
+
+/**
+ * The audio processing unit: two pulse channels, a triangle, noise and the
+ * delta modulation channel (DMC), sequenced by the frame counter. Like the
+ * PPU it runs behind the CPU and catches up when a register is accessed,
+ * when one of its IRQs is due or at the end of a frame. Each channel runs
+ * its timer a period at a time rather than a cycle at a time, and only
+ * sends its level to the BlipBuffer when it changes. Channels that are
+ * silent skip their periods in one step.
+ *
+ * The channels are mixed linearly, with the weights the hardware's
+ * nonlinear mixer has at low levels, so each one can add its own steps.
+ */
+class APU {
+public:
+    /** Called with the new level when the frame counter or DMC raises or releases the CPU IRQ line */
+    typedef void (*IrqHandler)(void* context, bool asserted);
+
+private:
+    typedef struct envelope {
+        bool start;
+        bool loop;          // Also halts the length counter
+        bool constant;
+        uint8_t period;     // Also the volume when constant
+        uint8_t divider;
+        uint8_t decay;
+    } Envelope;
+
+    typedef struct pulse {
+        bool enabled;
+        uint8_t duty;
+        uint8_t step;       // Position in the 8 step duty cycle
+        uint16_t timer;     // Period in APU cycles (two CPU cycles), minus one
+        uint8_t length;
+        Envelope envelope;
+        bool sweep_enabled;
+        bool sweep_negate;
+        bool sweep_reload;
+        uint8_t negate_offset;  // 1 on the first pulse, whose sweep negates in ones' complement
+        uint8_t sweep_period;
+        uint8_t sweep_shift;
+        uint8_t sweep_divider;
+        uint64_t next;      // CPU cycle of the next timer clock
+        int output;         // Weighted level last sent to the buffer
+    } Pulse;
+
+    typedef struct triangle {
+        bool enabled;
+        bool control;       // Also halts the length counter
+        uint8_t step;       // Position in the 32 step waveform
+        uint16_t timer;     // Period in CPU cycles, minus one
+        uint8_t length;
+        uint8_t linear;
+        uint8_t linear_period;
+        bool linear_reload;
+        uint64_t next;
+        int output;
+    } Triangle;
+
+    typedef struct noise {
+        bool enabled;
+        bool short_mode;
+        uint8_t period;     // Index into the period table
+        uint16_t shift;     // 15 bit LFSR
+        uint8_t length;
+        Envelope envelope;
+        uint64_t next;
+        int output;
+    } Noise;
+
+    typedef struct dmc {
+        bool irq_enabled;
+        bool loop;
+        uint8_t rate;       // Index into the rate table
+        uint8_t level;      // 7 bit output level
+        uint16_t sample_addr;
+        uint16_t sample_length;
+        uint16_t addr;
+        uint16_t remaining; // Bytes of the sample still to be fetched
+        uint8_t buffer;
+        bool buffer_full;
+        uint8_t shifter;
+        uint8_t bits;       // Bits left in the shifter
+        bool silence;
+        uint64_t next;
+        int output;
+    } Dmc;
+
+    CPU* cpu;
+    Pulse pulses[2];
+    Triangle triangle;
+    Noise noise;
+    Dmc dmc;
+
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    bool dmc_irq;
+    bool irq;
+    int frame_step;         // Next step of the frame counter's sequence
+    uint64_t sequence_start;    // CPU cycle the current sequence started at
+    int event;
+
+    uint64_t time;          // CPU cycle the APU has run to
+    uint64_t frame_start;   // CPU cycle the BlipBuffer's frame started at
+    BlipBuffer blip;
+    std::vector<int16_t> samples;
+
+    IrqHandler irq_handler;
+    void* irq_context;
+
+    void mix(int& output, int level, uint64_t cycle);
+    int pulse_volume(Pulse& pulse);
+    int noise_volume();
+    void run_pulse(Pulse& pulse, uint64_t cycle);
+    void run_triangle(uint64_t cycle);
+    void run_noise(uint64_t cycle);
+    void run_dmc(uint64_t cycle);
+    void fetch_sample();
+    void run_channels(uint64_t cycle);
+    void update_outputs(uint64_t cycle);
+
+    uint64_t frame_step_cycle();
+    void clock_frame_counter();
+    void clock_quarter_frame();
+    void clock_half_frame();
+    void clock_envelope(Envelope& envelope);
+    void clock_sweep(Pulse& pulse);
+    int sweep_target(Pulse& pulse);
+    uint64_t dmc_end_cycle();
+    void update_irq();
+    void schedule_event();
+
+    template<typename State> void serialize_envelope(State& state, Envelope& envelope);
+    template<typename State> void serialize_pulse(State& state, Pulse& pulse);
+    template<typename State> void serialize(State& state);
+
+    static uint8_t read_register(void* apu, uint16_t addr);
+    static void write_register(void* apu, uint16_t addr, uint8_t value);
+    static void on_event(void* apu, uint64_t now);
+
+public:
+    APU();
+
+    /** Maps the registers at $4000-$4013, $4015 and $4017 into the CPU's bus and reads DMC samples from it */
+    void attach(CPU& cpu);
+    void reset();
+    void set_irq_handler(IrqHandler handler, void* context);
+
+    uint8_t read(uint16_t addr);
+    void write(uint16_t addr, uint8_t value);
+
+    /** Catches up with the CPU: runs everything up to a CPU cycle */
+    void run(uint64_t cycle);
+    /** Runs up to a CPU cycle and turns everything since the last call into samples */
+    void end_frame(uint64_t cycle);
+    /** The samples made by the last end_frame(), mono 16 bit at SAMPLE_RATE */
+    const int16_t* get_samples();
+    size_t get_sample_count();
+    /** True while the frame counter or DMC holds the CPU IRQ line low */
+    bool irq_pending();
+
+    /** Channels, frame counter and the samples of the frame in progress */
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
+};
+
+
+#endif //NESEMU_APU_H
@@ -0,0 +1,170 @@
+#include "batch.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "input_script.h"
+#include "nes.h"
+#include "rom_cache.h"
+#include "wav.h"
+
+static bool parse_count(const std::string& text, uint64_t& count) {
+    char* end;
+    count = strtoull(text.c_str(), &end, 10);
+    return !text.empty() && *end == '\0';
+}
+
+bool parse_batch_manifest(const char* filename, std::vector<BatchJob>& jobs) {
+    std::ifstream file(filename);
+    if(!file) {
+        perror(filename);
+        return false;
+    }
+
+    std::string text;
+    for(int line=1; std::getline(file, text); line++) {
+        text = text.substr(0, text.find('#'));
+        std::stringstream fields(text);
+        std::string field;
+        BatchJob job = {};
+        job.line = line;
+        bool empty = true;
+        while(fields >> field) {
+            empty = false;
+            size_t split = field.find('=');
+            std::string key = field.substr(0, split);
+            std::string value = split == std::string::npos ? "" : field.substr(split + 1);
+            bool valid = !value.empty();
+            if(key == "rom")
+                job.rom = value;
+            else if(key == "input")
+                job.input = value;
+            else if(key == "frames")
+                valid = parse_count(value, job.frames);
+            else if(key == "cycles")
+                valid = parse_count(value, job.cycles);
+            else if(key == "screenshot")
+                job.screenshot = value;
+            else if(key == "state")
+                job.state = value;
+            else if(key == "wav")
+                job.wav = value;
+            else
+                valid = false;
+            if(!valid) {
+                fprintf(stderr, "%s:%d: bad field '%s'\n", filename, line, field.c_str());
+                return false;
+            }
+        }
+        if(empty)
+            continue;
+        if(job.rom.empty() || (job.frames == 0 && job.cycles == 0)) {
+            fprintf(stderr, "%s:%d: a job needs a rom and a frames or cycles budget\n", filename, line);
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+static void fail_job(BatchJob& job, const std::string& error) {
+    job.ok = false;
+    job.error = error;
+}
+
+void run_batch_job(BatchJob& job) {
+    auto start = std::chrono::steady_clock::now();
+    job.ok = true;
+    job.stop = CPU::STOP_NONE;
+    job.frames_run = 0;
+    job.cycles_run = 0;
+    job.seconds = 0;
+
+    std::shared_ptr<ROM> rom = RomCache::get().load(job.rom.c_str());
+    if(!rom->ok())
+        return fail_job(job, rom->get_error());
+    if(!Mapper::is_supported(rom->get_mapper()))
+        return fail_job(job, "mapper " + std::to_string(rom->get_mapper()) + " is not supported");
+    InputScript input;
+    if(!job.input.empty() && !input.load(job.input.c_str()))
+        return fail_job(job, input.get_error());
+
+    NES nes(rom);
+    CPU& cpu = nes.get_cpu();
+    std::unique_ptr<WavWriter> wav_writer;
+    if(!job.wav.empty()) {
+        wav_writer.reset(new WavWriter(job.wav.c_str(), SAMPLE_RATE));
+        if(!wav_writer->is_open())
+            return fail_job(job, "cannot write " + job.wav);
+    }
+
+    uint64_t start_cycles = cpu.get_cycles();
+    while((job.frames == 0 || job.frames_run < job.frames)
+          && (job.cycles == 0 || cpu.get_cycles() - start_cycles < job.cycles)) {
+        input.apply(job.frames_run, nes.get_controller());
+        job.stop = nes.run_frame();
+        if(job.stop != CPU::STOP_FRAME_COMPLETE)
+            break;
+        job.frames_run++;
+        if(wav_writer != nullptr)
+            wav_writer->write(nes.get_apu().get_samples(), nes.get_apu().get_sample_count());
+    }
+    job.cycles_run = cpu.get_cycles() - start_cycles;
+    wav_writer.reset();
+
+    if(!job.screenshot.empty() && !nes.get_ppu().save_frame(job.screenshot.c_str()))
+        fail_job(job, "cannot write " + job.screenshot);
+    if(!job.state.empty() && !nes.save_state_file(job.state.c_str()))
+        fail_job(job, "cannot write " + job.state);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    job.seconds = elapsed.count();
+}
+
+BatchRunner::BatchRunner(int threads) {
+    if(threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    this->threads = threads > 0 ? threads : 1;
+    queues.reset(new Queue[this->threads]);
+}
+
+/** The worker's own queue from the front, then the others' from the back */
+BatchJob* BatchRunner::take(int worker) {
+    for(int i=0; i<threads; i++) {
+        Queue& queue = queues[(worker + i) % threads];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if(queue.jobs.empty())
+            continue;
+        BatchJob* job;
+        if(i == 0) {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        } else {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+        }
+        return job;
+    }
+    return nullptr;
+}
+
+/** No jobs are added once the workers start, so every queue being empty means done */
+void BatchRunner::work(int worker) {
+    for(BatchJob* job = take(worker); job != nullptr; job = take(worker))
+        run_batch_job(*job);
+}
+
+void BatchRunner::run(std::vector<BatchJob>& jobs) {
+    for(size_t i=0; i<jobs.size(); i++)
+        queues[i % threads].jobs.push_back(&jobs[i]);
+
+    std::vector<std::thread> workers;
+    for(int worker=1; worker<threads; worker++)
+        workers.emplace_back(&BatchRunner::work, this, worker);
+    work(0);
+    for(std::thread& thread : workers)
+        thread.join();
+}
@@ -0,0 +1,80 @@
+#ifndef NESEMU_BATCH_H
+#define NESEMU_BATCH_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+
+/**
+ * One run of a game: a ROM, the input to play it with, how long to run it
+ * and what to write out at the end. The results are filled in by
+ * run_batch_job().
+ */
+typedef struct batch_job {
+    int line;                   // In the manifest
+    std::string rom;
+    std::string input;          // Input script, empty for none
+    uint64_t frames;            // Frame budget, 0 for none
+    uint64_t cycles;            // CPU cycle budget, checked between frames, 0 for none
+    std::string screenshot;     // Outputs, empty for none
+    std::string state;
+    std::string wav;
+
+    bool ok;
+    std::string error;
+    CPU::StopReason stop;
+    uint64_t frames_run;
+    uint64_t cycles_run;
+    double seconds;
+} BatchJob;
+
+/**
+ * Reads a manifest of jobs, one per line as key=value fields:
+ *
+ *     rom=game.nes input=game.inp frames=3600 screenshot=game.ppm
+ *
+ * The keys are rom, input, frames, cycles, screenshot, state and wav. Every
+ * job needs a rom and a frames or cycles budget. Blank lines and everything
+ * after a '#' are skipped. Prints the first error to stderr and returns false.
+ */
+bool parse_batch_manifest(const char* filename, std::vector<BatchJob>& jobs);
+
+/**
+ * Runs a job on the calling thread with a machine of its own. Only the ROM
+ * is shared with other jobs, read only, through the RomCache.
+ */
+void run_batch_job(BatchJob& job);
+
+/**
+ * Runs jobs on a pool of threads. Each thread has a queue of jobs dealt out
+ * round robin, and once its own queue is empty it steals from the back of
+ * the others', so long jobs do not leave threads idle at the end.
+ */
+class BatchRunner {
+private:
+    typedef struct queue {
+        std::mutex lock;
+        std::deque<BatchJob*> jobs;
+    } Queue;
+
+    int threads;
+    std::unique_ptr<Queue[]> queues;
+
+    BatchJob* take(int worker);
+    void work(int worker);
+
+public:
+    /** threads 0 uses one per hardware thread */
+    BatchRunner(int threads = 0);
+
+    /** Runs every job and returns once all are done */
+    void run(std::vector<BatchJob>& jobs);
+};
+
+
+#endif //NESEMU_BATCH_H
@@ -0,0 +1,122 @@
+#include "blip_buffer.h"
+
+#include <cmath>
+#include <cstring>
+
+#define BLIP_CUTOFF 0.45        // Of the sample rate, just below Nyquist
+#define BLIP_BASS_SHIFT 9       // High pass cutoff, about sample rate / 3200
+
+/**
+ * Kernels for each sub-sample phase: the impulse of a band limited step,
+ * which is a Blackman windowed sinc. Every phase is normalized to sum to
+ * exactly 1 << BLIP_KERNEL_BITS, so a step always settles at its delta.
+ */
+typedef struct kernel {
+    int16_t taps[BLIP_PHASES][BLIP_TAPS];
+
+    kernel() {
+        for(int phase=0; phase<BLIP_PHASES; phase++) {
+            double weights[BLIP_TAPS];
+            double sum = 0;
+            for(int i=0; i<BLIP_TAPS; i++) {
+                double x = i - BLIP_TAPS / 2 + 1 - (double)phase / BLIP_PHASES;
+                double w = (i + 1 - (double)phase / BLIP_PHASES) / BLIP_TAPS;
+                double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+                double sinc = x == 0 ? 1 : sin(M_PI * 2 * BLIP_CUTOFF * x) / (M_PI * 2 * BLIP_CUTOFF * x);
+                weights[i] = sinc * window;
+                sum += weights[i];
+            }
+            int total = 0;
+            for(int i=0; i<BLIP_TAPS; i++) {
+                taps[phase][i] = (int16_t)lround(weights[i] / sum * (1 << BLIP_KERNEL_BITS));
+                total += taps[phase][i];
+            }
+            // Rounding leftovers go to the center tap
+            taps[phase][BLIP_TAPS / 2 - 1] += (1 << BLIP_KERNEL_BITS) - total;
+        }
+    }
+} Kernel;
+
+static const Kernel kernel;
+
+BlipBuffer::BlipBuffer(double clock_rate, int sample_rate, int max_samples) {
+    factor = (uint64_t)((double)sample_rate / clock_rate * ((uint64_t)1 << BLIP_TIME_BITS) + 0.5);
+    buffer.resize(max_samples + BLIP_TAPS);
+    clear();
+}
+
+void BlipBuffer::clear() {
+    offset = 0;
+    integrator = 0;
+    memset(buffer.data(), 0, buffer.size() * sizeof(int32_t));
+}
+
+void BlipBuffer::add_delta(uint32_t time, int delta) {
+    uint64_t position = offset + time * factor;
+    if(position >> BLIP_TIME_BITS > buffer.size() - BLIP_TAPS)
+        return;
+    int32_t* out = &buffer[position >> BLIP_TIME_BITS];
+    const int16_t* taps = kernel.taps[(position >> (BLIP_TIME_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    for(int i=0; i<BLIP_TAPS; i++)
+        out[i] += taps[i] * delta;
+}
+
+uint64_t BlipBuffer::get_max_time() {
+    uint64_t end = (uint64_t)(buffer.size() - BLIP_TAPS) << BLIP_TIME_BITS;
+    return offset > end ? 0 : (end - offset) / factor;
+}
+
+/** A frame too long for the buffer is cut at its end */
+void BlipBuffer::end_frame(uint32_t time) {
+    uint64_t max_time = get_max_time();
+    offset += (time < max_time ? time : max_time) * factor;
+}
+
+int BlipBuffer::samples_available() {
+    return offset >> BLIP_TIME_BITS;
+}
+
+int BlipBuffer::read_samples(int16_t* out, int count) {
+    int available = samples_available();
+    if(count > available)
+        count = available;
+    for(int i=0; i<count; i++) {
+        integrator += buffer[i];
+        int32_t sample = integrator >> BLIP_KERNEL_BITS;
+        integrator -= sample * (1 << (BLIP_KERNEL_BITS - BLIP_BASS_SHIFT));
+        if(sample > INT16_MAX)
+            sample = INT16_MAX;
+        else if(sample < INT16_MIN)
+            sample = INT16_MIN;
+        out[i] = sample;
+    }
+
+    // Kernels of the next frame's early steps reach into the tail
+    int remaining = available - count + BLIP_TAPS;
+    memmove(buffer.data(), &buffer[count], remaining * sizeof(int32_t));
+    memset(&buffer[remaining], 0, count * sizeof(int32_t));
+    offset -= (uint64_t)count << BLIP_TIME_BITS;
+    return count;
+}
+
+template<typename State> void BlipBuffer::serialize(State& state) {
+    state.value(offset);
+    state.value(integrator);
+    uint32_t size = buffer.size();
+    state.value(size);
+    if(size != buffer.size()) {
+        state.fail();
+        return;
+    }
+    state.bytes(buffer.data(), size * sizeof(int32_t));
+}
+
+void BlipBuffer::save_state(StateWriter& state) {
+    serialize(state);
+}
+
+void BlipBuffer::load_state(StateReader& state) {
+    serialize(state);
+    if(offset >> BLIP_TIME_BITS > buffer.size() - BLIP_TAPS)
+        state.fail();
+}
@@ -0,0 +1,60 @@
+#ifndef NESEMU_BLIP_BUFFER_H
+#define NESEMU_BLIP_BUFFER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "state.h"
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS 16
+#define BLIP_KERNEL_BITS 12    // Each kernel phase sums to 1 << BLIP_KERNEL_BITS
+#define BLIP_TIME_BITS 32      // Fraction bits of sample positions
+
+/**
+ * Band limited synthesis of a signal made of steps. Sound chips only
+ * change their output level now and then, so instead of generating every
+ * clock and filtering that down, each change is added as a band limited
+ * step at its exact time: a windowed sinc kernel picked from BLIP_PHASES
+ * sub-sample positions. The buffer holds the kernels' sums and reading
+ * integrates them into samples, with a high pass that removes the DC
+ * offset. Work is proportional to the number of changes, not the clock.
+ *
+ * Times are in clocks since the start of the frame. end_frame() makes the
+ * frame's samples available and starts the next frame where it ended.
+ */
+class BlipBuffer {
+private:
+    uint64_t factor;    // Sample positions per clock
+    uint64_t offset;    // Sample position of the start of the frame
+    int32_t integrator;
+    std::vector<int32_t> buffer;
+
+    template<typename State> void serialize(State& state);
+
+public:
+    /** Holds up to max_samples samples, frames must not run past them */
+    BlipBuffer(double clock_rate, int sample_rate, int max_samples);
+
+    void clear();
+    /** Adds a step of delta at a time in the current frame, steps past get_max_time() are dropped */
+    void add_delta(uint32_t time, int delta);
+    /** Latest time in the current frame that still fits the buffer */
+    uint64_t get_max_time();
+    /** Ends the frame at a time, at most get_max_time(), after which its samples can be read */
+    void end_frame(uint32_t time);
+    int samples_available();
+    /** Reads up to count samples, returns how many were read */
+    int read_samples(int16_t* out, int count);
+
+    /**
+     * The frame so far and the kernel tails reaching past it, for buffers of
+     * the same size. A frame start past the end of the buffer fails the load.
+     */
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
+};
+
+
+#endif //NESEMU_BLIP_BUFFER_H
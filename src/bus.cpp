@@ -0,0 +1,44 @@
+#include "bus.h"
+
+Bus::Bus() {
+    for(int page=0; page<0x100; page++) {
+        read_pages[page] = nullptr;
+        write_pages[page] = nullptr;
+    }
+}
+
+void Bus::map_memory(uint16_t start, uint16_t end, uint8_t* memory, uint32_t size, bool writable) {
+    for(int page=start>>8; page<=end>>8; page++) {
+        uint8_t* ptr = &memory[((page << 8) - start) % size];
+        read_pages[page] = ptr;
+        write_pages[page] = writable ? ptr : nullptr;
+    }
+}
+
+void Bus::unmap_memory(uint16_t start, uint16_t end) {
+    for(int page=start>>8; page<=end>>8; page++) {
+        read_pages[page] = nullptr;
+        write_pages[page] = nullptr;
+    }
+}
+
+void Bus::map_io(uint16_t start, uint16_t end, ReadHandler read, WriteHandler write, void* context) {
+    regions.push_back({start, end, read, write, context});
+}
+
+uint8_t Bus::read_io(uint16_t addr) {
+    for(auto region = regions.rbegin(); region != regions.rend(); ++region) {
+        if(region->start <= addr && addr <= region->end && region->read != nullptr)
+            return region->read(region->context, addr);
+    }
+    return 0;   // Open bus
+}
+
+void Bus::write_io(uint16_t addr, uint8_t value) {
+    for(auto region = regions.rbegin(); region != regions.rend(); ++region) {
+        if(region->start <= addr && addr <= region->end && region->write != nullptr) {
+            region->write(region->context, addr, value);
+            return;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef NESEMU_BUS_H
+#define NESEMU_BUS_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * The CPU address space. Reads and writes are resolved through a table of
+ * 256 byte pages: pages backed by plain memory (RAM, PRG ROM) hold a direct
+ * pointer and cost a single load, everything else falls back to the read
+ * and write handlers registered for the address, so registers can have side
+ * effects. Reads and writes are mapped separately, which lets ROM be read
+ * directly while writes to it reach a mapper.
+ */
+class Bus {
+public:
+    typedef uint8_t (*ReadHandler)(void* context, uint16_t addr);
+    typedef void (*WriteHandler)(void* context, uint16_t addr, uint8_t value);
+
+private:
+    typedef struct io_region {
+        uint16_t start;
+        uint16_t end;
+        ReadHandler read;
+        WriteHandler write;
+        void* context;
+    } IoRegion;
+
+    uint8_t* read_pages[0x100];
+    uint8_t* write_pages[0x100];
+    /** Handlers for everything that is not plain memory, searched newest first */
+    std::vector<IoRegion> regions;
+
+    uint8_t read_io(uint16_t addr);
+    void write_io(uint16_t addr, uint8_t value);
+
+public:
+    Bus();
+
+    /**
+     * Maps the pages from start to end (both page aligned, end inclusive) to
+     * memory, mirroring it every size bytes. Read only memory ignores writes
+     * unless a write handler covers it.
+     */
+    void map_memory(uint16_t start, uint16_t end, uint8_t* memory, uint32_t size, bool writable);
+    /** Removes the direct mapping of the pages from start to end */
+    void unmap_memory(uint16_t start, uint16_t end);
+    /**
+     * Routes accesses from start to end that do not hit plain memory to the
+     * given handlers. Either handler may be null. Later registrations take
+     * precedence over earlier ones.
+     */
+    void map_io(uint16_t start, uint16_t end, ReadHandler read, WriteHandler write, void* context);
+
+    uint8_t read8(uint16_t addr) {
+        uint8_t* page = read_pages[addr >> 8];
+        if(page != nullptr)
+            return page[addr & 0xFF];
+        return read_io(addr);
+    }
+
+    void write8(uint16_t addr, uint8_t value) {
+        uint8_t* page = write_pages[addr >> 8];
+        if(page != nullptr)
+            page[addr & 0xFF] = value;
+        else
+            write_io(addr, value);
+    }
+
+    /** Little endian word at addr and addr + 1, without wrapping around the page */
+    uint16_t read16(uint16_t addr) {
+        return read8(addr) | (read8(addr + 1) << 8);
+    }
+
+    /**
+     * Direct pointer to count bytes of plain memory starting at addr, or null
+     * if they are not all on the same directly mapped page.
+     */
+    uint8_t* read_ptr(uint16_t addr, int count) {
+        uint8_t* page = read_pages[addr >> 8];
+        if(page == nullptr || (addr & 0xFF) + count > 0x100)
+            return nullptr;
+        return page + (addr & 0xFF);
+    }
+
+    /** The page tables, for generated code that indexes them itself */
+    uint8_t* const* get_read_pages() {
+        return read_pages;
+    }
+
+    uint8_t* const* get_write_pages() {
+        return write_pages;
+    }
+
+    /** Direct pointer to the byte at addr if writes to it go straight to memory, or null */
+    uint8_t* write_ptr(uint16_t addr) {
+        uint8_t* page = write_pages[addr >> 8];
+        return page == nullptr ? nullptr : page + (addr & 0xFF);
+    }
+};
+
+
+#endif //NESEMU_BUS_H
@@ -0,0 +1,64 @@
+#include "controller.h"
+
+#define OPEN_BUS 0x40      // Bits 5-7 are open bus, usually the $40 of the address
+
+Controller::Controller() {
+    reset();
+}
+
+void Controller::attach(CPU& cpu) {
+    cpu.get_bus().map_io(0x4016, 0x4016, read_register, write_register, this);
+    cpu.get_bus().map_io(0x4017, 0x4017, read_register, nullptr, this);
+}
+
+void Controller::reset() {
+    for(int port=0; port<CONTROLLER_PORTS; port++) {
+        buttons[port] = 0;
+        shift[port] = 0;
+    }
+    strobe = false;
+}
+
+void Controller::set_buttons(int port, uint8_t buttons) {
+    this->buttons[port] = buttons;
+    if(strobe)
+        shift[port] = buttons;
+}
+
+uint8_t Controller::read_register(void* controller, uint16_t addr) {
+    return ((Controller*)controller)->read(addr);
+}
+
+void Controller::write_register(void* controller, uint16_t addr, uint8_t value) {
+    ((Controller*)controller)->write(value);
+}
+
+uint8_t Controller::read(uint16_t addr) {
+    int port = addr & 0x01;
+    uint8_t bit = shift[port] & 0x01;
+    if(!strobe)
+        shift[port] = (shift[port] >> 1) | 0x80;
+    return OPEN_BUS | bit;
+}
+
+void Controller::write(uint8_t value) {
+    strobe = value & 0x01;
+    if(strobe) {
+        for(int port=0; port<CONTROLLER_PORTS; port++)
+            shift[port] = buttons[port];
+    }
+}
+
+template<typename State> void Controller::serialize(State& state) {
+    state.bytes(buttons, sizeof(buttons));
+    state.bytes(shift, sizeof(shift));
+    state.value(strobe);
+}
+
+void Controller::save_state(StateWriter& state) {
+    serialize(state);
+}
+
+void Controller::load_state(StateReader& state) {
+    serialize(state);
+}
@@ -0,0 +1,56 @@
+#ifndef NESEMU_CONTROLLER_H
+#define NESEMU_CONTROLLER_H
+
+#include <cstdint>
+
+#include "cpu.h"
+#include "state.h"
+
+#define CONTROLLER_PORTS 2
+
+/**
+ * The two standard controllers at $4016 and $4017. Writing bit 0 of $4016
+ * latches the buttons of both, and each read then shifts out the next
+ * button of one pad, A first. Past the eighth read a pad returns 1s.
+ */
+class Controller {
+public:
+    enum Button {
+        BUTTON_A = 0x01,
+        BUTTON_B = 0x02,
+        BUTTON_SELECT = 0x04,
+        BUTTON_START = 0x08,
+        BUTTON_UP = 0x10,
+        BUTTON_DOWN = 0x20,
+        BUTTON_LEFT = 0x40,
+        BUTTON_RIGHT = 0x80,
+    };
+
+private:
+    uint8_t buttons[CONTROLLER_PORTS];  // Held now
+    uint8_t shift[CONTROLLER_PORTS];    // Latched, next bit to read in bit 0
+    bool strobe;                        // While set the buttons are latched continuously
+
+    template<typename State> void serialize(State& state);
+
+    static uint8_t read_register(void* controller, uint16_t addr);
+    static void write_register(void* controller, uint16_t addr, uint8_t value);
+
+public:
+    Controller();
+
+    /** Maps $4016 and the read side of $4017, whose writes stay with the APU */
+    void attach(CPU& cpu);
+    void reset();
+    /** Sets the held buttons of a pad, a mask of Button */
+    void set_buttons(int port, uint8_t buttons);
+
+    uint8_t read(uint16_t addr);
+    void write(uint8_t value);
+
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
+};
+
+
+#endif //NESEMU_CONTROLLER_H
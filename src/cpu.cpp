@@ -1,12 +1,31 @@
 #include "cpu.h"
+#include "jit.h"
+#include "opcodes.h"
 
-#include <iostream>
 #include <cstring>
+#include <iostream>
 
-#define PC_INIT_ADDR 0xC000
 #define REG_INIT 0x00
-#define STACK_INIT 0xFD
 #define STATUS_INIT 0x24
+#define RESET_CYCLES 7
+#define RAM_MIRROR_SIZE 0x0800
+
+#define NMI_VECTOR 0xFFFA
+#define RESET_VECTOR 0xFFFC
+#define IRQ_VECTOR 0xFFFE
+#define INTERRUPT_CYCLES 7
+
+#ifdef __GNUC__
+#define FLATTEN __attribute__((flatten))
+#else
+#define FLATTEN
+#endif
+
+#ifdef NESEMU_THREADED
+#define DEFAULT_ENGINE ENGINE_THREADED
+#else
+#define DEFAULT_ENGINE ENGINE_TABLE
+#endif
 
 
 uint16_t fix_endian(uint8_t* bin) {
@@ -17,660 +36,705 @@ uint8_t sign_bit(uint8_t byte) {
     return (byte >> 7) & 0x01;
 }
 
-CPU::CPU(RAM& ram, ROM& rom): ram(ram), rom(rom){
-    ppu_reg = new uint8_t[0x0008];
-    apu_io_reg = new uint8_t[0x0018];
-    apu_io_test = new uint8_t[0x0008];
-    cart_space = new uint8_t[0xBFE0];
+uint8_t page_crossed(uint16_t from, uint16_t to) {
+    return (from ^ to) >> 8 != 0;
+}
+
+CPU::CPU(RAM& ram): ram(ram) {
+    map_memory();
 
-    pc = PC_INIT_ADDR;
+    pc = REG_INIT;
     a = REG_INIT;
     x = REG_INIT;
     y = REG_INIT;
-    sp = STACK_INIT;
+    sp = REG_INIT;
     status.sr = STATUS_INIT;
+    cycles = RESET_CYCLES;
+
+    engine = DEFAULT_ENGINE;
+    run_deadline = 0;
+    deadline = 0;
+    scheduler.set_wake_handler(wake, this);
+    breakpoint_armed = true;
+    attention = 0;
+    trace_sink = nullptr;
+    jit = nullptr;
+}
+
+CPU::~CPU() {
+    delete jit;
+}
+
+/**
+ * Maps the CPU's own RAM. The PPU, the APU, the controllers and the
+ * cartridge map their own regions when attached, and whatever nothing
+ * claims reads as open bus.
+ */
+void CPU::map_memory() {
+    bus.map_memory(0x0000, 0x1FFF, ram.get_ram(0), RAM_MIRROR_SIZE, true);
+}
+
+/**
+ * Instruction bytes at addr. Points straight into memory unless the
+ * instruction crosses a page or sits in registers, then the bytes are read
+ * through the bus into fetch_buf: the opcode first, then only the operand
+ * bytes it has, so no byte past the instruction is read.
+ */
+inline uint8_t* CPU::fetch(uint16_t addr) {
+    uint8_t* inst = bus.read_ptr(addr, 3);
+    if(inst != nullptr)
+        return inst;
+    fetch_buf[0] = bus.read8(addr);
+    for(int i=1; i<inst_info[fetch_buf[0]].inst_size; i++)
+        fetch_buf[i] = bus.read8(addr + i);
+    return fetch_buf;
+}
+
+void CPU::set_engine(Engine engine) {
+    if(engine == ENGINE_JIT && jit == nullptr && Jit::is_supported())
+        jit = new Jit(*this);
+    if(engine == ENGINE_JIT && (jit == nullptr || !jit->ok()))
+        engine = ENGINE_TABLE;
+    this->engine = engine;
+}
+
+void CPU::set_tracing(bool tracing) {
+    if(tracing)
+        attention.fetch_or(ATTN_TRACE);
+    else
+        attention.fetch_and(~ATTN_TRACE);
+}
+
+void CPU::set_trace_sink(TraceSink* sink) {
+    trace_sink = sink;
+}
+
+void CPU::add_breakpoint(uint16_t addr) {
+    breakpoints.set(addr);
+    attention.fetch_or(ATTN_BREAKPOINT);
+}
+
+void CPU::remove_breakpoint(uint16_t addr) {
+    breakpoints.reset(addr);
+    if(breakpoints.none())
+        attention.fetch_and(~ATTN_BREAKPOINT);
+}
+
+void CPU::request_stop() {
+    attention.fetch_or(ATTN_STOP);
+}
+
+/** Scheduler wake handler, makes the run loops stop for an event that comes before their deadline */
+void CPU::wake(void* cpu, uint64_t cycle) {
+    CPU* self = (CPU*)cpu;
+    if(cycle < self->deadline)
+        self->deadline = cycle;
+}
+
+void CPU::end_frame() {
+    attention.fetch_or(ATTN_FRAME);
+}
+
+void CPU::stall(uint64_t cycles) {
+    this->cycles += cycles;
+}
+
+void CPU::nmi() {
+    attention.fetch_or(ATTN_NMI);
+}
+
+/**
+ * RESET goes through the motions of an interrupt with writes turned into
+ * reads, so nothing is pushed but SP still moves down by three, from $00
+ * to $FD after power on. Its 7 cycles are counted from power on.
+ */
+void CPU::reset() {
+    pc = bus.read16(RESET_VECTOR);
+    sp -= 3;
+    status.flag.i = 1;
+}
+
+void CPU::set_pc(uint16_t addr) {
+    pc = addr;
+}
+
+void CPU::set_irq(bool asserted) {
+    if(asserted)
+        attention.fetch_or(ATTN_IRQ);
+    else
+        attention.fetch_and(~ATTN_IRQ);
+}
+
+/** Pushes pc and the status like BRK, but with the break flag clear, and jumps through vector */
+void CPU::interrupt(uint16_t vector) {
+    bus.write8(0x0100 + sp, (pc >> 8) & 0xFF);
+    sp--;
+    bus.write8(0x0100 + sp, pc & 0xFF);
+    sp--;
+    bus.write8(0x0100 + sp, (status.sr & ~0x10) | 0x20);
+    sp--;
+    status.flag.i = 1;
+    pc = bus.read16(vector);
+    cycles += INTERRUPT_CYCLES;
+}
+
+uint64_t CPU::get_cycles() {
+    return cycles;
+}
+
+Bus& CPU::get_bus() {
+    return bus;
+}
+
+Scheduler& CPU::get_scheduler() {
+    return scheduler;
+}
+
+const CPU::InstInfo& CPU::get_inst_info(uint8_t opcode) {
+    return inst_info[opcode];
+}
+
+CPU::StopReason CPU::run() {
+    return run_until(UINT64_MAX);
 }
 
-void CPU::run() {
-    InstInfo info;
-	do {
-		CPUState state = save_cpu_state();
-        info = exec_inst(access_mem(pc));
-        log(info, state);
-    } while(strcmp(info.inst_name, "BAD") != 0);
-}
-
-void CPU::log(InstInfo info, CPUState state) {
-	printf("%04X  ", state.pc);
-	for(int i=0; i<3; i++) {
-		if(i<info.inst_size) {
-			printf("%02X ", access_mem(state.pc)[i]);
-		} else {
-			printf("   ");
-		}
-	}
-	printf(" %s  ", info.inst_name);
-	printf("A:%02X X:%02X Y:%02X P:%02X SP:%02X",
-		   state.a, state.x, state.y, state.sr, state.sp);
-	printf("\n");
-}
-
-uint8_t* CPU::access_mem(uint16_t addr) {
-    if(0x0000 <= addr && addr <= 0x1FFF) {
-        addr %= 0x0800;
-        return ram.get_ram(addr);
-    } else if(0x2000 <= addr && addr <= 0x3FFF) {
-        addr %= 0x0008;
-        return &ppu_reg[addr];
-    } else if(0x4000 <= addr && addr <= 0x4017) {
-        return &apu_io_reg[addr - 0x4000];
-    } else if(0x4018 <= addr && addr <= 0x401F) {
-        return &apu_io_reg[addr - 0x4018];
-    } else if(0x8000 <= addr && addr <= 0xBFFF) {
-        return rom.get_prg_rom_lo(addr - 0x8000);
-    } else if(0xC000 <= addr && addr <= 0xFFFF) {
-        return rom.get_prg_rom_hi(addr - 0xC000);
-    } else {
-            return &cart_space[addr - 0x4020];
+CPU::StopReason CPU::run_for(uint64_t budget) {
+    return run_until(cycles + budget);
+}
+
+CPU::StopReason CPU::step(int count) {
+    run_deadline = UINT64_MAX;
+    deadline = scheduler.next_cycle();
+    for(int i=0; i<count; i++) {
+        StopReason reason = check_stop();
+        if(reason != STOP_NONE)
+            return reason;
+        exec_inst(fetch(pc));
+    }
+    return STOP_NONE;
+}
+
+CPU::StopReason CPU::step_until(uint64_t deadline) {
+    run_deadline = deadline;
+    this->deadline = std::min(deadline, scheduler.next_cycle());
+    StopReason reason = check_stop();
+    if(reason == STOP_NONE)
+        exec_inst(fetch(pc));
+    return reason;
+}
+
+CPU::StopReason CPU::run_until(uint64_t deadline) {
+    run_deadline = deadline;
+    this->deadline = std::min(deadline, scheduler.next_cycle());
+    if(engine == ENGINE_THREADED)
+        return run_threaded();
+    if(engine == ENGINE_JIT)
+        return run_jit();
+    return run_table();
+}
+
+/**
+ * Slow path of the run loops, taken before an instruction once the cycle
+ * budget is used up, an event is due or something needs attention. Due
+ * events and pending interrupts are handled here. Returns why the CPU has
+ * to stop, or STOP_NONE to go on with the instruction at pc. A breakpoint
+ * disarms itself when it stops the CPU, so the next run resumes past it,
+ * while stopping for the cycle budget leaves it armed.
+ */
+CPU::StopReason CPU::check_stop() {
+    uint8_t flags = attention.load(std::memory_order_relaxed);
+    if(flags & ATTN_HALT) {
+        attention.fetch_and(~ATTN_HALT);
+        return STOP_ILLEGAL_OPCODE;
+    }
+    if(flags & ATTN_STOP) {
+        attention.fetch_and(~ATTN_STOP);
+        return STOP_EXTERNAL;
+    }
+    if(cycles >= deadline) {
+        if(cycles >= run_deadline)
+            return STOP_CYCLE_BUDGET;
+        scheduler.run_due(cycles);
+        deadline = std::min(run_deadline, scheduler.next_cycle());
+        flags = attention.load(std::memory_order_relaxed);
+    }
+    if(flags & ATTN_FRAME) {
+        attention.fetch_and(~ATTN_FRAME);
+        return STOP_FRAME_COMPLETE;
+    }
+    if(flags & ATTN_NMI) {
+        attention.fetch_and(~ATTN_NMI);
+        interrupt(NMI_VECTOR);
+    } else if((flags & ATTN_IRQ) && !status.flag.i) {
+        interrupt(IRQ_VECTOR);
+    }
+    if(flags & ATTN_BREAKPOINT) {
+        if(breakpoint_armed && breakpoints[pc]) {
+            breakpoint_armed = false;
+            return STOP_BREAKPOINT;
+        }
+        breakpoint_armed = true;
+    }
+    if(flags & ATTN_TRACE)
+        trace();
+    return STOP_NONE;
+}
+
+CPU::StopReason CPU::run_table() {
+    for(;;) {
+        if(cycles >= deadline || attention.load(std::memory_order_relaxed)) {
+            StopReason reason = check_stop();
+            if(reason != STOP_NONE)
+                return reason;
+        }
+        exec_inst(fetch(pc));
     }
 }
 
+/**
+ * run_table() with compiled blocks. A block runs in place of the next
+ * instruction only when the fast path would be taken for every instruction
+ * in it, so anything needing the slow path (tracing included) still goes
+ * an instruction at a time. An IRQ held off by I does not count, the
+ * blocks end at the instructions that can clear I.
+ */
+CPU::StopReason CPU::run_jit() {
+    for(;;) {
+        uint8_t flags = attention.load(std::memory_order_relaxed);
+        if(status.flag.i)
+            flags &= ~ATTN_IRQ;
+        if(cycles >= deadline || flags) {
+            StopReason reason = check_stop();
+            if(reason != STOP_NONE)
+                return reason;
+        } else if(jit->run_block(deadline)) {
+            continue;
+        }
+        exec_inst(fetch(pc));
+    }
+}
+
+/**
+ * Threaded interpreter. Every opcode gets its own copy of the fetch and
+ * dispatch code, so control goes straight from one opcode body to the next
+ * through a label table instead of returning to a central loop. The handlers
+ * are called directly and get inlined into their bodies, and the cycle count
+ * of each opcode is a constant. Compilers without labels as values get a
+ * single switch over the same bodies instead. The function is flattened so
+ * the bus accessors and operand fetchers stay inline in every body.
+ */
+FLATTEN CPU::StopReason CPU::run_threaded() {
+    uint8_t* inst;
+    StopReason reason;
+
+#ifdef __GNUC__
+#define X(opcode, handler, name, size, cyc) &&op_##opcode,
+#define B(opcode) &&halt,
+    static const void* const labels[256] = { CPU_OPCODES(X, B) };
+#undef X
+#undef B
+
+#define NEXT() \
+    if(cycles >= deadline || attention.load(std::memory_order_relaxed)) \
+        goto check; \
+    inst = fetch(pc); \
+    goto *labels[inst[0]]
+
+check:
+    reason = check_stop();
+    if(reason != STOP_NONE)
+        return reason;
+    inst = fetch(pc);
+    goto *labels[inst[0]];
+
+#define X(opcode, handler, name, size, cyc) op_##opcode: cycles += cyc; handler(inst); NEXT();
+#define B(opcode)
+    CPU_OPCODES(X, B)
+#undef X
+#undef B
+#undef NEXT
+
+halt:
+    bad(inst);
+    goto check;
+#else
+    for(;;) {
+        if(cycles >= deadline || attention.load(std::memory_order_relaxed)) {
+            reason = check_stop();
+            if(reason != STOP_NONE)
+                return reason;
+        }
+        inst = fetch(pc);
+        switch(inst[0]) {
+#define X(opcode, handler, name, size, cyc) case opcode: cycles += cyc; handler(inst); break;
+#define B(opcode) case opcode: bad(inst); break;
+            CPU_OPCODES(X, B)
+#undef X
+#undef B
+        }
+    }
+#endif
+}
+
+void CPU::trace() {
+    if(trace_sink == nullptr)
+        return;
+    uint8_t* inst = fetch(pc);
+    TraceRecord rec = {};
+    rec.cycles = cycles;
+    rec.pc = pc;
+    for(int i=0; i<inst_info[inst[0]].inst_size; i++)
+        rec.inst[i] = inst[i];
+    rec.a = a;
+    rec.x = x;
+    rec.y = y;
+    rec.p = status.sr;
+    rec.sp = sp;
+    trace_sink->record(rec);
+}
+
 uint16_t CPU::load_address(uint16_t addr) {
-	uint16_t ld_addr = *access_mem((addr & 0xFF00) + ((addr+1) & 0xFF)) << 8;
-	ld_addr += *access_mem(addr);
+	uint16_t ld_addr = bus.read8((addr & 0xFF00) + ((addr+1) & 0xFF)) << 8;
+	ld_addr += bus.read8(addr);
 	return ld_addr;
 }
 
-CPU::InstInfo CPU::exec_inst(uint8_t* inst) {
-    switch(inst[0]) {
-        case 0x69: case 0x65: case 0x75: case 0x6D:
-        case 0x7D: case 0x79: case 0x61: case 0x71:
-			return adc(inst);
-        case 0x29: case 0x25: case 0x35: case 0x2D:
-        case 0x3D: case 0x39: case 0x21: case 0x31:
-			return and_(inst);
-        case 0x0A: case 0x06: case 0x16:
-        case 0x0E: case 0x1E:
-			return asl(inst);
-        case 0x90:
-			return bcc(inst);
-        case 0xB0:
-			return bcs(inst);
-        case 0xF0:
-			return beq(inst);
-        case 0x24: case 0x2C:
-			return bit(inst);
-        case 0x30:
-			return bmi(inst);
-        case 0xD0:
-			return bne(inst);
-        case 0x10:
-			return bpl(inst);
-        case 0x00:
-			return brk(inst);
-        case 0x50:
-			return bvc(inst);
-        case 0x70:
-			return bvs(inst);
-        case 0x18:
-			return clc(inst);
-        case 0xD8:
-			return cld(inst);
-        case 0x58:
-			return cli(inst);
-        case 0xB8:
-			return clv(inst);
-        case 0xC9: case 0xC5: case 0xD5: case 0xCD:
-        case 0xDD: case 0xD9: case 0xC1: case 0xD1:
-			return cmp(inst);
-        case 0xE0: case 0xE4: case 0xEC:
-			return cpx(inst);
-        case 0xC0: case 0xC4: case 0xCC:
-			return cpy(inst);
-        case 0xC6: case 0xD6: case 0xCE: case 0xDE:
-			return dec(inst);
-        case 0xCA:
-			return dex(inst);
-        case 0x88:
-			return dey(inst);
-        case 0x49: case 0x45: case 0x55: case 0x4D:
-        case 0x5D: case 0x59: case 0x41: case 0x51:
-			return eor(inst);
-        case 0xE6: case 0xF6: case 0xEE: case 0xFE:
-			return inc(inst);
-        case 0xE8:
-			return inx(inst);
-        case 0xC8:
-			return iny(inst);
-        case 0x4C: case 0x6C:
-			return jmp(inst);
-        case 0x20:
-			return jsr(inst);
-        case 0xA9: case 0xA5: case 0xB5: case 0xAD:
-        case 0xBD: case 0xB9: case 0xA1: case 0xB1:
-			return lda(inst);
-        case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE:
-			return ldx(inst);
-        case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC:
-			return ldy(inst);
-        case 0x4A: case 0x46: case 0x56: case 0x4E: case 0x5E:
-			return lsr(inst);
-        case 0xEA:
-			return nop(inst);
-        case 0x09: case 0x05: case 0x15: case 0x0D:
-        case 0x1D: case 0x19: case 0x01: case 0x11:
-			return ora(inst);
-        case 0x48:
-			return pha(inst);
-        case 0x08:
-			return php(inst);
-        case 0x68:
-			return pla(inst);
-        case 0x28:
-			return plp(inst);
-        case 0x2A: case 0x26: case 0x36: case 0x2E: case 0x3E:
-			return rol(inst);
-        case 0x6A: case 0x66: case 0x76: case 0x6E: case 0x7E:
-			return ror(inst);
-        case 0x40:
-			return rti(inst);
-        case 0x60:
-			return rts(inst);
-        case 0xE9: case 0xE5: case 0xF5: case 0xED:
-        case 0xFD: case 0xF9: case 0xE1: case 0xF1:
-			return sbc(inst);
-        case 0x38:
-			return sec(inst);
-        case 0xF8:
-			return sed(inst);
-        case 0x78:
-			return sei(inst);
-        case 0x85: case 0x95: case 0x8D: case 0x9D:
-        case 0x99: case 0x81: case 0x91:
-			return sta(inst);
-        case 0x86: case 0x96: case 0x8E:
-			return stx(inst);
-        case 0x84: case 0x94: case 0x8C:
-			return sty(inst);
-        case 0xAA:
-			return tax(inst);
-        case 0xA8:
-			return tay(inst);
-        case 0xBA:
-			return tsx(inst);
-        case 0x8A:
-			return txa(inst);
-        case 0x9A:
-			return txs(inst);
-        case 0x98:
-			return tya(inst);
-		case 0x1A: case 0x3A: case 0x5A: case 0x7A: case 0xDA:
-		case 0xFA: case 0x80: case 0x82: case 0x89: case 0xC2:
-		case 0xE2: case 0x04: case 0x44: case 0x64: case 0x14:
-		case 0x34: case 0x54: case 0x74: case 0xD4: case 0xF4:
-		case 0x0C: case 0x1C: case 0x3C: case 0x5C: case 0x7C:
-		case 0xDC: case 0xFC:
-			return ill_nop(inst);
-    }
-    InstInfo null_info = {"BAD", 1};
-    return null_info;
+void CPU::exec_inst(uint8_t* inst) {
+    cycles += inst_info[inst[0]].inst_cycles;
+    (this->*dispatch_table[inst[0]])(inst);
 }
 
+/**
+ * Builds the opcode -> handler table. Each entry points at a handler that is
+ * already specialized for the opcode's addressing mode, so executing an
+ * instruction is a single indirect call with no further decoding.
+ */
+constexpr CPU::DispatchTable CPU::build_dispatch_table() {
+    DispatchTable t = {};
+#define X(opcode, handler, name, size, cycles) t[opcode] = &CPU::handler;
+#define B(opcode) t[opcode] = &CPU::bad;
+    CPU_OPCODES(X, B)
+#undef X
+#undef B
+    return t;
+}
+
+const CPU::DispatchTable CPU::dispatch_table = CPU::build_dispatch_table();
+
+/** Mnemonic, size and base cycle count of every opcode, for tracing and timing */
+const CPU::InstInfo CPU::inst_info[256] = {
+#define X(opcode, handler, name, size, cycles) {name, size, cycles},
+#define B(opcode) {"BAD", 1, 0},
+    CPU_OPCODES(X, B)
+#undef X
+#undef B
+};
+
 CPU::CPUState CPU::save_cpu_state() {
-	return {a, x, y, pc, sp, status.sr};
+	return {a, x, y, pc, sp, status.sr, cycles};
+}
+
+template<typename State> void CPU::serialize(State& state) {
+    state.value(a);
+    state.value(x);
+    state.value(y);
+    state.value(pc);
+    state.value(sp);
+    state.value(status.sr);
+    state.value(cycles);
+}
+
+/** Of the attention flags only the pending interrupts are machine state */
+void CPU::save_state(StateWriter& state) {
+    serialize(state);
+    uint8_t interrupts = attention.load(std::memory_order_relaxed) & (ATTN_NMI | ATTN_IRQ);
+    state.value(interrupts);
+    scheduler.save_state(state);
+}
+
+void CPU::load_state(StateReader& state) {
+    serialize(state);
+    uint8_t interrupts = 0;
+    state.value(interrupts);
+    attention.fetch_and(~(ATTN_NMI | ATTN_IRQ));
+    attention.fetch_or(interrupts & (ATTN_NMI | ATTN_IRQ));
+    scheduler.load_state(state);
+}
+
+constexpr int CPU::inst_size(AddrMode mode) {
+    switch(mode) {
+        case IMP: case ACC:
+            return 1;
+        case ABS: case ABSX: case ABSY: case IND:
+            return 3;
+        default:
+            return 2;
+    }
 }
 
-CPU::InstInfo CPU::adc(uint8_t* inst) {
-    InstInfo info = {"ADC", 2};
-    uint8_t op1 = a;
-    uint8_t op2;
-    switch(inst[0]) {
-        case 0x69: // Immediate
-            op2 = inst[1];
-            break;
-        case 0x65: // Zero Page
-            op2 = *access_mem(inst[1]);
-            break;
-        case 0x75: // Zero Page, X
-            op2 = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x6D: // Absolute
-            op2 = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x7D: // Absolute, X
-            op2 = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0x79: // Absolute, Y
-            op2 = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0x61: // (Indirect, x)
-            op2 = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0x71: // (Indirect), Y
-            op2 = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
+/**
+ * Effective address of the operand. Zero page indexing wraps around within
+ * the zero page, and the indirect modes read their pointer through
+ * load_address so they share its page wrap behaviour.
+ */
+template<CPU::AddrMode mode>
+uint16_t CPU::operand_addr(uint8_t* inst) {
+    static_assert(mode != IMP && mode != ACC && mode != IMM,
+                  "addressing mode has no effective address");
+    if constexpr(mode == ZP)
+        return inst[1];
+    else if constexpr(mode == ZPX)
+        return (uint8_t)(inst[1] + x);
+    else if constexpr(mode == ZPY)
+        return (uint8_t)(inst[1] + y);
+    else if constexpr(mode == ABS)
+        return fix_endian(&inst[1]);
+    else if constexpr(mode == ABSX)
+        return fix_endian(&inst[1]) + x;
+    else if constexpr(mode == ABSY)
+        return fix_endian(&inst[1]) + y;
+    else if constexpr(mode == IND)
+        return load_address(fix_endian(&inst[1]));
+    else if constexpr(mode == INDX)
+        return load_address((uint8_t)(inst[1] + x));
+    else
+        return load_address(inst[1]) + y;
+}
+
+/**
+ * Value an instruction operates on, the immediate byte and the accumulator
+ * included. Indexed reads that cross a page take an extra cycle, except for
+ * read-modify-write instructions whose base count already includes it.
+ */
+template<CPU::AddrMode mode, bool page_penalty>
+uint8_t CPU::read_operand(uint8_t* inst) {
+    if constexpr(mode == IMM)
+        return inst[1];
+    else if constexpr(mode == ACC)
+        return a;
+    else if constexpr(page_penalty && (mode == ABSX || mode == ABSY || mode == INDY)) {
+        uint16_t base = mode == INDY ? load_address(inst[1]) : fix_endian(&inst[1]);
+        uint16_t addr = base + (mode == ABSX ? x : y);
+        cycles += page_crossed(base, addr);
+        return bus.read8(addr);
     }
+    else
+        return bus.read8(operand_addr<mode>(inst));
+}
+
+/** Stores the result of an instruction to memory or the accumulator */
+template<CPU::AddrMode mode>
+void CPU::write_operand(uint8_t* inst, uint8_t value) {
+    if constexpr(mode == ACC)
+        a = value;
+    else
+        bus.write8(operand_addr<mode>(inst), value);
+}
+
+template<CPU::AddrMode mode>
+void CPU::adc(uint8_t* inst) {
+    uint8_t op1 = a;
+    uint8_t op2 = read_operand<mode>(inst);
     uint16_t tmp = op1 + op2 + status.flag.c;
     a = (uint8_t) tmp;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.c = tmp >> 8;
     status.flag.z = a == 0;
     status.flag.v = sign_bit(op1) == sign_bit(op2) ? sign_bit(a) != sign_bit(op1) : 0;
     status.flag.n = sign_bit(a);
-    return info;
 }
 
-CPU::InstInfo CPU::and_(uint8_t* inst) {
-    InstInfo info = {"AND", 2};
-    uint8_t op1 = a;
-    uint8_t op2;
-    switch(inst[0]) {
-        case 0x29: // Immediate
-            op2 = inst[1];
-            break;
-        case 0x25: // Zero Page
-            op2 = *access_mem(inst[1]);
-            break;
-        case 0x35: // Zero Page, X
-            op2 = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x2D: // Absolute
-            op2 = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x3D: // Absolute, X
-            op2 = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0x39: // Absolute, Y
-            op2 = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0x21: // (Indirect, X)
-            op2 = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0x31: // (Indirect), Y
-            op2 = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
-    a = op1 & op2;
-    pc += info.inst_size;
+template<CPU::AddrMode mode>
+void CPU::and_(uint8_t* inst) {
+    a &= read_operand<mode>(inst);
+    pc += inst_size(mode);
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-    return info;
-}
-
-CPU::InstInfo CPU::asl(uint8_t* inst) {
-    InstInfo info = {"ASL", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x0A: // Accumulator
-            op = &a;
-            info.inst_size = 1;
-            break;
-        case 0x06: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x16: // Zero Page X
-            op = access_mem(inst[1] + x);
-            break;
-        case 0x0E: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x1E: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
-    pc += info.inst_size;
-    status.flag.c = sign_bit(*op);
-    *op = *op << 1;
-    status.flag.z = *op == 0;
-    status.flag.n = sign_bit(*op);
-    return info;
-}
-
-CPU::InstInfo CPU::bcc(uint8_t* inst) {
-	InstInfo info = {"BCC", 2};
-	if(!status.flag.c)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::bcs(uint8_t* inst) {
-	InstInfo info = {"BCS", 2};
-	if(status.flag.c)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::beq(uint8_t* inst) {
-	InstInfo info = {"BEQ", 2};
-	if(status.flag.z)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::bit(uint8_t* inst) {
-    InstInfo info = {"BIT", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0x24: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0x2C: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
+}
+
+template<CPU::AddrMode mode>
+void CPU::asl(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst);
+    pc += inst_size(mode);
+    status.flag.c = sign_bit(op);
+    op = op << 1;
+    write_operand<mode>(inst, op);
+    status.flag.z = op == 0;
+    status.flag.n = sign_bit(op);
+}
+
+/**
+ * Relative jump shared by the conditional branches. A taken branch costs one
+ * more cycle, and another if the target is on a different page than the
+ * next instruction.
+ */
+void CPU::branch(uint8_t* inst, bool taken) {
+    pc += 2;
+    if(taken) {
+        uint16_t target = pc + (int8_t)inst[1];
+        cycles += 1 + page_crossed(pc, target);
+        pc = target;
     }
-    pc += info.inst_size;
+}
+
+void CPU::bcc(uint8_t* inst) {
+	branch(inst, !status.flag.c);
+}
+
+void CPU::bcs(uint8_t* inst) {
+	branch(inst, status.flag.c);
+}
+
+void CPU::beq(uint8_t* inst) {
+	branch(inst, status.flag.z);
+}
+
+template<CPU::AddrMode mode>
+void CPU::bit(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
+    pc += inst_size(mode);
     status.flag.z = (a & op) == 0;
     status.flag.v = (op >> 6) & 0x01;
     status.flag.n = sign_bit(op);
-    return info;
 }
 
-CPU::InstInfo CPU::bmi(uint8_t* inst) {
-	InstInfo info = {"BMI", 2};
-	if(status.flag.n)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
+void CPU::bmi(uint8_t* inst) {
+	branch(inst, status.flag.n);
 }
 
-CPU::InstInfo CPU::bne(uint8_t* inst) {
-	InstInfo info = {"BNE", 2};
-	if(!status.flag.z)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
+void CPU::bne(uint8_t* inst) {
+	branch(inst, !status.flag.z);
 }
 
-CPU::InstInfo CPU::bpl(uint8_t* inst) {
-	InstInfo info = {"BPL", 2};
-	if(!status.flag.n)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
+void CPU::bpl(uint8_t* inst) {
+	branch(inst, !status.flag.n);
 }
 
-CPU::InstInfo CPU::brk(uint8_t* inst) {
-    InstInfo info = {"BRK", 1};
+void CPU::brk(uint8_t* inst) {
     pc += 1;
-    *access_mem(0x0100 + sp) = (pc >> 8) & 0xFF;
+    bus.write8(0x0100 + sp, (pc >> 8) & 0xFF);
     sp--;
-    *access_mem(0x0100 + sp) = pc & 0xFF;
+    bus.write8(0x0100 + sp, pc & 0xFF);
     sp--;
-    *access_mem(0x0100 + sp) = status.sr | 0x10; // break flag is set to 1
+    bus.write8(0x0100 + sp, status.sr | 0x10); // break flag is set to 1
     sp--;
-    pc = fix_endian(access_mem(0xFFFE));
+    pc = bus.read16(0xFFFE);
     status.flag.b = 1;
-    return info;
 }
 
-CPU::InstInfo CPU::bvc(uint8_t* inst) {
-	InstInfo info = {"BVC", 2};
-	if(!status.flag.v)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
+void CPU::bvc(uint8_t* inst) {
+	branch(inst, !status.flag.v);
 }
 
-CPU::InstInfo CPU::bvs(uint8_t* inst) {
-	InstInfo info = {"BVS", 2};
-	if(status.flag.v)
-		pc += (int8_t)inst[1];
-	pc += info.inst_size;
-	return info;
+void CPU::bvs(uint8_t* inst) {
+	branch(inst, status.flag.v);
 }
 
-CPU::InstInfo CPU::clc(uint8_t* inst) {
-    InstInfo info = {"CLC", 1};
+void CPU::clc(uint8_t* inst) {
     status.flag.c = 0;
-    pc += info.inst_size;
-    return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::cld(uint8_t* inst) {
-    InstInfo info = {"CLD", 1};
+void CPU::cld(uint8_t* inst) {
     status.flag.d = 0;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::cli(uint8_t* inst) {
-	InstInfo info = {"CLI", 1};
+void CPU::cli(uint8_t* inst) {
     status.flag.i = 0;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::clv(uint8_t* inst) {
-	InstInfo info = {"CLV", 1};
+void CPU::clv(uint8_t* inst) {
     status.flag.v = 0;
-    pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::cmp(uint8_t* inst) {
-	InstInfo info = {"CMP", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xC9: // Immediate
-            op = inst[1];
-            break;
-        case 0xC5: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xD5: // Zero Page, X
-            op = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xCD: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xDD: // Absolute, X
-            op = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0xD9: // Absolute, Y
-            op = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0xC1: // (Indirect, X)
-            op = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0xD1: // (Indirect), Y
-            op = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
-    pc += info.inst_size;
+    pc += 1;
+}
+
+template<CPU::AddrMode mode>
+void CPU::cmp(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
+    pc += inst_size(mode);
     status.flag.c = a >= op;
     status.flag.z = a == op;
     status.flag.n = sign_bit(a - op);
-	return info;
-}
-
-CPU::InstInfo CPU::cpx(uint8_t* inst) {
-	InstInfo info = {"CPX", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xE0: // Immediate
-            op = inst[1];
-            break;
-        case 0xE4: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xEC: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-    }
-    pc += info.inst_size;
+}
+
+template<CPU::AddrMode mode>
+void CPU::cpx(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
+    pc += inst_size(mode);
     status.flag.c = x >= op;
     status.flag.z = x == op;
     status.flag.n = sign_bit(x - op);
-	return info;
-}
-
-CPU::InstInfo CPU::cpy(uint8_t* inst) {
-	InstInfo info = {"CPY", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xC0: // Immediate
-            op = inst[1];
-            break;
-        case 0xC4: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xCC: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-    }
-    pc += info.inst_size;
+}
+
+template<CPU::AddrMode mode>
+void CPU::cpy(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
+    pc += inst_size(mode);
     status.flag.c = y >= op;
     status.flag.z = y == op;
     status.flag.n = sign_bit(y - op);
-	return info;
-}
-
-CPU::InstInfo CPU::dec(uint8_t* inst) {
-	InstInfo info = {"DEC", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0xC6: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0xD6: // Zero Page, X
-            op = access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xCE: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xDE: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-           info.inst_size = 3;
-            break;
-    }
-    (*op)--;
-    pc += info.inst_size;
-    status.flag.z = *op == 0;
-    status.flag.n = sign_bit(*op);
-	return info;
 }
 
-CPU::InstInfo CPU::dex(uint8_t* inst) {
-	InstInfo info = {"DEX", 1};
+template<CPU::AddrMode mode>
+void CPU::dec(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst) - 1;
+    write_operand<mode>(inst, op);
+    pc += inst_size(mode);
+    status.flag.z = op == 0;
+    status.flag.n = sign_bit(op);
+}
+
+void CPU::dex(uint8_t* inst) {
     x--;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = x == 0;
     status.flag.n = sign_bit(x);
-	return info;
 }
 
-CPU::InstInfo CPU::dey(uint8_t* inst) {
-	InstInfo info = {"DEY", 1};
+void CPU::dey(uint8_t* inst) {
     y--;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = y == 0;
     status.flag.n = sign_bit(y);
-	return info;
 }
 
-CPU::InstInfo CPU::eor(uint8_t* inst) {
-	InstInfo info = {"EOR", 2};
+template<CPU::AddrMode mode>
+void CPU::eor(uint8_t* inst) {
     uint8_t op1 = a;
-    uint8_t op2;
-    switch(inst[0]) {
-        case 0x49: // Immediate
-            op2 = inst[1];
-            break;
-        case 0x45: // Zero Page
-            op2 = *access_mem(inst[1]);
-            break;
-        case 0x55: // Zero Page, X
-            op2 = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x4D: // Absolute
-            op2 = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x5D: // Absolute, X
-            op2 = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0x59: // Absolute, Y
-            op2 = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0x41: // (Indirect, X)
-            op2 = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0x51: // (Indirect), Y
-            op2 = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
+    uint8_t op2 = read_operand<mode>(inst);
     a = op1 ^ op2;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
-}
-
-CPU::InstInfo CPU::inc(uint8_t* inst) {
-	InstInfo info = {"INC", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0xE6: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0xF6: // Zero Page, X
-            op = access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xEE: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xFE: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
-    (*op)++;
-    pc += info.inst_size;
-    status.flag.z = *op == 0;
-    status.flag.n = sign_bit(*op);
-	return info;
 }
 
-CPU::InstInfo CPU::inx(uint8_t* inst) {
-	InstInfo info = {"INX", 1};
+template<CPU::AddrMode mode>
+void CPU::inc(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst) + 1;
+    write_operand<mode>(inst, op);
+    pc += inst_size(mode);
+    status.flag.z = op == 0;
+    status.flag.n = sign_bit(op);
+}
+
+void CPU::inx(uint8_t* inst) {
     x++;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = x == 0;
     status.flag.n = sign_bit(x);
-	return info;
 }
 
-CPU::InstInfo CPU::iny(uint8_t* inst) {
-	InstInfo info = {"INY", 1};
+void CPU::iny(uint8_t* inst) {
     y++;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = y == 0;
     status.flag.n = sign_bit(y);
-	return info;
 }
 
-CPU::InstInfo CPU::jmp(uint8_t* inst) {
+template<CPU::AddrMode mode>
+void CPU::jmp(uint8_t* inst) {
     /**
      * An original 6502 has does not correctly fetch the target address if the
      * indirect vector falls on a page boundary (e.g. $xxFF where xx is any value
@@ -679,529 +743,232 @@ CPU::InstInfo CPU::jmp(uint8_t* inst) {
      * so for compatibility always ensure the indirect vector is not at the end of
      * the page.
      */
-	InstInfo info = {"JMP", 3};
-    switch(inst[0]) {
-        case 0x4C: // Absolute
-            pc = fix_endian(&inst[1]);
-            break;
-        case 0x6C: // Indirect
-        	pc = load_address(fix_endian(&inst[1]));
-            break;
-    }
-	return info;
+    pc = operand_addr<mode>(inst);
 }
 
-CPU::InstInfo CPU::jsr(uint8_t* inst) {
-	InstInfo info = {"JSR", 3};
+void CPU::jsr(uint8_t* inst) {
     pc += 2;
-    *access_mem(0x0100 + sp) = (pc >> 8) & 0xFF;
+    bus.write8(0x0100 + sp, (pc >> 8) & 0xFF);
     sp--;
-    *access_mem(0x0100 + sp) = pc & 0xFF;
+    bus.write8(0x0100 + sp, pc & 0xFF);
     sp--;
     pc = fix_endian(&inst[1]);
-	return info;
-}
-
-CPU::InstInfo CPU::lda(uint8_t* inst) {
-	InstInfo info = {"LDA", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xA9: // Immediate
-            op = inst[1];
-            break;
-        case 0xA5: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xB5: // Zero Page, X
-            op = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xAD: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xBD: // Absolute, X
-            op = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0xB9: // Absolute, Y
-            op = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0xA1: // (Indirect, X)
-            op = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0xB1: // (Indirect), Y
-            op = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
+}
+
+template<CPU::AddrMode mode>
+void CPU::lda(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
     a = op;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
-}
-
-CPU::InstInfo CPU::ldx(uint8_t* inst) {
-	InstInfo info = {"LDX", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xA2: // Immediate
-            op = inst[1];
-            break;
-        case 0xA6: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xB6: // Zero Page, Y
-            op = *access_mem((uint8_t)(inst[1] + y));
-            break;
-        case 0xAE: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xBE: // Absolute, Y
-            op = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-    }
+}
+
+template<CPU::AddrMode mode>
+void CPU::ldx(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
     x = op;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.z = x == 0;
     status.flag.n = sign_bit(x);
-	return info;
-}
-
-CPU::InstInfo CPU::ldy(uint8_t* inst) {
-	InstInfo info = {"LDY", 2};
-    uint8_t op;
-    switch(inst[0]) {
-        case 0xA0: // Immediate
-            op = inst[1];
-            break;
-        case 0xA4: // Zero Page
-            op = *access_mem(inst[1]);
-            break;
-        case 0xB4: // Zero Page, X
-            op = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xAC: // Absolute
-            op = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xBC: // Absolute, X
-            op = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
+}
+
+template<CPU::AddrMode mode>
+void CPU::ldy(uint8_t* inst) {
+    uint8_t op = read_operand<mode>(inst);
     y = op;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.z = y == 0;
     status.flag.n = sign_bit(y);
-	return info;
-}
-
-CPU::InstInfo CPU::lsr(uint8_t* inst) {
-	InstInfo info = {"LSR", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x4A: // Accumulator
-            op = &a;
-            info.inst_size = 1;
-            break;
-        case 0x46: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x56: // Zero Page X
-            op = access_mem(inst[1] + x);
-            break;
-        case 0x4E: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x5E: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
-    pc += info.inst_size;
-    status.flag.c = *op & 0x01;
-    *op = (*op >> 1) & 0x7F;
-    status.flag.z = *op == 0;
-    status.flag.n = sign_bit(*op);
-	return info;
 }
 
-CPU::InstInfo CPU::nop(uint8_t* inst) {
-	InstInfo info = {"NOP", 1};
-    pc += info.inst_size;
-	return info;
+template<CPU::AddrMode mode>
+void CPU::lsr(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst);
+    pc += inst_size(mode);
+    status.flag.c = op & 0x01;
+    op = (op >> 1) & 0x7F;
+    write_operand<mode>(inst, op);
+    status.flag.z = op == 0;
+    status.flag.n = sign_bit(op);
 }
 
-CPU::InstInfo CPU::ora(uint8_t* inst) {
-	InstInfo info = {"ORA", 2};
+void CPU::nop(uint8_t* inst) {
+    pc += 1;
+}
+
+template<CPU::AddrMode mode>
+void CPU::ora(uint8_t* inst) {
     uint8_t op1 = a;
-    uint8_t op2;
-    switch(inst[0]) {
-        case 0x09: // Immediate
-            op2 = inst[1];
-            break;
-        case 0x05: // Zero Page
-            op2 = *access_mem(inst[1]);
-            break;
-        case 0x15: // Zero Page, X
-            op2 = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x0D: // Absolute
-            op2 = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x1D: // Absolute, X
-            op2 = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0x19: // Absolute, Y
-            op2 = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0x01: // (Indirect, X)
-            op2 = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0x11: // (Indirect), Y
-            op2 = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
+    uint8_t op2 = read_operand<mode>(inst);
     a = op1 | op2;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
 }
 
-CPU::InstInfo CPU::pha(uint8_t* inst) {
-	InstInfo info = {"PHA", 1};
-    pc += info.inst_size;
-    *access_mem(0x0100 + sp) = a;
+void CPU::pha(uint8_t* inst) {
+    pc += 1;
+    bus.write8(0x0100 + sp, a);
     sp--;
-	return info;
 }
 
-CPU::InstInfo CPU::php(uint8_t* inst) {
-	InstInfo info = {"PHP", 1};
-    pc += info.inst_size;
-    *access_mem(0x0100 + sp) = status.sr | 0x10; // break flag is set to 1
+void CPU::php(uint8_t* inst) {
+    pc += 1;
+    bus.write8(0x0100 + sp, status.sr | 0x10); // break flag is set to 1
     sp--;
-	return info;
 }
 
-CPU::InstInfo CPU::pla(uint8_t* inst) {
-	InstInfo info = {"PLA", 1};
-    pc += info.inst_size;
+void CPU::pla(uint8_t* inst) {
+    pc += 1;
     sp++;
-    a = *access_mem(0x0100 + sp);
+    a = bus.read8(0x0100 + sp);
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
 }
 
-CPU::InstInfo CPU::plp(uint8_t* inst) {
-	InstInfo info = {"PLP", 1};
-    pc += info.inst_size;
+void CPU::plp(uint8_t* inst) {
+    pc += 1;
     sp++;
-    status.sr = *access_mem(0x0100 + sp);
+    status.sr = bus.read8(0x0100 + sp);
     status.flag.b = 0; // Clear break flag
     status.flag.u = 1; // Reset unused flag;
-	return info;
-}
-
-CPU::InstInfo CPU::rol(uint8_t* inst) {
-	InstInfo info = {"ROL", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x2A: // Accumulator
-            op = &a;
-            info.inst_size = 1;
-            break;
-        case 0x26: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x36: // Zero Page X
-            op = access_mem(inst[1] + x);
-            break;
-        case 0x2E: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x3E: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
-    uint8_t old_bit7 = sign_bit(*op);
-    *op = (*op << 1) + status.flag.c;
-    pc += info.inst_size;
+}
+
+template<CPU::AddrMode mode>
+void CPU::rol(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst);
+    uint8_t old_bit7 = sign_bit(op);
+    op = (op << 1) + status.flag.c;
+    write_operand<mode>(inst, op);
+    pc += inst_size(mode);
     status.flag.c = old_bit7;
     status.flag.z = a == 0;
-    status.flag.n = sign_bit(*op);
-	return info;
-}
-
-CPU::InstInfo CPU::ror(uint8_t* inst) {
-	InstInfo info = {"ROR", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x6A: // Accumulator
-            op = &a;
-            info.inst_size = 1;
-            break;
-        case 0x66: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x76: // Zero Page X
-            op = access_mem(inst[1] + x);
-            break;
-        case 0x6E: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x7E: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-    }
-    uint8_t old_bit0 = *op & 0x01;
-    *op = ((*op >> 1) & 0x7F) + (uint8_t)(status.flag.c << 7);
-    pc += info.inst_size;
+    status.flag.n = sign_bit(op);
+}
+
+template<CPU::AddrMode mode>
+void CPU::ror(uint8_t* inst) {
+    uint8_t op = read_operand<mode, false>(inst);
+    uint8_t old_bit0 = op & 0x01;
+    op = ((op >> 1) & 0x7F) + (uint8_t)(status.flag.c << 7);
+    write_operand<mode>(inst, op);
+    pc += inst_size(mode);
     status.flag.c = old_bit0;
     status.flag.z = a == 0;
-    status.flag.n = sign_bit(*op);
-	return info;
+    status.flag.n = sign_bit(op);
 }
 
-CPU::InstInfo CPU::rti(uint8_t* inst) {
-	InstInfo info = {"RTI", 1};
+void CPU::rti(uint8_t* inst) {
     sp++;
-    status.sr = *access_mem(0x0100 + sp);
+    status.sr = bus.read8(0x0100 + sp);
     sp++;
-    pc = fix_endian(access_mem(0x0100 + sp));
+    pc = bus.read16(0x0100 + sp);
     sp++;
 	status.flag.b = 0; // Clear break flag
 	status.flag.u = 1; // Reset unused flag;
-	return info;
 }
 
-CPU::InstInfo CPU::rts(uint8_t* inst) {
-	InstInfo info = {"RTS", 1};
+void CPU::rts(uint8_t* inst) {
     sp++;
-    pc = fix_endian(access_mem(0x0100 + sp));
+    pc = bus.read16(0x0100 + sp);
     sp++;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::sbc(uint8_t* inst) {
-	InstInfo info = {"SBC", 2};
+template<CPU::AddrMode mode>
+void CPU::sbc(uint8_t* inst) {
     uint8_t op1 = a;
-    uint8_t op2;
-    switch(inst[0]) {
-        case 0xE9: // Immediate
-            op2 = inst[1];
-            break;
-        case 0xE5: // Zero Page
-            op2 = *access_mem(inst[1]);
-            break;
-        case 0xF5: // Zero Page, X
-            op2 = *access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0xED: // Absolute
-            op2 = *access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0xFD: // Absolute, X
-            op2 = *access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0xF9: // Absolute, Y
-            op2 = *access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0xE1: // (Indirect, x)
-            op2 = *access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0xF1: // (Indirect), Y
-            op2 = *access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
+    uint8_t op2 = read_operand<mode>(inst);
     uint16_t tmp = op1 - op2 - (1-status.flag.c);
     a = (uint8_t) tmp;
-    pc += info.inst_size;
+    pc += inst_size(mode);
     status.flag.c = !sign_bit(a);
     status.flag.z = a == 0;
     status.flag.v = sign_bit(op1) != sign_bit(op2) && sign_bit(op1) != sign_bit(a);
     status.flag.n = sign_bit(a);
-	return info;
 }
 
-CPU::InstInfo CPU::sec(uint8_t* inst) {
-	InstInfo info = {"SEC", 1};
+void CPU::sec(uint8_t* inst) {
     status.flag.c = 1;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::sed(uint8_t* inst) {
-	InstInfo info = {"SED", 1};
+void CPU::sed(uint8_t* inst) {
     status.flag.d = 1;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::sei(uint8_t* inst) {
-	InstInfo info = {"SEI", 1};
+void CPU::sei(uint8_t* inst) {
     status.flag.i = 1;
-    pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::sta(uint8_t* inst) {
-	InstInfo info = {"STA", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x85: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x95: // Zero Page, X
-            op = access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x8D: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-        case 0x9D: // Absolute, X
-            op = access_mem(fix_endian(&inst[1]) + x);
-            info.inst_size = 3;
-            break;
-        case 0x99: // Absolute, Y
-            op = access_mem(fix_endian(&inst[1]) + y);
-            info.inst_size = 3;
-            break;
-        case 0x81: // (Indirect, X)
-            op = access_mem(load_address((uint8_t)(inst[1] + x)));
-            break;
-        case 0x91: // (Indirect), Y
-            op = access_mem(load_address((uint8_t)inst[1]) + y);
-            break;
-    }
-    *op = a;
-    pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::stx(uint8_t* inst) {
-	InstInfo info = {"STX", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x86: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x96: // Zero Page, Y
-            op = access_mem((uint8_t)(inst[1] + y));
-            break;
-        case 0x8E: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-    }
-    *op = x;
-    pc += info.inst_size;
-	return info;
-}
-
-CPU::InstInfo CPU::sty(uint8_t* inst) {
-	InstInfo info = {"STY", 2};
-    uint8_t* op;
-    switch(inst[0]) {
-        case 0x84: // Zero Page
-            op = access_mem(inst[1]);
-            break;
-        case 0x94: // Zero Page, X
-            op = access_mem((uint8_t)(inst[1] + x));
-            break;
-        case 0x8C: // Absolute
-            op = access_mem(fix_endian(&inst[1]));
-            info.inst_size = 3;
-            break;
-    }
-    *op = y;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
+}
+
+template<CPU::AddrMode mode>
+void CPU::sta(uint8_t* inst) {
+    write_operand<mode>(inst, a);
+    pc += inst_size(mode);
+}
+
+template<CPU::AddrMode mode>
+void CPU::stx(uint8_t* inst) {
+    write_operand<mode>(inst, x);
+    pc += inst_size(mode);
+}
+
+template<CPU::AddrMode mode>
+void CPU::sty(uint8_t* inst) {
+    write_operand<mode>(inst, y);
+    pc += inst_size(mode);
 }
 
-CPU::InstInfo CPU::tax(uint8_t* inst) {
-	InstInfo info = {"TAX", 1};
+void CPU::tax(uint8_t* inst) {
     x = a;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = x == 0;
     status.flag.n = sign_bit(x);
-	return info;
 }
 
-CPU::InstInfo CPU::tay(uint8_t* inst) {
-	InstInfo info = {"TAY", 1};
+void CPU::tay(uint8_t* inst) {
     y = a;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = y == 0;
     status.flag.n = sign_bit(y);
-	return info;
 }
 
-CPU::InstInfo CPU::tsx(uint8_t* inst) {
-	InstInfo info = {"TSX", 1};
+void CPU::tsx(uint8_t* inst) {
     x = sp;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = x == 0;
     status.flag.n = sign_bit(x);
-	return info;
 }
 
-CPU::InstInfo CPU::txa(uint8_t* inst) {
-	InstInfo info = {"TXA", 1};
+void CPU::txa(uint8_t* inst) {
     a = x;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
 }
 
-CPU::InstInfo CPU::txs(uint8_t* inst) {
-	InstInfo info = {"TXS", 1};
+void CPU::txs(uint8_t* inst) {
     sp = x;
-    pc += info.inst_size;
-	return info;
+    pc += 1;
 }
 
-CPU::InstInfo CPU::tya(uint8_t* inst) {
-	InstInfo info = {"TYA", 1};
+void CPU::tya(uint8_t* inst) {
     a = y;
-    pc += info.inst_size;
+    pc += 1;
     status.flag.z = a == 0;
     status.flag.n = sign_bit(a);
-	return info;
-}
-
-CPU::InstInfo CPU::ill_nop(uint8_t* inst) {
-	InstInfo info = {"NOP", 1};
-	switch (inst[0]) {
-		case 0x1A: case 0x3A: case 0x5A: case 0x7A: case 0xDA: case 0xFA:
-			break;
-		case 0x80: case 0x82: case 0x89: case 0xC2: case 0xE2:
-		case 0x04: case 0x44: case 0x64: case 0x14: case 0x34:
-		case 0x54: case 0x74: case 0xD4: case 0xF4:
-			info.inst_size = 2;
-			break;
-		case 0x0C: case 0x1C: case 0x3C: case 0x5C: case 0x7C:
-		case 0xDC: case 0xFC:
-			info.inst_size = 3;
-			break;
-	}
-	pc += info.inst_size;
-	return info;
+}
+
+template<CPU::AddrMode mode>
+void CPU::ill_nop(uint8_t* inst) {
+	if constexpr(mode == ABSX)
+		read_operand<mode>(inst);  // dummy read, for the page cross cycle
+	pc += inst_size(mode);
+}
+
+void CPU::bad(uint8_t* inst) {
+    attention.fetch_or(ATTN_HALT);
 }
@@ -1,21 +1,44 @@
 #ifndef NESEMU_CPU_H
 #define NESEMU_CPU_H
 
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cstdint>
 #include <string>
 
+#include "bus.h"
 #include "ram.h"
-#include "rom.h"
+#include "scheduler.h"
+#include "state.h"
+#include "trace.h"
+
+/** Reasons for the run loops to leave the fast path, see CPU::check_stop */
+#define ATTN_TRACE 0x01
+#define ATTN_BREAKPOINT 0x02
+#define ATTN_HALT 0x04
+#define ATTN_STOP 0x08
+#define ATTN_NMI 0x10
+#define ATTN_IRQ 0x20
+#define ATTN_FRAME 0x40
 
 uint16_t fix_endian(uint8_t* bin);
 
+class Jit;
+
 class CPU {
+    /** Runs many CPUs' instructions together while they agree, see lockstep.h */
+    friend class LockstepCPU;
+    /** Generates code that works on the registers and the bus directly, see jit.h */
+    friend class Jit;
+
 private:
     uint8_t a;      // Accumulator
     uint8_t x;      // Register X
     uint8_t y;      // Register Y
     uint16_t pc;    // Program Counter
     uint8_t sp;     // Stack Pointer
+    uint64_t cycles; // Cycles executed since power on
 
     /**
      * 7	N	Negative	Compare: Set if the register's value is less than the input value
@@ -52,18 +75,80 @@ private:
     } status;
 
     RAM& ram;
-    ROM& rom;
-    /** TODO: Move when I figure out where these should actually go */
-    uint8_t* ppu_reg;
-    uint8_t* apu_io_reg;
-    uint8_t* apu_io_test;
-    uint8_t* cart_space;
+
+public:
+    enum Engine {
+        ENGINE_TABLE,       // Indirect call through the dispatch table for every instruction
+        ENGINE_THREADED,    // Threaded code, each opcode body jumps straight to the next one
+        ENGINE_JIT,         // Hot blocks compiled to native code, the table for the rest. x86-64 Linux only
+    };
+
+    /** Why run(), run_for() or step() returned */
+    enum StopReason {
+        STOP_NONE,              // step() executed every instruction it was asked to
+        STOP_ILLEGAL_OPCODE,    // Reached an opcode that is not implemented
+        STOP_BREAKPOINT,        // Reached a breakpoint address
+        STOP_CYCLE_BUDGET,      // Used up the cycles given to run_for()
+        STOP_FRAME_COMPLETE,    // end_frame() was called, a device finished a video frame
+        STOP_EXTERNAL,          // request_stop() was called
+    };
 
     typedef struct inst_info {
         char inst_name[4];
-        int inst_size;
+        uint8_t inst_size;
+        uint8_t inst_cycles;
     } InstInfo;
 
+private:
+    Engine engine;
+    uint64_t run_deadline;  // End of the cycle budget of the current run
+    uint64_t deadline;      // The earlier of run_deadline and the next scheduled event
+    std::bitset<0x10000> breakpoints;
+    bool breakpoint_armed;
+    /**
+     * Non zero while the run loops have to take the slow path before every
+     * instruction (tracing, breakpoints, interrupts, a halt, the end of a
+     * frame or a stop request). Atomic so request_stop() can be called
+     * from another thread.
+     */
+    std::atomic<uint8_t> attention;
+
+    Bus bus;
+    Scheduler scheduler;
+    uint8_t fetch_buf[3];
+    TraceSink* trace_sink;
+    Jit* jit;               // Created the first time ENGINE_JIT is set
+
+    static const InstInfo inst_info[256];
+
+    /** Addressing modes, used to specialize the instruction handlers at compile time */
+    enum AddrMode {
+        IMP,    // Implied
+        ACC,    // Accumulator
+        IMM,    // Immediate
+        ZP,     // Zero Page
+        ZPX,    // Zero Page, X
+        ZPY,    // Zero Page, Y
+        ABS,    // Absolute
+        ABSX,   // Absolute, X
+        ABSY,   // Absolute, Y
+        IND,    // Indirect
+        INDX,   // (Indirect, X)
+        INDY,   // (Indirect), Y
+    };
+
+    typedef void (CPU::*Handler)(uint8_t* inst);
+    typedef std::array<Handler, 256> DispatchTable;
+
+    static const DispatchTable dispatch_table;
+    static constexpr DispatchTable build_dispatch_table();
+
+    /** Operand fetchers, specialized per addressing mode */
+    static constexpr int inst_size(AddrMode mode);
+    template<AddrMode mode> uint16_t operand_addr(uint8_t* inst);
+    template<AddrMode mode, bool page_penalty = true> uint8_t read_operand(uint8_t* inst);
+    template<AddrMode mode> void write_operand(uint8_t* inst, uint8_t value);
+
     typedef struct cpu_state {
     	uint8_t a;
     	uint8_t x;
@@ -71,79 +156,141 @@ private:
     	uint16_t pc;
     	uint8_t sp;
     	uint8_t sr;
+    	uint64_t cycles;
     } CPUState;
 
-	void log(InstInfo info, CPUState state);
-    uint8_t* access_mem(uint16_t addr);
+    void trace();
+    void interrupt(uint16_t vector);
+    static void wake(void* cpu, uint64_t cycle);
+    StopReason run_until(uint64_t deadline);
+    /** One pass of run_table(), for LockstepCPU to run a lane's instruction */
+    StopReason step_until(uint64_t deadline);
+    StopReason check_stop();
+    StopReason run_table();
+    StopReason run_threaded();
+    StopReason run_jit();
+    uint8_t* fetch(uint16_t addr);
+    void map_memory();
     uint16_t load_address(uint16_t addr);
-    InstInfo exec_inst(uint8_t* inst);
+    void exec_inst(uint8_t* inst);
     CPUState save_cpu_state();
+    template<typename State> void serialize(State& state);
 
     /** CPU INSTRUCTIONS */
-    InstInfo adc(uint8_t* inst);
-    InstInfo and_(uint8_t* inst);
-    InstInfo asl(uint8_t* inst);
-    InstInfo bcc(uint8_t* inst);
-    InstInfo bcs(uint8_t* inst);
-    InstInfo beq(uint8_t* inst);
-    InstInfo bit(uint8_t* inst);
-    InstInfo bmi(uint8_t* inst);
-    InstInfo bne(uint8_t* inst);
-    InstInfo bpl(uint8_t* inst);
-    InstInfo brk(uint8_t* inst);
-    InstInfo bvc(uint8_t* inst);
-    InstInfo bvs(uint8_t* inst);
-    InstInfo clc(uint8_t* inst);
-    InstInfo cld(uint8_t* inst);
-    InstInfo cli(uint8_t* inst);
-    InstInfo clv(uint8_t* inst);
-    InstInfo cmp(uint8_t* inst);
-    InstInfo cpx(uint8_t* inst);
-    InstInfo cpy(uint8_t* inst);
-    InstInfo dec(uint8_t* inst);
-    InstInfo dex(uint8_t* inst);
-    InstInfo dey(uint8_t* inst);
-    InstInfo eor(uint8_t* inst);
-    InstInfo inc(uint8_t* inst);
-    InstInfo inx(uint8_t* inst);
-    InstInfo iny(uint8_t* inst);
-    InstInfo jmp(uint8_t* inst);
-    InstInfo jsr(uint8_t* inst);
-    InstInfo lda(uint8_t* inst);
-    InstInfo ldx(uint8_t* inst);
-    InstInfo ldy(uint8_t* inst);
-    InstInfo lsr(uint8_t* inst);
-    InstInfo nop(uint8_t* inst);
-    InstInfo ora(uint8_t* inst);
-    InstInfo pha(uint8_t* inst);
-    InstInfo php(uint8_t* inst);
-    InstInfo pla(uint8_t* inst);
-    InstInfo plp(uint8_t* inst);
-    InstInfo rol(uint8_t* inst);
-    InstInfo ror(uint8_t* inst);
-    InstInfo rti(uint8_t* inst);
-    InstInfo rts(uint8_t* inst);
-    InstInfo sbc(uint8_t* inst);
-    InstInfo sec(uint8_t* inst);
-    InstInfo sed(uint8_t* inst);
-    InstInfo sei(uint8_t* inst);
-    InstInfo sta(uint8_t* inst);
-    InstInfo stx(uint8_t* inst);
-    InstInfo sty(uint8_t* inst);
-    InstInfo tax(uint8_t* inst);
-    InstInfo tay(uint8_t* inst);
-    InstInfo tsx(uint8_t* inst);
-    InstInfo txa(uint8_t* inst);
-    InstInfo txs(uint8_t* inst);
-    InstInfo tya(uint8_t* inst);
-
-    InstInfo ill_nop(uint8_t* inst);
+    template<AddrMode mode> void adc(uint8_t* inst);
+    template<AddrMode mode> void and_(uint8_t* inst);
+    template<AddrMode mode> void asl(uint8_t* inst);
+    void branch(uint8_t* inst, bool taken);
+    void bcc(uint8_t* inst);
+    void bcs(uint8_t* inst);
+    void beq(uint8_t* inst);
+    template<AddrMode mode> void bit(uint8_t* inst);
+    void bmi(uint8_t* inst);
+    void bne(uint8_t* inst);
+    void bpl(uint8_t* inst);
+    void brk(uint8_t* inst);
+    void bvc(uint8_t* inst);
+    void bvs(uint8_t* inst);
+    void clc(uint8_t* inst);
+    void cld(uint8_t* inst);
+    void cli(uint8_t* inst);
+    void clv(uint8_t* inst);
+    template<AddrMode mode> void cmp(uint8_t* inst);
+    template<AddrMode mode> void cpx(uint8_t* inst);
+    template<AddrMode mode> void cpy(uint8_t* inst);
+    template<AddrMode mode> void dec(uint8_t* inst);
+    void dex(uint8_t* inst);
+    void dey(uint8_t* inst);
+    template<AddrMode mode> void eor(uint8_t* inst);
+    template<AddrMode mode> void inc(uint8_t* inst);
+    void inx(uint8_t* inst);
+    void iny(uint8_t* inst);
+    template<AddrMode mode> void jmp(uint8_t* inst);
+    void jsr(uint8_t* inst);
+    template<AddrMode mode> void lda(uint8_t* inst);
+    template<AddrMode mode> void ldx(uint8_t* inst);
+    template<AddrMode mode> void ldy(uint8_t* inst);
+    template<AddrMode mode> void lsr(uint8_t* inst);
+    void nop(uint8_t* inst);
+    template<AddrMode mode> void ora(uint8_t* inst);
+    void pha(uint8_t* inst);
+    void php(uint8_t* inst);
+    void pla(uint8_t* inst);
+    void plp(uint8_t* inst);
+    template<AddrMode mode> void rol(uint8_t* inst);
+    template<AddrMode mode> void ror(uint8_t* inst);
+    void rti(uint8_t* inst);
+    void rts(uint8_t* inst);
+    template<AddrMode mode> void sbc(uint8_t* inst);
+    void sec(uint8_t* inst);
+    void sed(uint8_t* inst);
+    void sei(uint8_t* inst);
+    template<AddrMode mode> void sta(uint8_t* inst);
+    template<AddrMode mode> void stx(uint8_t* inst);
+    template<AddrMode mode> void sty(uint8_t* inst);
+    void tax(uint8_t* inst);
+    void tay(uint8_t* inst);
+    void tsx(uint8_t* inst);
+    void txa(uint8_t* inst);
+    void txs(uint8_t* inst);
+    void tya(uint8_t* inst);
+
+    template<AddrMode mode> void ill_nop(uint8_t* inst);
+    void bad(uint8_t* inst);
 
 
 public:
-    CPU(RAM& ram, ROM& rom);
+    CPU(RAM& ram);
+    ~CPU();
+
+    /** ENGINE_JIT falls back to ENGINE_TABLE where there is no JIT */
+    void set_engine(Engine engine);
+    /** Off at power on. Instructions are only traced once a sink is set */
+    void set_tracing(bool tracing);
+    /** Where traced instructions go. Every CPU has its own, there is no default */
+    void set_trace_sink(TraceSink* sink);
+    void add_breakpoint(uint16_t addr);
+    void remove_breakpoint(uint16_t addr);
+    uint64_t get_cycles();
+    Bus& get_bus();
+    /** Events for the devices on the bus, run by the CPU when their cycle comes */
+    Scheduler& get_scheduler();
+    static const InstInfo& get_inst_info(uint8_t opcode);
+
+    /** Runs until an illegal opcode, a breakpoint or a stop request */
+	StopReason run();
+    /** Runs until at least the given number of cycles have passed */
+    StopReason run_for(uint64_t cycles);
+    /** Executes count instructions */
+    StopReason step(int count = 1);
+    /** Makes the running CPU return STOP_EXTERNAL, may be called from any thread */
+    void request_stop();
+    /** Makes the CPU return STOP_FRAME_COMPLETE before the next instruction */
+    void end_frame();
+    /**
+     * Adds cycles the CPU spends halted, for DMA. Called from an I/O
+     * handler, it delays the next instruction and any interrupt with it.
+     */
+    void stall(uint64_t cycles);
+    /** Raises a non maskable interrupt, taken before the next instruction */
+    void nmi();
+    /** Sets the level of the IRQ line, taken before the next instruction with I clear */
+    void set_irq(bool asserted);
+    /**
+     * Loads pc from the reset vector through the bus, so the cartridge has
+     * to be mapped first, and sets SP and I as RESET does
+     */
+    void reset();
+    /** Starts at addr instead of the reset vector, as nestest's automated mode does */
+    void set_pc(uint16_t addr);
 
-	void run();
+    /**
+     * Registers, pending interrupts and the scheduler's pending events.
+     * Tracing, breakpoints and the engine are settings of the instance and
+     * are kept on load.
+     */
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
 };
 
 
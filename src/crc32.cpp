@@ -0,0 +1,25 @@
+#include "crc32.h"
+
+#include <array>
+
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+static constexpr std::array<uint32_t, 256> build_crc32_table() {
+    std::array<uint32_t, 256> table = {};
+    for(uint32_t i=0; i<256; i++) {
+        uint32_t crc = i;
+        for(int bit=0; bit<8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+        table[i] = crc;
+    }
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc32_table = build_crc32_table();
+
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc) {
+    crc = ~crc;
+    for(size_t i=0; i<len; i++)
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
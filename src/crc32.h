@@ -0,0 +1,14 @@
+#ifndef NESEMU_CRC32_H
+#define NESEMU_CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CRC-32 as used by zip and ROM databases. Pass the result of a previous
+ * call as crc to checksum data in pieces.
+ */
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0);
+
+
+#endif //NESEMU_CRC32_H
@@ -0,0 +1,95 @@
+#include "input_script.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <strings.h>
+
+static const struct {
+    const char* name;
+    uint8_t button;
+} button_names[] = {
+    {"a", Controller::BUTTON_A}, {"b", Controller::BUTTON_B},
+    {"select", Controller::BUTTON_SELECT}, {"start", Controller::BUTTON_START},
+    {"up", Controller::BUTTON_UP}, {"down", Controller::BUTTON_DOWN},
+    {"left", Controller::BUTTON_LEFT}, {"right", Controller::BUTTON_RIGHT},
+};
+
+InputScript::InputScript() {
+    next = 0;
+}
+
+const std::string& InputScript::get_error() {
+    return error;
+}
+
+bool InputScript::fail(const char* filename, int line, const std::string& message) {
+    error = std::string(filename) + ":" + std::to_string(line) + ": " + message;
+    return false;
+}
+
+bool InputScript::parse_buttons(const std::string& text, uint8_t& buttons) {
+    buttons = 0;
+    if(text == ".")
+        return true;
+    std::stringstream names(text);
+    std::string name;
+    while(std::getline(names, name, '+')) {
+        bool known = false;
+        for(const auto& entry : button_names) {
+            if(strcasecmp(name.c_str(), entry.name) == 0) {
+                buttons |= entry.button;
+                known = true;
+            }
+        }
+        if(!known)
+            return false;
+    }
+    return true;
+}
+
+bool InputScript::load(const char* filename) {
+    changes.clear();
+    next = 0;
+    std::ifstream file(filename);
+    if(!file) {
+        error = std::string(filename) + ": " + strerror(errno);
+        return false;
+    }
+
+    std::string text;
+    for(int line=1; std::getline(file, text); line++) {
+        text = text.substr(0, text.find('#'));
+        std::stringstream fields(text);
+        std::string frame;
+        if(!(fields >> frame))
+            continue;
+
+        Change change = {};
+        char* end;
+        change.frame = strtoull(frame.c_str(), &end, 10);
+        if(*end != '\0')
+            return fail(filename, line, "bad frame number '" + frame + "'");
+        if(!changes.empty() && change.frame <= changes.back().frame)
+            return fail(filename, line, "frames must increase");
+        std::string pad;
+        for(int port=0; port<CONTROLLER_PORTS && fields >> pad; port++) {
+            if(!parse_buttons(pad, change.buttons[port]))
+                return fail(filename, line, "bad buttons '" + pad + "'");
+        }
+        if(fields >> pad)
+            return fail(filename, line, "more than " + std::to_string(CONTROLLER_PORTS) + " pads");
+        changes.push_back(change);
+    }
+    return true;
+}
+
+void InputScript::apply(uint64_t frame, Controller& controller) {
+    while(next < changes.size() && changes[next].frame <= frame) {
+        for(int port=0; port<CONTROLLER_PORTS; port++)
+            controller.set_buttons(port, changes[next].buttons[port]);
+        next++;
+    }
+}
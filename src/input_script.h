@@ -0,0 +1,47 @@
+#ifndef NESEMU_INPUT_SCRIPT_H
+#define NESEMU_INPUT_SCRIPT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "controller.h"
+
+/**
+ * Controller input by frame, to play a game without a player. The file is
+ * text with one change per line:
+ *
+ *     FRAME PAD1 [PAD2]
+ *
+ * A pad is button names joined by '+' (a, b, select, start, up, down,
+ * left, right) or '.' for none. The buttons are held from that frame until
+ * the next line, whose frame must be later. Blank lines and everything
+ * after a '#' are skipped.
+ */
+class InputScript {
+private:
+    typedef struct change {
+        uint64_t frame;
+        uint8_t buttons[CONTROLLER_PORTS];
+    } Change;
+
+    std::vector<Change> changes;
+    size_t next;
+    std::string error;
+
+    bool parse_buttons(const std::string& text, uint8_t& buttons);
+    bool fail(const char* filename, int line, const std::string& message);
+
+public:
+    InputScript();
+
+    /** False if the file could not be read or parsed, get_error() says where */
+    bool load(const char* filename);
+    const std::string& get_error();
+
+    /** Sets the buttons held during a frame. Frames must come in order */
+    void apply(uint64_t frame, Controller& controller);
+};
+
+
+#endif //NESEMU_INPUT_SCRIPT_H
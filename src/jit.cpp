@@ -0,0 +1,1123 @@
+#include "jit.h"
+
+#include <array>
+#include <cstring>
+#include <deque>
+#include <initializer_list>
+
+#include "cpu.h"
+#include "opcodes.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_SPACE (64 << 10)  // Well over the code of the largest block
+#define JIT_PAGE_SIZE 4096
+#define JIT_HOT 16      // Visits to a pc before a block is compiled there
+#define JIT_MAX_REWRITES 8  // Recompiles of a block in RAM before it is left uncompiled
+
+uint8_t Jit::read(CPU* cpu, uint16_t addr) {
+    return cpu->bus.read8(addr);
+}
+
+void Jit::write(CPU* cpu, uint16_t addr, uint8_t value) {
+    cpu->bus.write8(addr, value);
+}
+
+size_t Jit::get_block_count() {
+    return storage.size();
+}
+
+#ifdef JIT_SUPPORTED
+
+namespace {
+
+/** The CPU's addressing modes, so the opcode table expands the same */
+enum AddrMode {
+    IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABSX, ABSY, IND, INDX, INDY,
+};
+
+enum Op {
+    OP_ADC, OP_AND, OP_ASL, OP_BCC, OP_BCS, OP_BEQ, OP_BIT, OP_BMI, OP_BNE, OP_BPL, OP_BRK, OP_BVC,
+    OP_BVS, OP_CLC, OP_CLD, OP_CLI, OP_CLV, OP_CMP, OP_CPX, OP_CPY, OP_DEC, OP_DEX, OP_DEY, OP_EOR,
+    OP_INC, OP_INX, OP_INY, OP_JMP, OP_JSR, OP_LDA, OP_LDX, OP_LDY, OP_LSR, OP_NOP, OP_ORA, OP_PHA,
+    OP_PHP, OP_PLA, OP_PLP, OP_ROL, OP_ROR, OP_RTI, OP_RTS, OP_SBC, OP_SEC, OP_SED, OP_SEI, OP_STA,
+    OP_STX, OP_STY, OP_TAX, OP_TAY, OP_TSX, OP_TXA, OP_TXS, OP_TYA, OP_ILL_NOP, OP_BAD,
+};
+
+typedef struct decoded {
+    Op op;
+    AddrMode mode;
+} Decoded;
+
+/** One name per CPU handler, so CPU_OPCODES expands to what each opcode does */
+namespace ops {
+template<AddrMode mode> constexpr Decoded adc = {OP_ADC, mode};
+template<AddrMode mode> constexpr Decoded and_ = {OP_AND, mode};
+template<AddrMode mode> constexpr Decoded asl = {OP_ASL, mode};
+constexpr Decoded bcc = {OP_BCC, IMP};
+constexpr Decoded bcs = {OP_BCS, IMP};
+constexpr Decoded beq = {OP_BEQ, IMP};
+template<AddrMode mode> constexpr Decoded bit = {OP_BIT, mode};
+constexpr Decoded bmi = {OP_BMI, IMP};
+constexpr Decoded bne = {OP_BNE, IMP};
+constexpr Decoded bpl = {OP_BPL, IMP};
+constexpr Decoded brk = {OP_BRK, IMP};
+constexpr Decoded bvc = {OP_BVC, IMP};
+constexpr Decoded bvs = {OP_BVS, IMP};
+constexpr Decoded clc = {OP_CLC, IMP};
+constexpr Decoded cld = {OP_CLD, IMP};
+constexpr Decoded cli = {OP_CLI, IMP};
+constexpr Decoded clv = {OP_CLV, IMP};
+template<AddrMode mode> constexpr Decoded cmp = {OP_CMP, mode};
+template<AddrMode mode> constexpr Decoded cpx = {OP_CPX, mode};
+template<AddrMode mode> constexpr Decoded cpy = {OP_CPY, mode};
+template<AddrMode mode> constexpr Decoded dec = {OP_DEC, mode};
+constexpr Decoded dex = {OP_DEX, IMP};
+constexpr Decoded dey = {OP_DEY, IMP};
+template<AddrMode mode> constexpr Decoded eor = {OP_EOR, mode};
+template<AddrMode mode> constexpr Decoded inc = {OP_INC, mode};
+constexpr Decoded inx = {OP_INX, IMP};
+constexpr Decoded iny = {OP_INY, IMP};
+template<AddrMode mode> constexpr Decoded jmp = {OP_JMP, mode};
+constexpr Decoded jsr = {OP_JSR, ABS};
+template<AddrMode mode> constexpr Decoded lda = {OP_LDA, mode};
+template<AddrMode mode> constexpr Decoded ldx = {OP_LDX, mode};
+template<AddrMode mode> constexpr Decoded ldy = {OP_LDY, mode};
+template<AddrMode mode> constexpr Decoded lsr = {OP_LSR, mode};
+constexpr Decoded nop = {OP_NOP, IMP};
+template<AddrMode mode> constexpr Decoded ora = {OP_ORA, mode};
+constexpr Decoded pha = {OP_PHA, IMP};
+constexpr Decoded php = {OP_PHP, IMP};
+constexpr Decoded pla = {OP_PLA, IMP};
+constexpr Decoded plp = {OP_PLP, IMP};
+template<AddrMode mode> constexpr Decoded rol = {OP_ROL, mode};
+template<AddrMode mode> constexpr Decoded ror = {OP_ROR, mode};
+constexpr Decoded rti = {OP_RTI, IMP};
+constexpr Decoded rts = {OP_RTS, IMP};
+template<AddrMode mode> constexpr Decoded sbc = {OP_SBC, mode};
+constexpr Decoded sec = {OP_SEC, IMP};
+constexpr Decoded sed = {OP_SED, IMP};
+constexpr Decoded sei = {OP_SEI, IMP};
+template<AddrMode mode> constexpr Decoded sta = {OP_STA, mode};
+template<AddrMode mode> constexpr Decoded stx = {OP_STX, mode};
+template<AddrMode mode> constexpr Decoded sty = {OP_STY, mode};
+constexpr Decoded tax = {OP_TAX, IMP};
+constexpr Decoded tay = {OP_TAY, IMP};
+constexpr Decoded tsx = {OP_TSX, IMP};
+constexpr Decoded txa = {OP_TXA, IMP};
+constexpr Decoded txs = {OP_TXS, IMP};
+constexpr Decoded tya = {OP_TYA, IMP};
+template<AddrMode mode> constexpr Decoded ill_nop = {OP_ILL_NOP, mode};
+}
+
+constexpr std::array<Decoded, 256> build_decode_table() {
+    std::array<Decoded, 256> t = {};
+#define X(opcode, handler, name, size, cycles) t[opcode] = ops::handler;
+#define B(opcode) t[opcode] = {OP_BAD, IMP};
+    CPU_OPCODES(X, B)
+#undef X
+#undef B
+    return t;
+}
+
+const std::array<Decoded, 256> decode_table = build_decode_table();
+
+enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/** Where the 6502 state lives while a block runs, all callee saved */
+#define R_CPU RBX
+#define R_CYCLES RBP
+#define R_A R12
+#define R_X R13
+#define R_Y R14
+#define R_P R15
+
+/** Condition codes, for jcc and setcc */
+enum Cond {
+    CC_E = 0x4, CC_NE = 0x5,
+};
+
+/** Group 1 operations, the /digit of their 0x81 and 0x83 forms */
+enum Alu {
+    ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP,
+};
+
+/** [base + index * (1 << scale) + disp], index -1 for none */
+typedef struct mem {
+    int base;
+    int index;
+    int scale;
+    int32_t disp;
+} Mem;
+
+Mem at(int base, int32_t disp) {
+    return {base, -1, 0, disp};
+}
+
+Mem at_index(int base, int index, int scale, int32_t disp) {
+    return {base, index, scale, disp};
+}
+
+/** Stack slots of the block: set once an access went to an I/O handler, and scratch */
+const Mem IO_DONE = at(RSP, 0);
+const Mem TEMP = at(RSP, 8);
+#define FRAME_SIZE 24
+
+typedef struct label {
+    int pos = -1;
+    std::vector<size_t> fixups;     // rel32 fields waiting for pos
+} Label;
+
+/**
+ * Just enough of an x86-64 assembler for the code generator. Operations
+ * on registers are 32 bit unless named 64 or 8. Writes nothing past the
+ * end of the buffer, overflowed() tells whether the code did not fit.
+ */
+class Emitter {
+private:
+    uint8_t* buf;
+    size_t capacity;
+    size_t size;
+
+    static bool is_byte_reg(int reg) {
+        return reg >= RSP && reg <= RDI;    // Need a REX prefix to mean spl to dil rather than ah to bh
+    }
+
+    void rex(int w, int reg, int index, int base, bool force) {
+        uint8_t prefix = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+        if(prefix != 0x40 || force)
+            byte(prefix);
+    }
+
+    void opcode(std::initializer_list<uint8_t> bytes) {
+        for(uint8_t b : bytes)
+            byte(b);
+    }
+
+    /** Register and memory operand, always with a 32 bit displacement if any */
+    void mem(std::initializer_list<uint8_t> op, int reg, Mem m, int w = 0, bool byte_reg = false) {
+        rex(w, reg, m.index < 0 ? 0 : m.index, m.base, byte_reg && is_byte_reg(reg));
+        opcode(op);
+        int mod = m.disp == 0 && (m.base & 7) != RBP ? 0 : 2;
+        if(m.index < 0 && (m.base & 7) != RSP) {
+            byte(mod << 6 | (reg & 7) << 3 | (m.base & 7));
+        } else {
+            byte(mod << 6 | (reg & 7) << 3 | 4);
+            byte(m.scale << 6 | ((m.index < 0 ? RSP : m.index) & 7) << 3 | (m.base & 7));
+        }
+        if(mod == 2)
+            imm32(m.disp);
+    }
+
+    void reg(std::initializer_list<uint8_t> op, int reg, int rm, int w = 0, bool byte_reg = false) {
+        rex(w, reg, 0, rm, byte_reg && (is_byte_reg(reg) || is_byte_reg(rm)));
+        opcode(op);
+        byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void rel32(Label& label) {
+        if(label.pos >= 0) {
+            imm32(label.pos - (int32_t)(size + 4));
+        } else {
+            label.fixups.push_back(size);
+            imm32(0);
+        }
+    }
+
+public:
+    Emitter(uint8_t* buf, size_t capacity): buf(buf), capacity(capacity), size(0) {}
+
+    size_t get_size() {
+        return size;
+    }
+
+    bool overflowed() {
+        return size > capacity;
+    }
+
+    void byte(uint8_t b) {
+        if(size < capacity)
+            buf[size] = b;
+        size++;
+    }
+
+    void imm16(uint16_t value) {
+        byte(value);
+        byte(value >> 8);
+    }
+
+    void imm32(uint32_t value) {
+        imm16(value);
+        imm16(value >> 16);
+    }
+
+    void imm64(uint64_t value) {
+        imm32(value);
+        imm32(value >> 32);
+    }
+
+    void bind(Label& label) {
+        label.pos = size;
+        for(size_t fixup : label.fixups) {
+            int32_t rel = label.pos - (int32_t)(fixup + 4);
+            if(fixup + 4 <= capacity)
+                memcpy(buf + fixup, &rel, 4);
+        }
+        label.fixups.clear();
+    }
+
+    void mov(int dst, int src) { reg({0x89}, src, dst); }
+    void mov64(int dst, int src) { reg({0x89}, src, dst, 1); }
+    void movi(int dst, uint32_t value) { rex(0, 0, 0, dst, false); byte(0xB8 + (dst & 7)); imm32(value); }
+    void movi64(int dst, uint64_t value) { rex(1, 0, 0, dst, false); byte(0xB8 + (dst & 7)); imm64(value); }
+    void movzx8(int dst, int src) { reg({0x0F, 0xB6}, dst, src, 0, true); }
+    void movzx8(int dst, Mem m) { mem({0x0F, 0xB6}, dst, m); }
+    void load(int dst, Mem m) { mem({0x8B}, dst, m); }
+    void load64(int dst, Mem m) { mem({0x8B}, dst, m, 1); }
+    void store(Mem m, int src) { mem({0x89}, src, m); }
+    void store64(Mem m, int src) { mem({0x89}, src, m, 1); }
+    void store8(Mem m, int src) { mem({0x88}, src, m, 0, true); }
+    void store8i(Mem m, uint8_t value) { mem({0xC6}, 0, m); byte(value); }
+    void store16(Mem m, int src) { byte(0x66); mem({0x89}, src, m); }
+    void store16i(Mem m, uint16_t value) { byte(0x66); mem({0xC7}, 0, m); imm16(value); }
+    void inc8(Mem m) { mem({0xFE}, 0, m); }
+    void dec8(Mem m) { mem({0xFE}, 1, m); }
+    void cmp8i(Mem m, uint8_t value) { mem({0x80}, ALU_CMP, m); byte(value); }
+
+    void alu(Alu op, int dst, int src) { reg({(uint8_t)(op * 8 + 1)}, src, dst); }
+    void alu(Alu op, int dst, Mem m) { mem({(uint8_t)(op * 8 + 3)}, dst, m); }
+    void alu64(Alu op, int dst, int src) { reg({(uint8_t)(op * 8 + 1)}, src, dst, 1); }
+
+    void alui(Alu op, int dst, int32_t value, int w = 0) {
+        if(value >= -128 && value <= 127) {
+            reg({0x83}, op, dst, w);
+            byte(value);
+        } else {
+            reg({0x81}, op, dst, w);
+            imm32(value);
+        }
+    }
+
+    void alui64(Alu op, int dst, int32_t value) { alui(op, dst, value, 1); }
+    void test(int a, int b) { reg({0x85}, b, a); }
+    void test64(int a, int b) { reg({0x85}, b, a, 1); }
+    void testi(int dst, uint32_t value) { reg({0xF7}, 0, dst); imm32(value); }
+    void not_(int dst) { reg({0xF7}, 2, dst); }
+    void shl(int dst, uint8_t count) { reg({0xC1}, 4, dst); byte(count); }
+    void shr(int dst, uint8_t count) { reg({0xC1}, 5, dst); byte(count); }
+    void setcc(Cond cc, int dst) { reg({0x0F, (uint8_t)(0x90 + cc)}, 0, dst, 0, true); }
+    void jcc(Cond cc, Label& label) { byte(0x0F); byte(0x80 + cc); rel32(label); }
+    void jmp(Label& label) { byte(0xE9); rel32(label); }
+    void call(const void* function) { movi64(RAX, (uint64_t)function); byte(0xFF); byte(0xD0); }
+    void push(int r) { rex(0, 0, 0, r, false); byte(0x50 + (r & 7)); }
+    void pop(int r) { rex(0, 0, 0, r, false); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xC3); }
+};
+
+/** How an instruction left the block's code */
+enum Flow {
+    FLOW_NEXT,      // Goes on with the next instruction
+    FLOW_END,       // Goes on with the next instruction, but the block has to end first
+    FLOW_JUMPED,    // Left through an exit of its own
+};
+
+/**
+ * Translates one block, an instruction at a time. The code mirrors the
+ * CPU's handlers in cpu.cpp quirk for quirk, including the order of the
+ * bus accesses and when cycles are added, since I/O handlers see both.
+ */
+class BlockCompiler {
+private:
+    typedef struct exit {
+        uint16_t pc;
+        Label label;
+    } Exit;
+
+    Emitter& e;
+    const Jit::Layout& layout;
+    Label epilogue;
+    std::deque<Exit> exits;     // Stable references, labels are patched through them
+    bool accessed;              // The current instruction went through the bus
+    bool wrote;
+
+    Mem cpu_field(int32_t offset) {
+        return at(R_CPU, offset);
+    }
+
+    /** Leaves the block with pc set to a known address */
+    Label& exit_to(uint16_t pc) {
+        for(Exit& exit : exits) {
+            if(exit.pc == pc)
+                return exit.label;
+        }
+        exits.push_back({pc, {}});
+        return exits.back().label;
+    }
+
+    /**
+     * Byte at the address in esi into eax, straight from the page table or
+     * through the bus, which clobbers every caller saved register.
+     */
+    void read() {
+        accessed = true;
+        Label slow, done;
+        e.mov(RAX, RSI);
+        e.shr(RAX, 8);
+        e.load64(RDX, at_index(R_CPU, RAX, 3, layout.read_pages));
+        e.test64(RDX, RDX);
+        e.jcc(CC_E, slow);
+        e.movzx8(RCX, RSI);
+        e.movzx8(RAX, at_index(RDX, RCX, 0, 0));
+        e.jmp(done);
+        e.bind(slow);
+        e.store8i(IO_DONE, 1);
+        e.store64(cpu_field(layout.cycles), R_CYCLES);
+        e.mov64(RDI, R_CPU);
+        e.call(layout.read);
+        e.movzx8(RAX, RAX);
+        e.load64(R_CYCLES, cpu_field(layout.cycles));
+        e.bind(done);
+    }
+
+    /** Stores al to the address in esi, the same way */
+    void write() {
+        accessed = true;
+        wrote = true;
+        Label slow, done;
+        e.mov(RCX, RSI);
+        e.shr(RCX, 8);
+        e.load64(RDX, at_index(R_CPU, RCX, 3, layout.write_pages));
+        e.test64(RDX, RDX);
+        e.jcc(CC_E, slow);
+        e.movzx8(RCX, RSI);
+        e.store8(at_index(RDX, RCX, 0, 0), RAX);
+        e.jmp(done);
+        e.bind(slow);
+        e.store8i(IO_DONE, 1);
+        e.store64(cpu_field(layout.cycles), R_CYCLES);
+        e.mov(RDX, RAX);
+        e.mov64(RDI, R_CPU);
+        e.call(layout.write);
+        e.load64(R_CYCLES, cpu_field(layout.cycles));
+        e.bind(done);
+    }
+
+    /** CPU::load_address(), high byte first, into esi */
+    void load_address(int high_reg, int32_t high_offset, int low_reg, int32_t low_offset, uint8_t wrap) {
+        for(int half=0; half<2; half++) {
+            int base = half == 0 ? high_reg : low_reg;
+            int32_t offset = half == 0 ? high_offset : low_offset;
+            if(base < 0) {
+                e.movi(RSI, offset);
+            } else {
+                e.mov(RSI, base);
+                e.alui(ALU_ADD, RSI, offset);
+                e.alui(ALU_AND, RSI, wrap);
+            }
+            read();
+            if(half == 0) {
+                e.shl(RAX, 8);
+                e.store(TEMP, RAX);
+            }
+        }
+        e.alu(ALU_OR, RAX, TEMP);
+        e.mov(RSI, RAX);
+    }
+
+    /** One more cycle if esi is on another page than base */
+    void page_penalty(int base) {
+        e.mov(RCX, RSI);
+        e.alu(ALU_XOR, RCX, base);
+        e.shr(RCX, 8);
+        e.setcc(CC_NE, RCX);
+        e.movzx8(RCX, RCX);
+        e.alu64(ALU_ADD, R_CYCLES, RCX);
+    }
+
+    /** CPU::operand_addr() into esi, with read_operand()'s page penalty if asked */
+    void operand_addr(AddrMode mode, const uint8_t* inst, bool penalty) {
+        uint16_t word = inst[1] | inst[2] << 8;
+        switch(mode) {
+            case ZP:
+                e.movi(RSI, inst[1]);
+                break;
+            case ZPX: case ZPY:
+                e.mov(RSI, mode == ZPX ? R_X : R_Y);
+                e.alui(ALU_ADD, RSI, inst[1]);
+                e.alui(ALU_AND, RSI, 0xFF);
+                break;
+            case ABS:
+                e.movi(RSI, word);
+                break;
+            case ABSX: case ABSY:
+                e.mov(RSI, mode == ABSX ? R_X : R_Y);
+                e.alui(ALU_ADD, RSI, word);
+                e.alui(ALU_AND, RSI, 0xFFFF);
+                if(penalty) {
+                    e.movi(RAX, word);
+                    page_penalty(RAX);
+                }
+                break;
+            case IND:
+                load_address(-1, (word & 0xFF00) + ((word + 1) & 0xFF), -1, word, 0);
+                break;
+            case INDX:
+                load_address(R_X, inst[1] + 1, R_X, inst[1], 0xFF);
+                break;
+            case INDY:
+                load_address(-1, (inst[1] + 1) & 0xFF, -1, inst[1], 0);
+                e.alu(ALU_ADD, RSI, R_Y);
+                e.alui(ALU_AND, RSI, 0xFFFF);
+                if(penalty)
+                    page_penalty(RAX);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /** CPU::read_operand() into eax */
+    void read_operand(AddrMode mode, const uint8_t* inst, bool penalty = true) {
+        if(mode == IMM) {
+            e.movi(RAX, inst[1]);
+        } else if(mode == ACC) {
+            e.mov(RAX, R_A);
+        } else {
+            operand_addr(mode, inst, penalty);
+            read();
+        }
+    }
+
+    /** Sets Z, if reg is zero, through ecx */
+    void set_z(int reg) {
+        Label nonzero;
+        e.alui(ALU_AND, R_P, ~0x02);
+        e.test(reg, reg);
+        e.jcc(CC_NE, nonzero);
+        e.alui(ALU_OR, R_P, 0x02);
+        e.bind(nonzero);
+    }
+
+    /** Sets N from bit 7 of reg, through ecx */
+    void set_n(int reg) {
+        e.alui(ALU_AND, R_P, ~0x80);
+        e.mov(RCX, reg);
+        e.alui(ALU_AND, RCX, 0x80);
+        e.alu(ALU_OR, R_P, RCX);
+    }
+
+    void set_zn(int reg) {
+        set_n(reg);
+        set_z(reg);
+    }
+
+    /** Pushes al */
+    void push() {
+        e.movzx8(RSI, cpu_field(layout.sp));
+        e.alui(ALU_OR, RSI, 0x100);
+        write();
+        e.dec8(cpu_field(layout.sp));
+    }
+
+    /** Pulls into eax */
+    void pull() {
+        e.inc8(cpu_field(layout.sp));
+        e.movzx8(RSI, cpu_field(layout.sp));
+        e.alui(ALU_OR, RSI, 0x100);
+        read();
+    }
+
+    /** bus.read16() of the address after the stack pointer, high byte second, into eax */
+    void pull16() {
+        pull();
+        e.store(TEMP, RAX);
+        e.movzx8(RSI, cpu_field(layout.sp));
+        e.alui(ALU_ADD, RSI, 0x101);
+        read();
+        e.shl(RAX, 8);
+        e.alu(ALU_OR, RAX, TEMP);
+    }
+
+    void push_word(uint16_t value) {
+        e.movi(RAX, value >> 8);
+        push();
+        e.movi(RAX, value & 0xFF);
+        push();
+    }
+
+    /** Pulled status in eax, with B clear and U set */
+    void pull_status() {
+        e.mov(R_P, RAX);
+        e.alui(ALU_AND, R_P, ~0x10);
+        e.alui(ALU_OR, R_P, 0x20);
+    }
+
+    void jump_to_eax() {
+        e.store16(cpu_field(layout.pc), RAX);
+        e.jmp(epilogue);
+    }
+
+    void adc() {
+        e.mov(RCX, R_P);
+        e.alui(ALU_AND, RCX, 0x01);
+        e.mov(RDX, R_A);
+        e.alu(ALU_ADD, RDX, RAX);
+        e.alu(ALU_ADD, RDX, RCX);
+        e.mov(RCX, R_A);                // V = ~(a ^ op) & (a ^ result)
+        e.alu(ALU_XOR, RCX, RAX);
+        e.not_(RCX);
+        e.mov(RSI, R_A);
+        e.alu(ALU_XOR, RSI, RDX);
+        e.alu(ALU_AND, RCX, RSI);
+        e.alui(ALU_AND, RCX, 0x80);
+        e.shr(RCX, 1);
+        e.alui(ALU_AND, R_P, ~0x41);
+        e.alu(ALU_OR, R_P, RCX);
+        e.mov(RCX, RDX);
+        e.shr(RCX, 8);
+        e.alu(ALU_OR, R_P, RCX);
+        e.mov(R_A, RDX);
+        e.alui(ALU_AND, R_A, 0xFF);
+        set_zn(R_A);
+    }
+
+    /** C is the inverted sign of the result, as the CPU has it */
+    void sbc() {
+        e.mov(RCX, R_P);
+        e.alui(ALU_AND, RCX, 0x01);
+        e.mov(RDX, R_A);
+        e.alu(ALU_SUB, RDX, RAX);
+        e.alui(ALU_SUB, RDX, 1);
+        e.alu(ALU_ADD, RDX, RCX);
+        e.alui(ALU_AND, RDX, 0xFF);
+        e.mov(RCX, R_A);                // V = (a ^ op) & (a ^ result)
+        e.alu(ALU_XOR, RCX, RAX);
+        e.mov(RSI, R_A);
+        e.alu(ALU_XOR, RSI, RDX);
+        e.alu(ALU_AND, RCX, RSI);
+        e.alui(ALU_AND, RCX, 0x80);
+        e.shr(RCX, 1);
+        e.alui(ALU_AND, R_P, ~0x41);
+        e.alu(ALU_OR, R_P, RCX);
+        e.mov(RCX, RDX);
+        e.shr(RCX, 7);
+        e.alui(ALU_XOR, RCX, 1);
+        e.alu(ALU_OR, R_P, RCX);
+        e.mov(R_A, RDX);
+        set_zn(R_A);
+    }
+
+    void compare(int reg) {
+        e.mov(RDX, reg);
+        e.alu(ALU_SUB, RDX, RAX);
+        e.alui(ALU_AND, R_P, ~0x01);
+        e.mov(RCX, RDX);
+        e.shr(RCX, 31);
+        e.alui(ALU_XOR, RCX, 1);
+        e.alu(ALU_OR, R_P, RCX);
+        set_zn(RDX);
+    }
+
+    void bit() {
+        e.alui(ALU_AND, R_P, ~0xC0);
+        e.mov(RCX, RAX);
+        e.alui(ALU_AND, RCX, 0xC0);
+        e.alu(ALU_OR, R_P, RCX);
+        e.alu(ALU_AND, RAX, R_A);
+        set_z(RAX);
+    }
+
+    /** The shifts, rotates and INC/DEC, with every flag set before the write back */
+    void modify(Op op, AddrMode mode, const uint8_t* inst) {
+        if(mode == ACC) {
+            e.mov(RAX, R_A);
+        } else {
+            operand_addr(mode, inst, false);
+            e.store(TEMP, RSI);
+            read();
+        }
+        switch(op) {
+            case OP_ASL:
+                e.alui(ALU_AND, R_P, ~0x01);
+                e.mov(RCX, RAX);
+                e.shr(RCX, 7);
+                e.alu(ALU_OR, R_P, RCX);
+                e.alu(ALU_ADD, RAX, RAX);
+                e.alui(ALU_AND, RAX, 0xFF);
+                set_zn(RAX);
+                break;
+            case OP_LSR:
+                e.alui(ALU_AND, R_P, ~0x01);
+                e.mov(RCX, RAX);
+                e.alui(ALU_AND, RCX, 0x01);
+                e.alu(ALU_OR, R_P, RCX);
+                e.shr(RAX, 1);
+                set_zn(RAX);
+                break;
+            case OP_ROL: case OP_ROR:
+                e.mov(RCX, R_P);
+                e.alui(ALU_AND, RCX, 0x01);
+                e.mov(RDX, RAX);
+                if(op == OP_ROL) {
+                    e.shr(RDX, 7);
+                    e.alu(ALU_ADD, RAX, RAX);
+                } else {
+                    e.alui(ALU_AND, RDX, 0x01);
+                    e.shl(RCX, 7);
+                    e.shr(RAX, 1);
+                }
+                e.alu(ALU_OR, RAX, RCX);
+                e.alui(ALU_AND, RAX, 0xFF);
+                e.alui(ALU_AND, R_P, ~0x01);
+                e.alu(ALU_OR, R_P, RDX);
+                if(mode == ACC)
+                    e.mov(R_A, RAX);
+                set_n(RAX);
+                set_z(R_A);     // Of A even for memory, as the CPU has it
+                break;
+            case OP_INC: case OP_DEC:
+                e.alui(op == OP_INC ? ALU_ADD : ALU_SUB, RAX, 1);
+                e.alui(ALU_AND, RAX, 0xFF);
+                set_zn(RAX);
+                break;
+            default:
+                break;
+        }
+        if(mode == ACC) {
+            e.mov(R_A, RAX);
+        } else {
+            e.load(RSI, TEMP);
+            write();
+        }
+    }
+
+    void branch(uint16_t pc, const uint8_t* inst, uint8_t flag, bool taken_if_set) {
+        uint16_t next = pc + 2;
+        uint16_t target = next + (int8_t)inst[1];
+        Label taken;
+        e.testi(R_P, flag);
+        e.jcc(taken_if_set ? CC_NE : CC_E, taken);
+        e.jmp(exit_to(next));
+        e.bind(taken);
+        e.alui64(ALU_ADD, R_CYCLES, 1 + ((next & 0xFF00) != (target & 0xFF00)));
+        e.jmp(exit_to(target));
+    }
+
+    /** Code for the rest of an instruction, once its base cycles are added */
+    Flow body(uint16_t pc, const uint8_t* inst, Decoded d) {
+        switch(d.op) {
+            case OP_LDA: case OP_LDX: case OP_LDY: {
+                int reg = d.op == OP_LDA ? R_A : d.op == OP_LDX ? R_X : R_Y;
+                read_operand(d.mode, inst);
+                e.mov(reg, RAX);
+                set_zn(reg);
+                return FLOW_NEXT;
+            }
+            case OP_STA: case OP_STX: case OP_STY:
+                operand_addr(d.mode, inst, false);
+                e.mov(RAX, d.op == OP_STA ? R_A : d.op == OP_STX ? R_X : R_Y);
+                write();
+                return FLOW_NEXT;
+            case OP_ADC:
+                read_operand(d.mode, inst);
+                adc();
+                return FLOW_NEXT;
+            case OP_SBC:
+                read_operand(d.mode, inst);
+                sbc();
+                return FLOW_NEXT;
+            case OP_AND: case OP_ORA: case OP_EOR:
+                read_operand(d.mode, inst);
+                e.alu(d.op == OP_AND ? ALU_AND : d.op == OP_ORA ? ALU_OR : ALU_XOR, R_A, RAX);
+                set_zn(R_A);
+                return FLOW_NEXT;
+            case OP_CMP: case OP_CPX: case OP_CPY:
+                read_operand(d.mode, inst);
+                compare(d.op == OP_CMP ? R_A : d.op == OP_CPX ? R_X : R_Y);
+                return FLOW_NEXT;
+            case OP_BIT:
+                read_operand(d.mode, inst);
+                bit();
+                return FLOW_NEXT;
+            case OP_ASL: case OP_LSR: case OP_ROL: case OP_ROR: case OP_INC: case OP_DEC:
+                modify(d.op, d.mode, inst);
+                return FLOW_NEXT;
+            case OP_INX: case OP_DEX: case OP_INY: case OP_DEY: {
+                int reg = d.op == OP_INX || d.op == OP_DEX ? R_X : R_Y;
+                e.alui(d.op == OP_INX || d.op == OP_INY ? ALU_ADD : ALU_SUB, reg, 1);
+                e.alui(ALU_AND, reg, 0xFF);
+                set_zn(reg);
+                return FLOW_NEXT;
+            }
+            case OP_TAX: case OP_TAY: case OP_TXA: case OP_TYA: {
+                int dst = d.op == OP_TAX ? R_X : d.op == OP_TAY ? R_Y : R_A;
+                e.mov(dst, d.op == OP_TXA ? R_X : d.op == OP_TYA ? R_Y : R_A);
+                set_zn(dst);
+                return FLOW_NEXT;
+            }
+            case OP_TSX:
+                e.movzx8(R_X, cpu_field(layout.sp));
+                set_zn(R_X);
+                return FLOW_NEXT;
+            case OP_TXS:
+                e.store8(cpu_field(layout.sp), R_X);
+                return FLOW_NEXT;
+            case OP_CLC: e.alui(ALU_AND, R_P, ~0x01); return FLOW_NEXT;
+            case OP_SEC: e.alui(ALU_OR, R_P, 0x01); return FLOW_NEXT;
+            case OP_CLD: e.alui(ALU_AND, R_P, ~0x08); return FLOW_NEXT;
+            case OP_SED: e.alui(ALU_OR, R_P, 0x08); return FLOW_NEXT;
+            case OP_CLV: e.alui(ALU_AND, R_P, ~0x40); return FLOW_NEXT;
+            case OP_SEI: e.alui(ALU_OR, R_P, 0x04); return FLOW_NEXT;
+            case OP_CLI:
+                e.alui(ALU_AND, R_P, ~0x04);
+                return FLOW_END;    // A pending IRQ is taken before the next instruction
+            case OP_NOP:
+                return FLOW_NEXT;
+            case OP_ILL_NOP:
+                if(d.mode == ABSX) {
+                    operand_addr(d.mode, inst, true);
+                    read();     // dummy read, for the page cross cycle
+                }
+                return FLOW_NEXT;
+            case OP_PHA:
+                e.mov(RAX, R_A);
+                push();
+                return FLOW_NEXT;
+            case OP_PHP:
+                e.mov(RAX, R_P);
+                e.alui(ALU_OR, RAX, 0x10);
+                push();
+                return FLOW_NEXT;
+            case OP_PLA:
+                pull();
+                e.mov(R_A, RAX);
+                set_zn(R_A);
+                return FLOW_NEXT;
+            case OP_PLP:
+                pull();
+                pull_status();
+                return FLOW_END;
+            case OP_JSR:
+                push_word(pc + 2);
+                e.jmp(exit_to(inst[1] | inst[2] << 8));
+                return FLOW_JUMPED;
+            case OP_RTS:
+                pull16();
+                e.inc8(cpu_field(layout.sp));
+                e.alui(ALU_ADD, RAX, 1);
+                jump_to_eax();
+                return FLOW_JUMPED;
+            case OP_RTI:
+                pull();
+                pull_status();
+                pull16();
+                e.inc8(cpu_field(layout.sp));
+                jump_to_eax();
+                return FLOW_JUMPED;
+            case OP_BRK:
+                push_word(pc + 1);
+                e.mov(RAX, R_P);
+                e.alui(ALU_OR, RAX, 0x10);
+                push();
+                e.movi(RSI, 0xFFFE);
+                read();
+                e.store(TEMP, RAX);
+                e.movi(RSI, 0xFFFF);
+                read();
+                e.shl(RAX, 8);
+                e.alu(ALU_OR, RAX, TEMP);
+                e.alui(ALU_OR, R_P, 0x10);
+                jump_to_eax();
+                return FLOW_JUMPED;
+            case OP_JMP:
+                if(d.mode == ABS) {
+                    e.jmp(exit_to(inst[1] | inst[2] << 8));
+                } else {
+                    operand_addr(d.mode, inst, false);
+                    e.mov(RAX, RSI);
+                    jump_to_eax();
+                }
+                return FLOW_JUMPED;
+            case OP_BPL: branch(pc, inst, 0x80, false); return FLOW_JUMPED;
+            case OP_BMI: branch(pc, inst, 0x80, true); return FLOW_JUMPED;
+            case OP_BVC: branch(pc, inst, 0x40, false); return FLOW_JUMPED;
+            case OP_BVS: branch(pc, inst, 0x40, true); return FLOW_JUMPED;
+            case OP_BCC: branch(pc, inst, 0x01, false); return FLOW_JUMPED;
+            case OP_BCS: branch(pc, inst, 0x01, true); return FLOW_JUMPED;
+            case OP_BNE: branch(pc, inst, 0x02, false); return FLOW_JUMPED;
+            case OP_BEQ: branch(pc, inst, 0x02, true); return FLOW_JUMPED;
+            default:
+                return FLOW_JUMPED;
+        }
+    }
+
+public:
+    BlockCompiler(Emitter& e, const Jit::Layout& layout): e(e), layout(layout) {}
+
+    void prologue() {
+        for(int reg : {RBX, RBP, R12, R13, R14, R15})
+            e.push(reg);
+        e.alui64(ALU_SUB, RSP, FRAME_SIZE);
+        e.mov64(R_CPU, RDI);
+        e.movzx8(R_A, cpu_field(layout.a));
+        e.movzx8(R_X, cpu_field(layout.x));
+        e.movzx8(R_Y, cpu_field(layout.y));
+        e.movzx8(R_P, cpu_field(layout.sr));
+        e.load64(R_CYCLES, cpu_field(layout.cycles));
+        e.store8i(IO_DONE, 0);
+    }
+
+    /**
+     * Adds an instruction, leaving the block after it if it went to an I/O
+     * handler. wrote() tells whether it may have stored to memory.
+     */
+    Flow instruction(uint16_t pc, const uint8_t* inst, Decoded d) {
+        accessed = false;
+        wrote = false;
+        const CPU::InstInfo& info = CPU::get_inst_info(inst[0]);
+        e.alui64(ALU_ADD, R_CYCLES, info.inst_cycles);
+        Flow flow = body(pc, inst, d);
+        if(accessed && flow != FLOW_JUMPED) {
+            e.cmp8i(IO_DONE, 0);
+            e.jcc(CC_NE, exit_to(pc + info.inst_size));
+        }
+        return flow;
+    }
+
+    bool wrote_memory() {
+        return wrote;
+    }
+
+    /** Ends the block at pc, then adds the exits and the epilogue */
+    void finish(uint16_t pc, bool jumped) {
+        if(!jumped)
+            e.jmp(exit_to(pc));
+        for(Exit& exit : exits) {
+            e.bind(exit.label);
+            e.store16i(cpu_field(layout.pc), exit.pc);
+            e.jmp(epilogue);
+        }
+        e.bind(epilogue);
+        e.store8(cpu_field(layout.a), R_A);
+        e.store8(cpu_field(layout.x), R_X);
+        e.store8(cpu_field(layout.y), R_Y);
+        e.store8(cpu_field(layout.sr), R_P);
+        e.store64(cpu_field(layout.cycles), R_CYCLES);
+        e.alui64(ALU_ADD, RSP, FRAME_SIZE);
+        for(int reg : {R15, R14, R13, R12, RBP, RBX})
+            e.pop(reg);
+        e.ret();
+    }
+};
+
+/** Most cycles an instruction can take, with a page cross and a taken branch */
+uint32_t max_cycles(uint8_t opcode) {
+    const Decoded& d = decode_table[opcode];
+    uint32_t cycles = CPU::get_inst_info(opcode).inst_cycles;
+    if(d.mode == ABSX || d.mode == ABSY || d.mode == INDY)
+        cycles += 1;
+    if(d.op == OP_BPL || d.op == OP_BMI || d.op == OP_BVC || d.op == OP_BVS
+       || d.op == OP_BCC || d.op == OP_BCS || d.op == OP_BNE || d.op == OP_BEQ)
+        cycles += 2;
+    return cycles;
+}
+
+}
+
+Jit::Jit(CPU& cpu): cpu(cpu) {
+    uint8_t* base = (uint8_t*)&cpu;
+    layout.a = (uint8_t*)&cpu.a - base;
+    layout.x = (uint8_t*)&cpu.x - base;
+    layout.y = (uint8_t*)&cpu.y - base;
+    layout.sp = (uint8_t*)&cpu.sp - base;
+    layout.pc = (uint8_t*)&cpu.pc - base;
+    layout.sr = (uint8_t*)&cpu.status.sr - base;
+    layout.cycles = (uint8_t*)&cpu.cycles - base;
+    layout.read_pages = (uint8_t*)cpu.bus.get_read_pages() - base;
+    layout.write_pages = (uint8_t*)cpu.bus.get_write_pages() - base;
+    layout.read = (const void*)&Jit::read;
+    layout.write = (const void*)&Jit::write;
+
+    void* buf = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code = buf == MAP_FAILED ? nullptr : (uint8_t*)buf;
+    code_used = 0;
+    cache.reset(new Block*[0x10000]());
+    heat.reset(new uint8_t[0x10000]());
+}
+
+Jit::~Jit() {
+    if(code != nullptr)
+        munmap(code, JIT_CODE_SIZE);
+}
+
+bool Jit::is_supported() {
+    return true;
+}
+
+bool Jit::ok() {
+    return code != nullptr;
+}
+
+void Jit::flush() {
+    blocks.clear();
+    storage.clear();
+    std::fill(cache.get(), cache.get() + 0x10000, nullptr);
+    code_used = 0;
+}
+
+/** Pointers fit in 48 bits, which leaves the top for the pc */
+static uint64_t block_key(uint16_t pc, const uint8_t* source) {
+    return (uint64_t)pc << 48 ^ (uint64_t)(uintptr_t)source;
+}
+
+Jit::Block* Jit::find(uint16_t pc, const uint8_t* source) {
+    auto found = blocks.find(block_key(pc, source));
+    if(found != blocks.end())
+        return found->second;
+    if(++heat[pc] < JIT_HOT)
+        return nullptr;
+    heat[pc] = 0;
+    return compile(pc, source, nullptr);
+}
+
+/**
+ * Translates the instructions from pc, into block if given or a new one.
+ * Only the pages the code goes to are made writable meanwhile.
+ */
+Jit::Block* Jit::compile(uint16_t pc, const uint8_t* source, Block* block) {
+    if(code_used + JIT_BLOCK_SPACE > JIT_CODE_SIZE) {
+        flush();
+        block = nullptr;
+    }
+    if(block == nullptr) {
+        storage.emplace_back(new Block());
+        block = storage.back().get();
+        blocks[block_key(pc, source)] = block;
+    }
+    block->pc = pc;
+    block->source = source;
+    block->writable = cpu.bus.write_ptr(pc) != nullptr;
+    block->code = nullptr;
+
+    uint8_t* pages = code + (code_used & ~(size_t)(JIT_PAGE_SIZE - 1));
+    size_t pages_size = code + code_used + JIT_BLOCK_SPACE - pages;
+    if(mprotect(pages, pages_size, PROT_READ | PROT_WRITE) != 0) {
+        disable();
+        return nullptr;
+    }
+    Emitter e(code + code_used, JIT_BLOCK_SPACE);
+    BlockCompiler compiler(e, layout);
+    compiler.prologue();
+    int available = 0x100 - (pc & 0xFF);
+    int length = 0;
+    int count = 0;
+    uint32_t prefix = 0;
+    uint32_t last = 0;
+    bool jumped = false;
+    while(count < JIT_MAX_INSTS && length < available) {
+        uint8_t opcode = source[length];
+        const Decoded& d = decode_table[opcode];
+        int size = CPU::get_inst_info(opcode).inst_size;
+        if(d.op == OP_BAD || length + size > available)
+            break;
+        Flow flow = compiler.instruction(pc + length, source + length, d);
+        prefix += last;
+        last = max_cycles(opcode);
+        length += size;
+        count++;
+        if(flow == FLOW_JUMPED)
+            jumped = true;
+        if(flow != FLOW_NEXT || (block->writable && compiler.wrote_memory()))
+            break;
+    }
+    if(count > 0)
+        compiler.finish(pc + length, jumped);
+    if(mprotect(pages, pages_size, PROT_READ | PROT_EXEC) != 0) {
+        disable();
+        return nullptr;
+    }
+
+    block->length = length;
+    memcpy(block->bytes, source, length);
+    block->max_cycles = prefix;
+    if(count > 0 && !e.overflowed()) {
+        block->code = (Code)(code + code_used);
+        code_used += e.get_size();
+    }
+    return block;
+}
+
+/**
+ * Gives up on compiling for good, when the code pages cannot be switched
+ * between writable and executable. ok() is false from then on.
+ */
+void Jit::disable() {
+    flush();
+    munmap(code, JIT_CODE_SIZE);
+    code = nullptr;
+}
+
+bool Jit::run_block(uint64_t deadline) {
+    if(code == nullptr)
+        return false;
+    uint16_t pc = cpu.pc;
+    const uint8_t* page = cpu.bus.get_read_pages()[pc >> 8];
+    if(page == nullptr)
+        return false;
+    const uint8_t* source = page + (pc & 0xFF);
+    Block* block = cache[pc];
+    if(block == nullptr || block->source != source) {
+        block = find(pc, source);
+        if(block == nullptr)
+            return false;
+        cache[pc] = block;
+    }
+    if(block->writable && memcmp(block->bytes, source, block->length) != 0) {
+        if(++block->rewrites > JIT_MAX_REWRITES) {
+            block->length = 0;      // Keeps changing, leave it to the interpreter
+            block->code = nullptr;
+            return false;
+        }
+        block = compile(pc, source, block);
+        if(block == nullptr)
+            return false;
+    }
+    if(block->code == nullptr || cpu.cycles + block->max_cycles >= deadline)
+        return false;
+    block->code(&cpu);
+    return true;
+}
+
+#else
+
+Jit::Jit(CPU& cpu): cpu(cpu) {
+    code = nullptr;
+    code_used = 0;
+}
+
+Jit::~Jit() {
+}
+
+bool Jit::is_supported() {
+    return false;
+}
+
+bool Jit::ok() {
+    return false;
+}
+
+void Jit::flush() {
+}
+
+bool Jit::run_block(uint64_t deadline) {
+    return false;
+}
+
+#endif
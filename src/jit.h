@@ -0,0 +1,101 @@
+#ifndef NESEMU_JIT_H
+#define NESEMU_JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#define JIT_MAX_INSTS 32    // Instructions per block
+#define JIT_MAX_BYTES (JIT_MAX_INSTS * 3)
+
+class CPU;
+
+/**
+ * Dynamic recompiler behind CPU::ENGINE_JIT. Straight runs of instructions
+ * that the CPU keeps coming back to are translated into x86-64 code, which
+ * keeps A, X, Y, the status and the cycle count in host registers. A block
+ * ends at a branch or jump, at the end of its page and at anything that
+ * could let an interrupt in (CLI, PLP), and stops early after any access
+ * that went to an I/O handler, so the CPU's usual slow path sees the new
+ * cycle count, pending interrupts and stop requests before the next
+ * instruction just as with the interpreter.
+ *
+ * Blocks are found by pc and by where their bytes are in host memory, so a
+ * bank switch picks other blocks rather than flushing any. Blocks in
+ * writable memory keep a copy of their bytes, are checked against it before
+ * every run and recompiled when the code has changed, and end at their
+ * first store so code that rewrites itself is seen.
+ *
+ * Only built for x86-64 Linux. Elsewhere, is_supported() is false and the
+ * CPU stays with its table.
+ */
+class Jit {
+public:
+    /** Offsets into the CPU and the bus callbacks, for the code generator */
+    typedef struct layout {
+        int32_t a;
+        int32_t x;
+        int32_t y;
+        int32_t sp;
+        int32_t pc;
+        int32_t sr;
+        int32_t cycles;
+        int32_t read_pages;
+        int32_t write_pages;
+        const void* read;
+        const void* write;
+    } Layout;
+
+private:
+    typedef void (*Code)(CPU* cpu);
+
+    typedef struct block {
+        uint16_t pc;
+        const uint8_t* source;  // The instruction bytes, in the page they were compiled from
+        bool writable;          // Source is RAM, checked against bytes before every run
+        int rewrites;           // Times the bytes were found changed
+        int length;
+        uint8_t bytes[JIT_MAX_BYTES];
+        uint32_t max_cycles;    // Most cycles the block can take before its last instruction
+        Code code;              // Null if the first instruction cannot be compiled
+    } Block;
+
+    CPU& cpu;
+    Layout layout;
+    uint8_t* code;
+    size_t code_used;
+    std::unordered_map<uint64_t, Block*> blocks;
+    std::vector<std::unique_ptr<Block>> storage;
+    std::unique_ptr<Block*[]> cache;    // Last block run at each pc
+    std::unique_ptr<uint8_t[]> heat;    // Visits to pcs without a block
+
+    static uint8_t read(CPU* cpu, uint16_t addr);
+    static void write(CPU* cpu, uint16_t addr, uint8_t value);
+    Block* find(uint16_t pc, const uint8_t* source);
+    /** Null if the code pages could not be made writable or executable again */
+    Block* compile(uint16_t pc, const uint8_t* source, Block* block);
+    void disable();
+
+public:
+    Jit(CPU& cpu);
+    ~Jit();
+
+    static bool is_supported();
+    /** False if the code buffer could not be allocated or its protection changed */
+    bool ok();
+
+    /**
+     * Runs the compiled block at the CPU's pc if there is one and it cannot
+     * reach the deadline before its last instruction. Returns false to have
+     * the CPU interpret the instruction at pc instead.
+     */
+    bool run_block(uint64_t deadline);
+    /** Throws away every compiled block */
+    void flush();
+    size_t get_block_count();
+};
+
+
+#endif //NESEMU_JIT_H
@@ -0,0 +1,1044 @@
+#include "lockstep.h"
+#include "opcodes.h"
+
+#include <algorithm>
+#include <cstring>
+
+static inline uint8_t page_crossed(uint16_t from, uint16_t to) {
+    return (from ^ to) >> 8 != 0;
+}
+
+LockstepCPU::LockstepCPU() {
+    lanes = 0;
+    running_count = 0;
+    active_count = 0;
+    lockstep_insts = 0;
+    scalar_insts = 0;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        cpus[i] = nullptr;
+        stops[i] = CPU::STOP_NONE;
+    }
+}
+
+bool LockstepCPU::add_lane(CPU& cpu) {
+    if(lanes == LOCKSTEP_LANES)
+        return false;
+    cpus[lanes++] = &cpu;
+    return true;
+}
+
+int LockstepCPU::get_lanes() {
+    return lanes;
+}
+
+CPU::StopReason LockstepCPU::get_stop_reason(int lane) {
+    return stops[lane];
+}
+
+uint64_t LockstepCPU::get_lockstep_instructions() {
+    return lockstep_insts;
+}
+
+uint64_t LockstepCPU::get_scalar_instructions() {
+    return scalar_insts;
+}
+
+/** Copies a lane's registers from its CPU into the rows */
+void LockstepCPU::load(int lane) {
+    CPU& cpu = *cpus[lane];
+    a[lane] = cpu.a;
+    x[lane] = cpu.x;
+    y[lane] = cpu.y;
+    sp[lane] = cpu.sp;
+    pc[lane] = cpu.pc;
+    cycles[lane] = cpu.cycles;
+    uint8_t sr = cpu.status.sr;
+    c[lane] = sr & 0x01;
+    z[lane] = (sr >> 1) & 0x01;
+    v[lane] = (sr >> 6) & 0x01;
+    n[lane] = (sr >> 7) & 0x01;
+    p[lane] = sr & 0x3C;
+    deadline[lane] = std::min(run_deadline[lane], cpu.scheduler.next_cycle());
+}
+
+/** Copies a lane's registers back to its CPU */
+void LockstepCPU::store(int lane) {
+    CPU& cpu = *cpus[lane];
+    cpu.a = a[lane];
+    cpu.x = x[lane];
+    cpu.y = y[lane];
+    cpu.sp = sp[lane];
+    cpu.pc = pc[lane];
+    cpu.cycles = cycles[lane];
+    cpu.status.sr = p[lane] | c[lane] | (z[lane] << 1) | (v[lane] << 6) | (n[lane] << 7);
+}
+
+CPU::StopReason LockstepCPU::run() {
+    return run_lanes(UINT64_MAX);
+}
+
+CPU::StopReason LockstepCPU::run_for(uint64_t budget) {
+    return run_lanes(budget);
+}
+
+/**
+ * Like CPU::run_table(), a lane takes the slow path when its deadline
+ * passes or something needs its attention, so it is left to the CPU then.
+ * An IRQ held while interrupts are disabled does nothing there, so it does
+ * not block the lane until the I flag is cleared.
+ */
+bool LockstepCPU::blocked(int lane) {
+    uint8_t flags = cpus[lane]->attention.load(std::memory_order_relaxed);
+    if(p[lane] & 0x04)
+        flags &= ~ATTN_IRQ;
+    return cycles[lane] >= deadline[lane] || flags != 0;
+}
+
+/**
+ * Executes a lane's next instruction on its CPU. False once the CPU stops,
+ * which leaves the lane's registers in the CPU and its reason in stops.
+ */
+bool LockstepCPU::step_lane(int lane) {
+    store(lane);
+    CPU::StopReason reason = cpus[lane]->step_until(run_deadline[lane]);
+    if(reason != CPU::STOP_NONE) {
+        stops[lane] = reason;
+        return false;
+    }
+    scalar_insts++;
+    load(lane);
+    return true;
+}
+
+/**
+ * Every instruction is executed for the running lanes at the lowest pc.
+ * Those that are blocked take it on their own first, so the others wait
+ * for them to come round to the same pc.
+ */
+CPU::StopReason LockstepCPU::run_lanes(uint64_t budget) {
+    running_count = 0;
+    for(int lane=0; lane<lanes; lane++) {
+        uint64_t start = cpus[lane]->cycles;
+        run_deadline[lane] = budget > UINT64_MAX - start ? UINT64_MAX : start + budget;
+        stops[lane] = CPU::STOP_NONE;
+        load(lane);
+        running[running_count++] = lane;
+    }
+
+    while(running_count > 0) {
+        uint16_t lowest = pc[running[0]];
+        for(int k=1; k<running_count; k++)
+            lowest = std::min(lowest, pc[running[k]]);
+
+        active_count = 0;
+        bool stopped = false;
+        for(int k=0; k<running_count; k++) {
+            int lane = running[k];
+            if(pc[lane] != lowest)
+                continue;
+            if(!blocked(lane))
+                active[active_count++] = lane;
+            else if(!step_lane(lane))
+                stopped = true;
+        }
+        if(active_count > 0 && !execute_group()) {
+            for(int k=0; k<active_count; k++)
+                stopped |= !step_lane(active[k]);
+        }
+
+        if(stopped) {
+            int still = 0;
+            for(int k=0; k<running_count; k++) {
+                if(stops[running[k]] == CPU::STOP_NONE)
+                    running[still++] = running[k];
+            }
+            running_count = still;
+        }
+    }
+    return lanes > 0 ? stops[0] : CPU::STOP_NONE;
+}
+
+/** execute() for the active lanes alone, the other running lanes keep their rows */
+bool LockstepCPU::execute_group() {
+    if(active_count == running_count)
+        return execute();
+    save_rows();
+    if(!execute())
+        return false;
+    merge_rows();
+    return true;
+}
+
+void LockstepCPU::save_rows() {
+    memcpy(saved.a, a, sizeof(a));
+    memcpy(saved.x, x, sizeof(x));
+    memcpy(saved.y, y, sizeof(y));
+    memcpy(saved.sp, sp, sizeof(sp));
+    memcpy(saved.c, c, sizeof(c));
+    memcpy(saved.z, z, sizeof(z));
+    memcpy(saved.v, v, sizeof(v));
+    memcpy(saved.n, n, sizeof(n));
+    memcpy(saved.p, p, sizeof(p));
+    memcpy(saved.pc, pc, sizeof(pc));
+    memcpy(saved.cycles, cycles, sizeof(cycles));
+}
+
+/** Puts back the saved rows of every lane that is not active */
+void LockstepCPU::merge_rows() {
+    alignas(32) uint8_t keep[LOCKSTEP_LANES] = {};
+    alignas(32) uint16_t keep16[LOCKSTEP_LANES];
+    alignas(32) uint64_t keep64[LOCKSTEP_LANES];
+    for(int k=0; k<active_count; k++)
+        keep[active[k]] = 0xFF;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        a[i] = (a[i] & keep[i]) | (saved.a[i] & ~keep[i]);
+        x[i] = (x[i] & keep[i]) | (saved.x[i] & ~keep[i]);
+        y[i] = (y[i] & keep[i]) | (saved.y[i] & ~keep[i]);
+        sp[i] = (sp[i] & keep[i]) | (saved.sp[i] & ~keep[i]);
+        c[i] = (c[i] & keep[i]) | (saved.c[i] & ~keep[i]);
+        z[i] = (z[i] & keep[i]) | (saved.z[i] & ~keep[i]);
+        v[i] = (v[i] & keep[i]) | (saved.v[i] & ~keep[i]);
+        n[i] = (n[i] & keep[i]) | (saved.n[i] & ~keep[i]);
+        p[i] = (p[i] & keep[i]) | (saved.p[i] & ~keep[i]);
+    }
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        keep16[i] = (int8_t)keep[i];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        pc[i] = (pc[i] & keep16[i]) | (saved.pc[i] & ~keep16[i]);
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        keep64[i] = (int8_t)keep[i];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        cycles[i] = (cycles[i] & keep64[i]) | (saved.cycles[i] & ~keep64[i]);
+}
+
+/**
+ * The instruction at the common pc of the active lanes, if they all have
+ * the same bytes there in plain memory. The CPU's base cycles are added
+ * once the handler has done the rest.
+ */
+bool LockstepCPU::execute() {
+    uint16_t addr = pc[active[0]];
+    const uint8_t* inst = cpus[active[0]]->bus.read_ptr(addr, 3);
+    if(inst == nullptr)
+        return false;
+    const CPU::InstInfo& info = CPU::get_inst_info(inst[0]);
+    for(int k=1; k<active_count; k++) {
+        const uint8_t* other = cpus[active[k]]->bus.read_ptr(addr, 3);
+        if(other == nullptr || (other != inst && memcmp(other, inst, info.inst_size) != 0))
+            return false;
+    }
+    uint8_t base_cycles = info.inst_cycles;
+    if(!(this->*dispatch_table[inst[0]])(inst))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        cycles[i] += base_cycles;
+    lockstep_insts += active_count;
+    return true;
+}
+
+/** Same opcode matrix as the CPU, opcodes that halt it are left to it */
+constexpr LockstepCPU::DispatchTable LockstepCPU::build_dispatch_table() {
+    DispatchTable t = {};
+#define X(opcode, handler, name, size, cycles) t[opcode] = &LockstepCPU::handler;
+#define B(opcode) t[opcode] = &LockstepCPU::bad;
+    CPU_OPCODES(X, B)
+#undef X
+#undef B
+    return t;
+}
+
+const LockstepCPU::DispatchTable LockstepCPU::dispatch_table = LockstepCPU::build_dispatch_table();
+
+inline const uint8_t* LockstepCPU::read_ptr(int lane, uint16_t addr) {
+    return cpus[lane]->bus.read_ptr(addr, 1);
+}
+
+inline uint8_t* LockstepCPU::write_ptr(int lane, uint16_t addr) {
+    return cpus[lane]->bus.write_ptr(addr);
+}
+
+/** CPU::load_address() for one lane, with its page wrap */
+bool LockstepCPU::load_address(int lane, uint16_t addr, uint16_t& value) {
+    const uint8_t* high = read_ptr(lane, (addr & 0xFF00) + ((addr+1) & 0xFF));
+    const uint8_t* low = read_ptr(lane, addr);
+    if(high == nullptr || low == nullptr)
+        return false;
+    value = (*high << 8) + *low;
+    return true;
+}
+
+constexpr int LockstepCPU::inst_size(AddrMode mode) {
+    switch(mode) {
+        case IMP: case ACC:
+            return 1;
+        case ABS: case ABSX: case ABSY: case IND:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+/** Effective address of the operand in every lane, see CPU::operand_addr() */
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::operand_addr(const uint8_t* inst, uint16_t* addr) {
+    static_assert(mode != IMP && mode != ACC && mode != IMM,
+                  "addressing mode has no effective address");
+    uint16_t base = inst[1] | (inst[2] << 8);
+    if constexpr(mode == ZP || mode == ABS) {
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            addr[i] = mode == ZP ? inst[1] : base;
+    } else if constexpr(mode == ZPX || mode == ZPY) {
+        const uint8_t* index = mode == ZPX ? x : y;
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            addr[i] = (uint8_t)(inst[1] + index[i]);
+    } else if constexpr(mode == ABSX || mode == ABSY) {
+        const uint8_t* index = mode == ABSX ? x : y;
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            addr[i] = base + index[i];
+    } else {
+        for(int k=0; k<active_count; k++) {
+            int lane = active[k];
+            if constexpr(mode == IND) {
+                if(!load_address(lane, base, addr[lane]))
+                    return false;
+            } else if constexpr(mode == INDX) {
+                if(!load_address(lane, (uint8_t)(inst[1] + x[lane]), addr[lane]))
+                    return false;
+            } else {
+                if(!load_address(lane, inst[1], addr[lane]))
+                    return false;
+                addr[lane] += y[lane];
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Operand of every lane, see CPU::read_operand(). The page cross cycle is
+ * only added once every lane could read, so a false return changes nothing.
+ */
+template<LockstepCPU::AddrMode mode, bool page_penalty>
+bool LockstepCPU::read_operand(const uint8_t* inst, uint8_t* op) {
+    if constexpr(mode == IMM) {
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            op[i] = inst[1];
+    } else if constexpr(mode == ACC) {
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            op[i] = a[i];
+    } else {
+        alignas(32) uint16_t addr[LOCKSTEP_LANES] = {};
+        if(!operand_addr<mode>(inst, addr))
+            return false;
+        for(int k=0; k<active_count; k++) {
+            const uint8_t* src = read_ptr(active[k], addr[active[k]]);
+            if(src == nullptr)
+                return false;
+            op[active[k]] = *src;
+        }
+        if constexpr(page_penalty && (mode == ABSX || mode == ABSY || mode == INDY)) {
+            const uint8_t* index = mode == ABSX ? x : y;
+            for(int i=0; i<LOCKSTEP_LANES; i++)
+                cycles[i] += page_crossed(addr[i] - index[i], addr[i]);
+        }
+    }
+    return true;
+}
+
+/** Stores every lane's result, only once it is known that all of them can */
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::write_operand(const uint8_t* inst, const uint8_t* value) {
+    if constexpr(mode == ACC) {
+        for(int i=0; i<LOCKSTEP_LANES; i++)
+            a[i] = value[i];
+    } else {
+        alignas(32) uint16_t addr[LOCKSTEP_LANES] = {};
+        uint8_t* dest[LOCKSTEP_LANES];
+        if(!operand_addr<mode>(inst, addr))
+            return false;
+        for(int k=0; k<active_count; k++) {
+            dest[active[k]] = write_ptr(active[k], addr[active[k]]);
+            if(dest[active[k]] == nullptr)
+                return false;
+        }
+        for(int k=0; k<active_count; k++)
+            *dest[active[k]] = value[active[k]];
+    }
+    return true;
+}
+
+/** Pushes count rows of bytes, values[0] first, if every lane's stack is plain memory */
+bool LockstepCPU::push(const uint8_t* const* values, int count) {
+    uint8_t* dest[3][LOCKSTEP_LANES];
+    for(int j=0; j<count; j++) {
+        for(int k=0; k<active_count; k++) {
+            int lane = active[k];
+            dest[j][lane] = write_ptr(lane, 0x0100 + (uint8_t)(sp[lane] - j));
+            if(dest[j][lane] == nullptr)
+                return false;
+        }
+    }
+    for(int j=0; j<count; j++) {
+        for(int k=0; k<active_count; k++)
+            *dest[j][active[k]] = values[j][active[k]];
+    }
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        sp[i] -= count;
+    return true;
+}
+
+/**
+ * Reads the stack offset bytes above sp without moving it. past reads
+ * that many bytes further without wrapping in the stack page, like the
+ * high byte of CPU::rts()'s read16.
+ */
+bool LockstepCPU::pull(uint8_t* value, int offset, int past) {
+    for(int k=0; k<active_count; k++) {
+        int lane = active[k];
+        const uint8_t* src = read_ptr(lane, 0x0100 + (uint8_t)(sp[lane] + offset) + past);
+        if(src == nullptr)
+            return false;
+        value[lane] = *src;
+    }
+    return true;
+}
+
+void LockstepCPU::advance(int size) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        pc[i] += size;
+}
+
+/**
+ * Rows passed by pointer are copied before the loops that write registers,
+ * they may be registers themselves and the compiler would not vectorize.
+ */
+void LockstepCPU::set_zn(const uint8_t* value) {
+    alignas(32) uint8_t row[LOCKSTEP_LANES];
+    memcpy(row, value, sizeof(row));
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        z[i] = row[i] == 0;
+        n[i] = row[i] >> 7;
+    }
+}
+
+/** Unpacks a row of status registers, with the break flag clear and the unused flag set */
+void LockstepCPU::set_status(const uint8_t* value) {
+    alignas(32) uint8_t sr[LOCKSTEP_LANES];
+    memcpy(sr, value, sizeof(sr));
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        c[i] = sr[i] & 0x01;
+        z[i] = (sr[i] >> 1) & 0x01;
+        v[i] = (sr[i] >> 6) & 0x01;
+        n[i] = sr[i] >> 7;
+        p[i] = (sr[i] & 0x0C) | 0x20;
+    }
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::adc(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        uint16_t tmp = a[i] + op[i] + c[i];
+        uint8_t result = tmp;
+        v[i] = (~(a[i] ^ op[i]) & (a[i] ^ result)) >> 7;
+        c[i] = tmp >> 8;
+        a[i] = result;
+    }
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::and_(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        a[i] &= op[i];
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::asl(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t result[LOCKSTEP_LANES];
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        result[i] = op[i] << 1;
+    if(!write_operand<mode>(inst, result))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        c[i] = op[i] >> 7;
+    set_zn(result);
+    advance(inst_size(mode));
+    return true;
+}
+
+/** CPU::branch() for every lane, taken or not per lane, which may split their pcs */
+void LockstepCPU::branch(const uint8_t* inst, const uint8_t* flag) {
+    alignas(32) uint8_t taken[LOCKSTEP_LANES];
+    memcpy(taken, flag, sizeof(taken));
+    alignas(32) uint16_t extra[LOCKSTEP_LANES];
+    int8_t offset = inst[1];
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        uint16_t next = pc[i] + 2;
+        uint16_t target = next + offset;
+        extra[i] = taken[i] ? 1 + ((next ^ target) >> 8 != 0) : 0;
+        pc[i] = taken[i] ? target : next;
+    }
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        cycles[i] += extra[i];
+}
+
+bool LockstepCPU::bcc(const uint8_t* inst) {
+    alignas(32) uint8_t taken[LOCKSTEP_LANES];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        taken[i] = !c[i];
+    branch(inst, taken);
+    return true;
+}
+
+bool LockstepCPU::bcs(const uint8_t* inst) {
+    branch(inst, c);
+    return true;
+}
+
+bool LockstepCPU::beq(const uint8_t* inst) {
+    branch(inst, z);
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::bit(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        z[i] = (a[i] & op[i]) == 0;
+        v[i] = (op[i] >> 6) & 0x01;
+        n[i] = op[i] >> 7;
+    }
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::bmi(const uint8_t* inst) {
+    branch(inst, n);
+    return true;
+}
+
+bool LockstepCPU::bne(const uint8_t* inst) {
+    alignas(32) uint8_t taken[LOCKSTEP_LANES];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        taken[i] = !z[i];
+    branch(inst, taken);
+    return true;
+}
+
+bool LockstepCPU::bpl(const uint8_t* inst) {
+    alignas(32) uint8_t taken[LOCKSTEP_LANES];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        taken[i] = !n[i];
+    branch(inst, taken);
+    return true;
+}
+
+bool LockstepCPU::brk(const uint8_t* inst) {
+    alignas(32) uint8_t high[LOCKSTEP_LANES];
+    alignas(32) uint8_t low[LOCKSTEP_LANES];
+    alignas(32) uint8_t sr[LOCKSTEP_LANES];
+    alignas(32) uint8_t vector_low[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t vector_high[LOCKSTEP_LANES] = {};
+    for(int k=0; k<active_count; k++) {
+        const uint8_t* vector = cpus[active[k]]->bus.read_ptr(0xFFFE, 2);
+        if(vector == nullptr)
+            return false;
+        vector_low[active[k]] = vector[0];
+        vector_high[active[k]] = vector[1];
+    }
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        uint16_t next = pc[i] + 1;
+        high[i] = next >> 8;
+        low[i] = next & 0xFF;
+        sr[i] = p[i] | c[i] | (z[i] << 1) | (v[i] << 6) | (n[i] << 7) | 0x10; // break flag is set to 1
+    }
+    const uint8_t* values[] = {high, low, sr};
+    if(!push(values, 3))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        pc[i] = vector_low[i] | (vector_high[i] << 8);
+        p[i] |= 0x10;
+    }
+    return true;
+}
+
+bool LockstepCPU::bvc(const uint8_t* inst) {
+    alignas(32) uint8_t taken[LOCKSTEP_LANES];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        taken[i] = !v[i];
+    branch(inst, taken);
+    return true;
+}
+
+bool LockstepCPU::bvs(const uint8_t* inst) {
+    branch(inst, v);
+    return true;
+}
+
+bool LockstepCPU::clc(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        c[i] = 0;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::cld(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        p[i] &= ~0x08;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::cli(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        p[i] &= ~0x04;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::clv(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        v[i] = 0;
+    advance(1);
+    return true;
+}
+
+/** CMP, CPX and CPY against reg, with the CPU's n from the difference */
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::compare(const uint8_t* inst, const uint8_t* value) {
+    alignas(32) uint8_t reg[LOCKSTEP_LANES];
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    memcpy(reg, value, sizeof(reg));
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        c[i] = reg[i] >= op[i];
+        z[i] = reg[i] == op[i];
+        n[i] = (uint8_t)(reg[i] - op[i]) >> 7;
+    }
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::cmp(const uint8_t* inst) {
+    return compare<mode>(inst, a);
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::cpx(const uint8_t* inst) {
+    return compare<mode>(inst, x);
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::cpy(const uint8_t* inst) {
+    return compare<mode>(inst, y);
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::dec(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        op[i]--;
+    if(!write_operand<mode>(inst, op))
+        return false;
+    set_zn(op);
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::dex(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        x[i]--;
+    set_zn(x);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::dey(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        y[i]--;
+    set_zn(y);
+    advance(1);
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::eor(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        a[i] ^= op[i];
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::inc(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        op[i]++;
+    if(!write_operand<mode>(inst, op))
+        return false;
+    set_zn(op);
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::inx(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        x[i]++;
+    set_zn(x);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::iny(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        y[i]++;
+    set_zn(y);
+    advance(1);
+    return true;
+}
+
+/** An indirect jump can send the lanes to different pcs */
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::jmp(const uint8_t* inst) {
+    alignas(32) uint16_t addr[LOCKSTEP_LANES] = {};
+    if(!operand_addr<mode>(inst, addr))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        pc[i] = addr[i];
+    return true;
+}
+
+bool LockstepCPU::jsr(const uint8_t* inst) {
+    alignas(32) uint8_t high[LOCKSTEP_LANES];
+    alignas(32) uint8_t low[LOCKSTEP_LANES];
+    uint16_t target = inst[1] | (inst[2] << 8);
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        uint16_t next = pc[i] + 2;
+        high[i] = next >> 8;
+        low[i] = next & 0xFF;
+    }
+    const uint8_t* values[] = {high, low};
+    if(!push(values, 2))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        pc[i] = target;
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::lda(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    memcpy(a, op, sizeof(a));
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::ldx(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    memcpy(x, op, sizeof(x));
+    set_zn(x);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::ldy(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    memcpy(y, op, sizeof(y));
+    set_zn(y);
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::lsr(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t result[LOCKSTEP_LANES];
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        result[i] = op[i] >> 1;
+    if(!write_operand<mode>(inst, result))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        c[i] = op[i] & 0x01;
+    set_zn(result);
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::nop(const uint8_t* inst) {
+    advance(1);
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::ora(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        a[i] |= op[i];
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::pha(const uint8_t* inst) {
+    const uint8_t* values[] = {a};
+    if(!push(values, 1))
+        return false;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::php(const uint8_t* inst) {
+    alignas(32) uint8_t sr[LOCKSTEP_LANES];
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        sr[i] = p[i] | c[i] | (z[i] << 1) | (v[i] << 6) | (n[i] << 7) | 0x10; // break flag is set to 1
+    const uint8_t* values[] = {sr};
+    if(!push(values, 1))
+        return false;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::pla(const uint8_t* inst) {
+    alignas(32) uint8_t value[LOCKSTEP_LANES] = {};
+    if(!pull(value, 1))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        sp[i]++;
+    memcpy(a, value, sizeof(a));
+    set_zn(a);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::plp(const uint8_t* inst) {
+    alignas(32) uint8_t sr[LOCKSTEP_LANES] = {};
+    if(!pull(sr, 1))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        sp[i]++;
+    set_status(sr);
+    advance(1);
+    return true;
+}
+
+/** Like the CPU's, z comes from the accumulator rather than the result */
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::rol(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t result[LOCKSTEP_LANES];
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        result[i] = (op[i] << 1) + c[i];
+    if(!write_operand<mode>(inst, result))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        c[i] = op[i] >> 7;
+        z[i] = a[i] == 0;
+        n[i] = result[i] >> 7;
+    }
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::ror(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t result[LOCKSTEP_LANES];
+    if(!read_operand<mode, false>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        result[i] = (op[i] >> 1) + (uint8_t)(c[i] << 7);
+    if(!write_operand<mode>(inst, result))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        c[i] = op[i] & 0x01;
+        z[i] = a[i] == 0;
+        n[i] = result[i] >> 7;
+    }
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::rti(const uint8_t* inst) {
+    alignas(32) uint8_t sr[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t low[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t high[LOCKSTEP_LANES] = {};
+    if(!pull(sr, 1) || !pull(low, 2) || !pull(high, 2, 1))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        sp[i] += 3;
+        pc[i] = low[i] | (high[i] << 8);
+    }
+    set_status(sr);
+    return true;
+}
+
+bool LockstepCPU::rts(const uint8_t* inst) {
+    alignas(32) uint8_t low[LOCKSTEP_LANES] = {};
+    alignas(32) uint8_t high[LOCKSTEP_LANES] = {};
+    if(!pull(low, 1) || !pull(high, 1, 1))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        sp[i] += 2;
+        pc[i] = (low[i] | (high[i] << 8)) + 1;
+    }
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::sbc(const uint8_t* inst) {
+    alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+    if(!read_operand<mode>(inst, op))
+        return false;
+    for(int i=0; i<LOCKSTEP_LANES; i++) {
+        uint8_t result = a[i] - op[i] - (1 - c[i]);
+        c[i] = (result >> 7) ^ 0x01;
+        v[i] = ((a[i] ^ op[i]) & (a[i] ^ result)) >> 7;
+        a[i] = result;
+    }
+    set_zn(a);
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::sec(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        c[i] = 1;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::sed(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        p[i] |= 0x08;
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::sei(const uint8_t* inst) {
+    for(int i=0; i<LOCKSTEP_LANES; i++)
+        p[i] |= 0x04;
+    advance(1);
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::sta(const uint8_t* inst) {
+    if(!write_operand<mode>(inst, a))
+        return false;
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::stx(const uint8_t* inst) {
+    if(!write_operand<mode>(inst, x))
+        return false;
+    advance(inst_size(mode));
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::sty(const uint8_t* inst) {
+    if(!write_operand<mode>(inst, y))
+        return false;
+    advance(inst_size(mode));
+    return true;
+}
+
+bool LockstepCPU::tax(const uint8_t* inst) {
+    memcpy(x, a, sizeof(x));
+    set_zn(x);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::tay(const uint8_t* inst) {
+    memcpy(y, a, sizeof(y));
+    set_zn(y);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::tsx(const uint8_t* inst) {
+    memcpy(x, sp, sizeof(x));
+    set_zn(x);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::txa(const uint8_t* inst) {
+    memcpy(a, x, sizeof(a));
+    set_zn(a);
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::txs(const uint8_t* inst) {
+    memcpy(sp, x, sizeof(sp));
+    advance(1);
+    return true;
+}
+
+bool LockstepCPU::tya(const uint8_t* inst) {
+    memcpy(a, y, sizeof(a));
+    set_zn(a);
+    advance(1);
+    return true;
+}
+
+template<LockstepCPU::AddrMode mode>
+bool LockstepCPU::ill_nop(const uint8_t* inst) {
+    if constexpr(mode == ABSX) {
+        alignas(32) uint8_t op[LOCKSTEP_LANES] = {};
+        if(!read_operand<mode>(inst, op))  // dummy read, for the page cross cycle
+            return false;
+    }
+    advance(inst_size(mode));
+    return true;
+}
+
+/** The CPU halts on these */
+bool LockstepCPU::bad(const uint8_t* inst) {
+    return false;
+}
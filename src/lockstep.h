@@ -0,0 +1,206 @@
+#ifndef NESEMU_LOCKSTEP_H
+#define NESEMU_LOCKSTEP_H
+
+#include <array>
+#include <cstdint>
+
+#include "cpu.h"
+
+#define LOCKSTEP_LANES 16
+
+/**
+ * Experimental core that runs up to 16 CPUs side by side, for running many
+ * copies of a game at once with different input. Each lane is a CPU of its
+ * own machine. Their registers are kept here as structure of arrays, one
+ * row per register with a byte or word per lane, and while lanes are at
+ * the same pc with the same instruction bytes the instruction is executed
+ * once for all of them: the register and flag updates are loops
+ * over whole rows, which the compiler turns into SSE2, or AVX2 when built
+ * with AVX2=1, and only the memory accesses go lane by lane.
+ *
+ * Once the pcs differ, the lanes at the lowest pc go on together while the
+ * others wait, so a branch skipping ahead is caught up with. The rows of
+ * the waiting lanes are put back after each instruction.
+ *
+ * Everything else is left to the lanes' own CPUs, an instruction at a
+ * time: due events, interrupts, tracing and breakpoints, and instructions
+ * that touch registers rather than memory. The handlers mirror the CPU's
+ * in cpu.cpp quirk for quirk, so every lane ends exactly where its CPU
+ * would have run on its own.
+ */
+class LockstepCPU {
+private:
+    /** The CPU's addressing modes, so the opcode table expands the same */
+    enum AddrMode {
+        IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABSX, ABSY, IND, INDX, INDY,
+    };
+
+    /**
+     * Executes an instruction for every active lane, or returns false
+     * without changing anything when one of them cannot, so the lanes'
+     * CPUs can execute it instead.
+     */
+    typedef bool (LockstepCPU::*Handler)(const uint8_t* inst);
+    typedef std::array<Handler, 256> DispatchTable;
+
+    static const DispatchTable dispatch_table;
+    static constexpr DispatchTable build_dispatch_table();
+
+    /** Copy of the rows, to put back the lanes an instruction is not executed for */
+    typedef struct rows {
+        alignas(32) uint8_t a[LOCKSTEP_LANES];
+        alignas(32) uint8_t x[LOCKSTEP_LANES];
+        alignas(32) uint8_t y[LOCKSTEP_LANES];
+        alignas(32) uint8_t sp[LOCKSTEP_LANES];
+        alignas(32) uint8_t c[LOCKSTEP_LANES];
+        alignas(32) uint8_t z[LOCKSTEP_LANES];
+        alignas(32) uint8_t v[LOCKSTEP_LANES];
+        alignas(32) uint8_t n[LOCKSTEP_LANES];
+        alignas(32) uint8_t p[LOCKSTEP_LANES];
+        alignas(32) uint16_t pc[LOCKSTEP_LANES];
+        alignas(32) uint64_t cycles[LOCKSTEP_LANES];
+    } Rows;
+
+    CPU* cpus[LOCKSTEP_LANES];
+    int lanes;
+    int running[LOCKSTEP_LANES];    // Lanes whose CPUs have not stopped, in lane order
+    int running_count;
+    int active[LOCKSTEP_LANES];     // Lanes the next instruction is executed for
+    int active_count;
+    CPU::StopReason stops[LOCKSTEP_LANES];
+    uint64_t lockstep_insts;
+    uint64_t scalar_insts;
+
+    /** Rows of registers, flags kept apart as 0 or 1, the other status bits in p */
+    alignas(32) uint8_t a[LOCKSTEP_LANES];
+    alignas(32) uint8_t x[LOCKSTEP_LANES];
+    alignas(32) uint8_t y[LOCKSTEP_LANES];
+    alignas(32) uint8_t sp[LOCKSTEP_LANES];
+    alignas(32) uint8_t c[LOCKSTEP_LANES];
+    alignas(32) uint8_t z[LOCKSTEP_LANES];
+    alignas(32) uint8_t v[LOCKSTEP_LANES];
+    alignas(32) uint8_t n[LOCKSTEP_LANES];
+    alignas(32) uint8_t p[LOCKSTEP_LANES];
+    alignas(32) uint16_t pc[LOCKSTEP_LANES];
+    alignas(32) uint64_t cycles[LOCKSTEP_LANES];
+    alignas(32) uint64_t deadline[LOCKSTEP_LANES];      // Like the CPU's
+    alignas(32) uint64_t run_deadline[LOCKSTEP_LANES];
+    Rows saved;
+
+    void load(int lane);
+    void store(int lane);
+    CPU::StopReason run_lanes(uint64_t budget);
+    bool execute();
+    bool execute_group();
+    void save_rows();
+    void merge_rows();
+    bool blocked(int lane);
+    bool step_lane(int lane);
+
+    /** Memory of a lane, null where the bus would call a handler */
+    const uint8_t* read_ptr(int lane, uint16_t addr);
+    uint8_t* write_ptr(int lane, uint16_t addr);
+    bool load_address(int lane, uint16_t addr, uint16_t& value);
+
+    /** Operand fetchers, as the CPU's but for rows */
+    static constexpr int inst_size(AddrMode mode);
+    template<AddrMode mode> bool operand_addr(const uint8_t* inst, uint16_t* addr);
+    template<AddrMode mode, bool page_penalty = true> bool read_operand(const uint8_t* inst, uint8_t* op);
+    template<AddrMode mode> bool write_operand(const uint8_t* inst, const uint8_t* value);
+    bool push(const uint8_t* const* values, int count);
+    bool pull(uint8_t* value, int offset, int past = 0);
+    void advance(int size);
+    void set_zn(const uint8_t* value);
+    void set_status(const uint8_t* value);
+    void branch(const uint8_t* inst, const uint8_t* flag);
+    template<AddrMode mode> bool compare(const uint8_t* inst, const uint8_t* value);
+
+    /** CPU INSTRUCTIONS */
+    template<AddrMode mode> bool adc(const uint8_t* inst);
+    template<AddrMode mode> bool and_(const uint8_t* inst);
+    template<AddrMode mode> bool asl(const uint8_t* inst);
+    bool bcc(const uint8_t* inst);
+    bool bcs(const uint8_t* inst);
+    bool beq(const uint8_t* inst);
+    template<AddrMode mode> bool bit(const uint8_t* inst);
+    bool bmi(const uint8_t* inst);
+    bool bne(const uint8_t* inst);
+    bool bpl(const uint8_t* inst);
+    bool brk(const uint8_t* inst);
+    bool bvc(const uint8_t* inst);
+    bool bvs(const uint8_t* inst);
+    bool clc(const uint8_t* inst);
+    bool cld(const uint8_t* inst);
+    bool cli(const uint8_t* inst);
+    bool clv(const uint8_t* inst);
+    template<AddrMode mode> bool cmp(const uint8_t* inst);
+    template<AddrMode mode> bool cpx(const uint8_t* inst);
+    template<AddrMode mode> bool cpy(const uint8_t* inst);
+    template<AddrMode mode> bool dec(const uint8_t* inst);
+    bool dex(const uint8_t* inst);
+    bool dey(const uint8_t* inst);
+    template<AddrMode mode> bool eor(const uint8_t* inst);
+    template<AddrMode mode> bool inc(const uint8_t* inst);
+    bool inx(const uint8_t* inst);
+    bool iny(const uint8_t* inst);
+    template<AddrMode mode> bool jmp(const uint8_t* inst);
+    bool jsr(const uint8_t* inst);
+    template<AddrMode mode> bool lda(const uint8_t* inst);
+    template<AddrMode mode> bool ldx(const uint8_t* inst);
+    template<AddrMode mode> bool ldy(const uint8_t* inst);
+    template<AddrMode mode> bool lsr(const uint8_t* inst);
+    bool nop(const uint8_t* inst);
+    template<AddrMode mode> bool ora(const uint8_t* inst);
+    bool pha(const uint8_t* inst);
+    bool php(const uint8_t* inst);
+    bool pla(const uint8_t* inst);
+    bool plp(const uint8_t* inst);
+    template<AddrMode mode> bool rol(const uint8_t* inst);
+    template<AddrMode mode> bool ror(const uint8_t* inst);
+    bool rti(const uint8_t* inst);
+    bool rts(const uint8_t* inst);
+    template<AddrMode mode> bool sbc(const uint8_t* inst);
+    bool sec(const uint8_t* inst);
+    bool sed(const uint8_t* inst);
+    bool sei(const uint8_t* inst);
+    template<AddrMode mode> bool sta(const uint8_t* inst);
+    template<AddrMode mode> bool stx(const uint8_t* inst);
+    template<AddrMode mode> bool sty(const uint8_t* inst);
+    bool tax(const uint8_t* inst);
+    bool tay(const uint8_t* inst);
+    bool tsx(const uint8_t* inst);
+    bool txa(const uint8_t* inst);
+    bool txs(const uint8_t* inst);
+    bool tya(const uint8_t* inst);
+
+    template<AddrMode mode> bool ill_nop(const uint8_t* inst);
+    bool bad(const uint8_t* inst);
+
+public:
+    LockstepCPU();
+
+    /**
+     * Adds a CPU as the next lane, false once all lanes are taken. Every
+     * lane needs a machine of its own, they are not synchronized with
+     * each other.
+     */
+    bool add_lane(CPU& cpu);
+    int get_lanes();
+
+    /**
+     * Runs every lane until its CPU stops, as CPU::run() would, and returns
+     * once all of them have. The reason is the first lane's, see
+     * get_stop_reason() for the others'.
+     */
+    CPU::StopReason run();
+    /** Runs every lane for at least the given number of cycles of its own */
+    CPU::StopReason run_for(uint64_t cycles);
+    CPU::StopReason get_stop_reason(int lane);
+
+    /** Instructions executed in lockstep, counted once per lane, and by the lanes' CPUs */
+    uint64_t get_lockstep_instructions();
+    uint64_t get_scalar_instructions();
+};
+
+
+#endif //NESEMU_LOCKSTEP_H
@@ -1,16 +1,321 @@
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
 
+#include "batch.h"
 #include "cpu.h"
-#include "ram.h"
+#include "lockstep.h"
+#include "mapper.h"
+#include "nes.h"
+#include "rewind.h"
+#include "rom_cache.h"
+#include "trace.h"
+#include "verify.h"
+#include "wav.h"
 
 using namespace std; 
 
-int main() {
-    ROM rom("nestest.nes");
-    RAM ram;
-    CPU cpu(ram, rom);
+#define REWIND_CAPACITY (4 << 20)
+#define LOCKSTEP_FRAMES 600
+#define NESTEST_START 0xC000   // nestest's automated mode, which runs without a PPU
 
-    cpu.run();
+/** Runs the jobs of a manifest on a thread pool and prints a line per job, in manifest order */
+static int run_batch(const char* manifest, int threads) {
+    vector<BatchJob> jobs;
+    if(!parse_batch_manifest(manifest, jobs))
+        return 2;
 
-    return 0;
+    auto start = chrono::steady_clock::now();
+    BatchRunner(threads).run(jobs);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    int failed = 0;
+    for(BatchJob& job : jobs) {
+        if(!job.ok) {
+            printf("%s:%d: %s: %s\n", manifest, job.line, job.rom.c_str(), job.error.c_str());
+            failed++;
+        } else {
+            printf("%s:%d: %s: %llu frames, %llu cycles in %.3fs%s\n", manifest, job.line, job.rom.c_str(),
+                   (unsigned long long)job.frames_run, (unsigned long long)job.cycles_run, job.seconds,
+                   job.stop == CPU::STOP_ILLEGAL_OPCODE ? ", stopped at an illegal opcode" : "");
+        }
+    }
+    fprintf(stderr, "%zu jobs in %.3fs, %d failed\n", jobs.size(), elapsed.count(), failed);
+    return failed > 0 ? 1 : 0;
+}
+
+/** Lane 0 holds no buttons, the others a mix of their own that changes every 16 frames */
+static uint8_t lockstep_buttons(int lane, uint64_t frame) {
+    return lane == 0 ? 0 : (uint8_t)((frame / 16 + 1) * (lane * 0x3B + 0x11));
+}
+
+/**
+ * Runs copies of a ROM on the lockstep core, each lane with buttons of its
+ * own, then runs the same again on machines of their own and checks that
+ * every lane ended in the same state.
+ */
+static int run_lockstep(std::shared_ptr<ROM> rom, int lanes, uint64_t frames) {
+    vector<unique_ptr<NES>> machines;
+    LockstepCPU lockstep;
+    for(int lane=0; lane<lanes; lane++) {
+        machines.emplace_back(new NES(rom));
+        lockstep.add_lane(machines[lane]->get_cpu());
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint64_t frames_run = 0;
+    bool complete = true;
+    while(complete && frames_run < frames) {
+        for(int lane=0; lane<lanes; lane++)
+            machines[lane]->get_controller().set_buttons(0, lockstep_buttons(lane, frames_run));
+        lockstep.run();
+        for(int lane=0; lane<lanes; lane++) {
+            if(lockstep.get_stop_reason(lane) == CPU::STOP_FRAME_COMPLETE)
+                machines[lane]->end_frame();
+            else
+                complete = false;
+        }
+        frames_run++;
+    }
+    chrono::duration<double> lockstep_time = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    vector<unique_ptr<NES>> references;
+    for(int lane=0; lane<lanes; lane++) {
+        references.emplace_back(new NES(rom));
+        for(uint64_t frame=0; frame<frames_run; frame++) {
+            references[lane]->get_controller().set_buttons(0, lockstep_buttons(lane, frame));
+            if(references[lane]->run_frame() != CPU::STOP_FRAME_COMPLETE)
+                break;
+        }
+    }
+    chrono::duration<double> scalar_time = chrono::steady_clock::now() - start;
+
+    int differ = 0;
+    vector<uint8_t> state, reference;
+    for(int lane=0; lane<lanes; lane++) {
+        machines[lane]->save_state(state);
+        references[lane]->save_state(reference);
+        if(state != reference) {
+            fprintf(stderr, "lane %d: state differs from a machine run on its own\n", lane);
+            differ++;
+        }
+    }
+
+    uint64_t together = lockstep.get_lockstep_instructions();
+    uint64_t total = together + lockstep.get_scalar_instructions();
+    printf("%d lanes, %llu frames: %llu instructions, %.1f%% in lockstep, %.3fs vs %.3fs one machine at a time,"
+           " %d lanes differ\n", lanes, (unsigned long long)frames_run, (unsigned long long)total,
+           total > 0 ? 100.0 * together / total : 0.0, lockstep_time.count(), scalar_time.count(), differ);
+    return differ > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    const char* rom_file = "nestest.nes";
+    const char* verify_file = nullptr;
+    bool nestest = false;
+    CPU::Engine engine = CPU::ENGINE_TABLE;
+    bool engine_set = false;
+    bool quiet = false;
+    bool shared_rom = false;
+    const char* trace_file = nullptr;
+    bool trace_sync = false;
+    bool trace_compress = false;
+    AsyncTraceWriter::FullPolicy trace_policy = AsyncTraceWriter::TRACE_BLOCK;
+    uint64_t frames = 0;
+    PPU::Mode ppu_mode = PPU::MODE_SCANLINE;
+    const char* screenshot_file = nullptr;
+    const char* wav_file = nullptr;
+    const char* load_state_file = nullptr;
+    const char* save_state_file = nullptr;
+    int rewind_interval = 0;
+    const char* batch_file = nullptr;
+    int batch_threads = 0;
+    int lockstep_lanes = 0;
+
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--threaded") == 0) {
+            engine = CPU::ENGINE_THREADED;
+            engine_set = true;
+        } else if(strcmp(argv[i], "--table") == 0) {
+            engine = CPU::ENGINE_TABLE;
+            engine_set = true;
+        } else if(strcmp(argv[i], "--jit") == 0) {
+            engine = CPU::ENGINE_JIT;
+            engine_set = true;
+        } else if(strcmp(argv[i], "--quiet") == 0)
+            quiet = true;
+        else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+            trace_file = argv[++i];
+        else if(strcmp(argv[i], "--trace-sync") == 0)
+            trace_sync = true;
+        else if(strcmp(argv[i], "--trace-compress") == 0)
+            trace_compress = true;
+        else if(strcmp(argv[i], "--trace-drop") == 0)
+            trace_policy = AsyncTraceWriter::TRACE_DROP;
+        else if(strcmp(argv[i], "--verify") == 0 && i+1 < argc)
+            verify_file = argv[++i];
+        else if(strcmp(argv[i], "--nestest") == 0)
+            nestest = true;
+        else if(strcmp(argv[i], "--shm") == 0)
+            shared_rom = true;
+        else if(strcmp(argv[i], "--ppu-dot") == 0)
+            ppu_mode = PPU::MODE_DOT;
+        else if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+            frames = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--screenshot") == 0 && i+1 < argc)
+            screenshot_file = argv[++i];
+        else if(strcmp(argv[i], "--wav") == 0 && i+1 < argc)
+            wav_file = argv[++i];
+        else if(strcmp(argv[i], "--load-state") == 0 && i+1 < argc)
+            load_state_file = argv[++i];
+        else if(strcmp(argv[i], "--save-state") == 0 && i+1 < argc)
+            save_state_file = argv[++i];
+        else if(strcmp(argv[i], "--rewind") == 0 && i+1 < argc)
+            rewind_interval = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--batch") == 0 && i+1 < argc)
+            batch_file = argv[++i];
+        else if(strcmp(argv[i], "--jobs") == 0 && i+1 < argc)
+            batch_threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--lockstep") == 0 && i+1 < argc)
+            lockstep_lanes = atoi(argv[++i]);
+        else if(argv[i][0] != '-')
+            rom_file = argv[i];
+        else {
+            fprintf(stderr, "usage: %s [--threaded|--table|--jit] [--quiet] [--trace FILE [--trace-sync]"
+                            " [--trace-compress] [--trace-drop]] [--verify LOG] [--nestest] [--shm] [--ppu-dot] [--frames N]"
+                            " [--screenshot FILE] [--wav FILE] [--load-state FILE] [--save-state FILE]"
+                            " [--rewind N] [ROM]\n"
+                            "       %s --batch MANIFEST [--jobs N]\n"
+                            "       %s --lockstep LANES [--frames N] [ROM]\n", argv[0], argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if(batch_file != nullptr)
+        return run_batch(batch_file, batch_threads);
+
+    if(shared_rom)
+        RomCache::get().set_shared_memory(true);
+    std::shared_ptr<ROM> rom = RomCache::get().load(rom_file);
+    if(!rom->ok()) {
+        fprintf(stderr, "%s: %s\n", rom_file, rom->get_error());
+        return 1;
+    }
+    if(!Mapper::is_supported(rom->get_mapper())) {
+        fprintf(stderr, "%s: mapper %d is not supported\n", rom_file, rom->get_mapper());
+        return 1;
+    }
+    if(lockstep_lanes != 0) {
+        if(lockstep_lanes < 1 || lockstep_lanes > LOCKSTEP_LANES) {
+            fprintf(stderr, "--lockstep takes 1 to %d lanes\n", LOCKSTEP_LANES);
+            return 2;
+        }
+        return run_lockstep(rom, lockstep_lanes, frames > 0 ? frames : LOCKSTEP_FRAMES);
+    }
+    NES nes(rom, ppu_mode);
+    CPU& cpu = nes.get_cpu();
+    // Reference logs in the nestest format start where its automated mode does
+    if(nestest || verify_file != nullptr)
+        cpu.set_pc(NESTEST_START);
+    if(engine_set)
+        cpu.set_engine(engine);
+    // Traces go to stdout as text unless a trace file or reference log takes them
+    TextTraceSink stdout_trace(stdout);
+    cpu.set_trace_sink(&stdout_trace);
+    cpu.set_tracing(!quiet);
+    if(load_state_file != nullptr && !nes.load_state_file(load_state_file))
+        return 1;
+
+    // Binary traces are written from a background thread unless --trace-sync
+    TraceWriter* trace_writer = nullptr;
+    AsyncTraceWriter* async_trace_writer = nullptr;
+    if(trace_file != nullptr && trace_sync) {
+        trace_writer = new TraceWriter(trace_file, trace_compress);
+        if(!trace_writer->is_open())
+            return 1;
+        cpu.set_trace_sink(trace_writer);
+    } else if(trace_file != nullptr) {
+        async_trace_writer = new AsyncTraceWriter(trace_file, trace_policy, trace_compress);
+        if(!async_trace_writer->is_open())
+            return 1;
+        cpu.set_trace_sink(async_trace_writer);
+    }
+
+    // The verifier takes the place of the trace output
+    TraceVerifier* verifier = nullptr;
+    if(verify_file != nullptr) {
+        verifier = new TraceVerifier(verify_file, cpu);
+        if(!verifier->is_open())
+            return 1;
+        cpu.set_trace_sink(verifier);
+        cpu.set_tracing(true);
+    }
+
+    WavWriter* wav_writer = nullptr;
+    if(wav_file != nullptr) {
+        wav_writer = new WavWriter(wav_file, SAMPLE_RATE);
+        if(!wav_writer->is_open())
+            return 1;
+    }
+
+    // Keeps a snapshot every N frames, as QA builds do to step back from a bug
+    Rewind* rewind = nullptr;
+    if(rewind_interval > 0)
+        rewind = new Rewind(nes, rewind_interval, REWIND_CAPACITY);
+
+    auto start = chrono::steady_clock::now();
+    uint64_t start_cycles = cpu.get_cycles();
+    // Without a frame count the console runs until the CPU stops
+    for(uint64_t frame=0; frames == 0 || frame<frames; frame++) {
+        if(nes.run_frame() != CPU::STOP_FRAME_COMPLETE)
+            break;
+        if(wav_writer != nullptr)
+            wav_writer->write(nes.get_apu().get_samples(), nes.get_apu().get_sample_count());
+        if(rewind != nullptr)
+            rewind->end_frame();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    uint64_t cycles = cpu.get_cycles() - start_cycles;
+    fprintf(stderr, "%llu cycles in %.3fs (%.2f MHz emulated)\n",
+            (unsigned long long)cycles, elapsed.count(),
+            cycles / elapsed.count() / 1e6);
+
+    int status = 0;
+    if(screenshot_file != nullptr && !nes.get_ppu().save_frame(screenshot_file))
+        status = 1;
+    if(save_state_file != nullptr && !nes.save_state_file(save_state_file))
+        status = 1;
+    if(verifier != nullptr) {
+        if(verifier->has_diverged())
+            status = 1;
+        else if(verifier->is_exhausted())
+            printf("Verified %llu instructions, matching the whole reference\n",
+                   (unsigned long long)verifier->get_checked());
+        else {
+            printf("Verified %llu instructions, the CPU stopped before the end of the reference\n",
+                   (unsigned long long)verifier->get_checked());
+            status = 1;
+        }
+        delete verifier;
+    }
+
+    if(rewind != nullptr) {
+        fprintf(stderr, "%zu rewind snapshots in %zu bytes\n", rewind->get_count(), rewind->get_size());
+        delete rewind;
+    }
+    delete wav_writer;
+    delete trace_writer;
+    if(async_trace_writer != nullptr) {
+        if(async_trace_writer->get_dropped() > 0)
+            fprintf(stderr, "%llu trace records dropped\n",
+                    (unsigned long long)async_trace_writer->get_dropped());
+        delete async_trace_writer;
+    }
+
+    return status;
 }
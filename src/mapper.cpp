@@ -0,0 +1,440 @@
+#include "mapper.h"
+
+#include <cstring>
+
+#define PRG_ADDR 0x8000
+#define PRG_RAM_ADDR 0x6000
+#define PRG_RAM_WINDOW 0x2000
+#define TRAINER_OFFSET 0x1000
+#define TRAINER_SIZE 0x0200
+
+Mapper* Mapper::create(ROM& rom, Bus& bus) {
+    Mapper* mapper;
+    switch(rom.get_mapper()) {
+        case 0: mapper = new NROM(rom, bus); break;
+        case 1: mapper = new MMC1(rom, bus); break;
+        case 2: mapper = new UxROM(rom, bus); break;
+        case 3: mapper = new CNROM(rom, bus); break;
+        case 4: mapper = new MMC3(rom, bus); break;
+        case 7: mapper = new AxROM(rom, bus); break;
+        default: return nullptr;
+    }
+    mapper->reset();
+    return mapper;
+}
+
+bool Mapper::is_supported(uint16_t number) {
+    return number <= 4 || number == 7;
+}
+
+Mapper::Mapper(ROM& rom, Bus& bus): rom(rom), bus(bus), chr_slots(), tiles(chr_slots) {
+    mirroring = rom.get_mirroring();
+    irq = false;
+    irq_handler = nullptr;
+    irq_context = nullptr;
+    prg_ram.resize(rom.get_prg_ram_size());
+    if(rom.is_chr_ram())
+        chr_ram.resize(rom.get_chr_size());
+    if(rom.get_trainer() != nullptr && prg_ram.size() >= TRAINER_OFFSET + TRAINER_SIZE)
+        memcpy(&prg_ram[TRAINER_OFFSET], rom.get_trainer(), TRAINER_SIZE);
+
+    if(!prg_ram.empty()) {
+        uint32_t window = prg_ram.size() < PRG_RAM_WINDOW ? prg_ram.size() : PRG_RAM_WINDOW;
+        bus.map_memory(PRG_RAM_ADDR, PRG_RAM_ADDR + PRG_RAM_WINDOW - 1, prg_ram.data(), window, true);
+    }
+    bus.map_io(PRG_ADDR, 0xFFFF, nullptr, write_register, this);
+}
+
+void Mapper::write_register(void* mapper, uint16_t addr, uint8_t value) {
+    ((Mapper*)mapper)->write(addr, value);
+}
+
+/** Power up banks: the first PRG banks at $8000, the last two at $C000, the first 8 KiB of CHR */
+void Mapper::reset() {
+    set_prg_bank(0, 0, PRG_SLOT_SIZE);
+    set_prg_bank(1, 1, PRG_SLOT_SIZE);
+    set_prg_bank(2, -2, PRG_SLOT_SIZE);
+    set_prg_bank(3, -1, PRG_SLOT_SIZE);
+    for(int slot=0; slot<CHR_SLOTS; slot++)
+        set_chr_bank(slot, slot, CHR_SLOT_SIZE);
+    mirroring = rom.get_mirroring();
+    set_irq(false);
+}
+
+uint8_t* Mapper::chr_memory() {
+    return chr_ram.empty() ? rom.get_chr() : chr_ram.data();
+}
+
+uint32_t Mapper::prg_banks(uint32_t size) {
+    uint32_t banks = rom.get_prg_rom_size() / size;
+    return banks == 0 ? 1 : banks;
+}
+
+uint32_t Mapper::chr_banks(uint32_t size) {
+    uint32_t banks = rom.get_chr_size() / size;
+    return banks == 0 ? 1 : banks;
+}
+
+/**
+ * Points size bytes of PRG slots starting at slot to a bank. ROMs smaller
+ * than the bank are mirrored across it, as the address lines are not
+ * connected.
+ */
+void Mapper::set_prg_bank(int slot, int bank, uint32_t size) {
+    int banks = prg_banks(size);
+    bank = ((bank % banks) + banks) % banks;
+    uint32_t prg_size = rom.get_prg_rom_size();
+    for(uint32_t i=0; i<size/PRG_SLOT_SIZE; i++)
+        map_prg_slot(slot + i, rom.get_prg_rom() + ((uint32_t)bank * size + i * PRG_SLOT_SIZE) % prg_size);
+}
+
+void Mapper::set_chr_bank(int slot, int bank, uint32_t size) {
+    int banks = chr_banks(size);
+    bank = ((bank % banks) + banks) % banks;
+    uint32_t chr_size = rom.get_chr_size();
+    for(uint32_t i=0; i<size/CHR_SLOT_SIZE; i++)
+        map_chr_slot(slot + i, chr_memory() + ((uint32_t)bank * size + i * CHR_SLOT_SIZE) % chr_size);
+}
+
+void Mapper::map_prg_slot(int slot, uint8_t* ptr) {
+    uint32_t prg_size = rom.get_prg_rom_size();
+    uint32_t window = prg_size < PRG_SLOT_SIZE ? prg_size : PRG_SLOT_SIZE;
+    uint16_t start = PRG_ADDR + slot * PRG_SLOT_SIZE;
+    prg_slots[slot] = ptr;
+    bus.map_memory(start, start + PRG_SLOT_SIZE - 1, ptr, window, false);
+}
+
+void Mapper::map_chr_slot(int slot, uint8_t* ptr) {
+    // Registers get rewritten with the same banks all the time, keep those decoded
+    if(chr_slots[slot] != ptr) {
+        chr_slots[slot] = ptr;
+        tiles.invalidate_slot(slot);
+    }
+}
+
+/** Also drops the decoded tile from every slot showing the same bank */
+void Mapper::write_chr(uint16_t addr, uint8_t value) {
+    if(chr_ram.empty())
+        return;
+    uint8_t* bank = chr_slots[addr >> 10];
+    bank[addr & (CHR_SLOT_SIZE - 1)] = value;
+    for(int slot=0; slot<CHR_SLOTS; slot++) {
+        if(chr_slots[slot] == bank)
+            tiles.invalidate_tile(slot, addr & (CHR_SLOT_SIZE - 1));
+    }
+}
+
+uint8_t* Mapper::get_chr_slot(int slot) {
+    return chr_slots[slot];
+}
+
+ROM::Mirroring Mapper::get_mirroring() {
+    return mirroring;
+}
+
+bool Mapper::irq_pending() {
+    return irq;
+}
+
+void Mapper::set_irq_handler(IrqHandler handler, void* context) {
+    irq_handler = handler;
+    irq_context = context;
+}
+
+void Mapper::set_irq(bool asserted) {
+    if(asserted == irq)
+        return;
+    irq = asserted;
+    if(irq_handler != nullptr)
+        irq_handler(irq_context, asserted);
+}
+
+/** Slots are saved as offsets into PRG ROM and CHR memory */
+void Mapper::save_state(StateWriter& state) {
+    for(uint8_t* slot : prg_slots) {
+        uint32_t offset = slot - rom.get_prg_rom();
+        state.value(offset);
+    }
+    for(uint8_t* slot : chr_slots) {
+        uint32_t offset = slot - chr_memory();
+        state.value(offset);
+    }
+    state.value(mirroring);
+    state.value(irq);
+    state.bytes(prg_ram.data(), prg_ram.size());
+    state.bytes(chr_ram.data(), chr_ram.size());
+}
+
+/**
+ * Offsets that would point a slot past the end of its memory fail the
+ * load. The IRQ line is restored without calling the handler, the CPU
+ * restores its own side. CHR RAM comes back with new contents, so none of
+ * its decoded tiles can be kept.
+ */
+void Mapper::load_state(StateReader& state) {
+    uint32_t prg_size = rom.get_prg_rom_size();
+    uint32_t prg_window = prg_size < PRG_SLOT_SIZE ? prg_size : PRG_SLOT_SIZE;
+    for(int slot=0; slot<PRG_SLOTS; slot++) {
+        uint32_t offset = 0;
+        state.value(offset);
+        if(offset > prg_size - prg_window) {
+            state.fail();
+            return;
+        }
+        map_prg_slot(slot, rom.get_prg_rom() + offset);
+    }
+    for(int slot=0; slot<CHR_SLOTS; slot++) {
+        uint32_t offset = 0;
+        state.value(offset);
+        if(offset + CHR_SLOT_SIZE > rom.get_chr_size()) {
+            state.fail();
+            return;
+        }
+        map_chr_slot(slot, chr_memory() + offset);
+    }
+    state.value(mirroring);
+    if(mirroring > ROM::MIRROR_SINGLE_HIGH)
+        state.fail();
+    state.value(irq);
+    state.bytes(prg_ram.data(), prg_ram.size());
+    state.bytes(chr_ram.data(), chr_ram.size());
+    if(!chr_ram.empty()) {
+        for(int slot=0; slot<CHR_SLOTS; slot++)
+            tiles.invalidate_slot(slot);
+    }
+}
+
+NROM::NROM(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void NROM::write(uint16_t addr, uint8_t value) {}
+
+MMC1::MMC1(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void MMC1::reset() {
+    Mapper::reset();
+    shift = 0x10;
+    control = 0x0C;
+    chr_bank0 = 0;
+    chr_bank1 = 0;
+    prg_bank = 0;
+    update_banks();
+}
+
+/**
+ * Registers are loaded a bit at a time, LSB first, through a 5 bit shift
+ * register. The marker bit reaching bit 0 means the fifth write, which
+ * selects the register by address. Bit 7 set resets the shift register.
+ */
+void MMC1::write(uint16_t addr, uint8_t value) {
+    if(value & 0x80) {
+        shift = 0x10;
+        control |= 0x0C;
+        update_banks();
+        return;
+    }
+
+    bool full = shift & 0x01;
+    shift = (shift >> 1) | ((value & 0x01) << 4);
+    if(!full)
+        return;
+
+    switch((addr >> 13) & 0x03) {
+        case 0: control = shift; break;
+        case 1: chr_bank0 = shift; break;
+        case 2: chr_bank1 = shift; break;
+        case 3: prg_bank = shift; break;
+    }
+    shift = 0x10;
+    update_banks();
+}
+
+void MMC1::update_banks() {
+    static const ROM::Mirroring mirroring_modes[4] = {
+        ROM::MIRROR_SINGLE_LOW, ROM::MIRROR_SINGLE_HIGH, ROM::MIRROR_VERTICAL, ROM::MIRROR_HORIZONTAL,
+    };
+    mirroring = mirroring_modes[control & 0x03];
+
+    if(control & 0x10) {
+        set_chr_bank(0, chr_bank0, 0x1000);
+        set_chr_bank(4, chr_bank1, 0x1000);
+    } else {
+        set_chr_bank(0, chr_bank0 >> 1, 0x2000);
+    }
+
+    // 512 KiB boards (SUROM) pick the 256 KiB half with a CHR register bit
+    int outer = rom.get_prg_rom_size() > 0x40000 ? chr_bank0 & 0x10 : 0;
+    int bank = prg_bank & 0x0F;
+    switch((control >> 2) & 0x03) {
+        case 0: case 1:
+            set_prg_bank(0, (outer | bank) >> 1, 0x8000);
+            break;
+        case 2:
+            set_prg_bank(0, outer, 0x4000);
+            set_prg_bank(2, outer | bank, 0x4000);
+            break;
+        case 3:
+            set_prg_bank(0, outer | bank, 0x4000);
+            set_prg_bank(2, outer | 0x0F, 0x4000);
+            break;
+    }
+}
+
+template<typename State> void MMC1::serialize(State& state) {
+    state.value(shift);
+    state.value(control);
+    state.value(chr_bank0);
+    state.value(chr_bank1);
+    state.value(prg_bank);
+}
+
+void MMC1::save_state(StateWriter& state) {
+    Mapper::save_state(state);
+    serialize(state);
+}
+
+void MMC1::load_state(StateReader& state) {
+    Mapper::load_state(state);
+    serialize(state);
+}
+
+UxROM::UxROM(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void UxROM::reset() {
+    Mapper::reset();
+    set_prg_bank(0, 0, 0x4000);
+    set_prg_bank(2, -1, 0x4000);
+}
+
+void UxROM::write(uint16_t addr, uint8_t value) {
+    set_prg_bank(0, value, 0x4000);
+}
+
+CNROM::CNROM(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void CNROM::write(uint16_t addr, uint8_t value) {
+    set_chr_bank(0, value, 0x2000);
+}
+
+MMC3::MMC3(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void MMC3::reset() {
+    Mapper::reset();
+    static const uint8_t initial_banks[8] = {0, 2, 4, 5, 6, 7, 0, 1};
+    bank_select = 0;
+    memcpy(bank_registers, initial_banks, sizeof(bank_registers));
+    irq_latch = 0;
+    irq_counter = 0;
+    irq_reload = false;
+    irq_enabled = false;
+    update_banks();
+}
+
+void MMC3::write(uint16_t addr, uint8_t value) {
+    switch(addr & 0xE001) {
+        case 0x8000:
+            bank_select = value;
+            update_banks();
+            break;
+        case 0x8001:
+            bank_registers[bank_select & 0x07] = value;
+            update_banks();
+            break;
+        case 0xA000:
+            if(rom.get_mirroring() != ROM::MIRROR_FOUR_SCREEN)
+                mirroring = value & 0x01 ? ROM::MIRROR_HORIZONTAL : ROM::MIRROR_VERTICAL;
+            break;
+        case 0xA001:
+            break;  // PRG RAM protect, RAM is always enabled
+        case 0xC000:
+            irq_latch = value;
+            break;
+        case 0xC001:
+            irq_counter = 0;
+            irq_reload = true;
+            break;
+        case 0xE000:
+            irq_enabled = false;
+            set_irq(false);
+            break;
+        case 0xE001:
+            irq_enabled = true;
+            break;
+    }
+}
+
+/**
+ * R6 and R7 are 8 KiB PRG banks, with the second to last bank at either
+ * $8000 or $C000. R0 and R1 are 2 KiB CHR banks and R2-R5 1 KiB banks, in
+ * the lower or upper pattern table depending on the inversion bit.
+ */
+void MMC3::update_banks() {
+    if(bank_select & 0x40) {
+        set_prg_bank(0, -2, PRG_SLOT_SIZE);
+        set_prg_bank(2, bank_registers[6] & 0x3F, PRG_SLOT_SIZE);
+    } else {
+        set_prg_bank(0, bank_registers[6] & 0x3F, PRG_SLOT_SIZE);
+        set_prg_bank(2, -2, PRG_SLOT_SIZE);
+    }
+    set_prg_bank(1, bank_registers[7] & 0x3F, PRG_SLOT_SIZE);
+    set_prg_bank(3, -1, PRG_SLOT_SIZE);
+
+    int big = bank_select & 0x80 ? 4 : 0;
+    int small = bank_select & 0x80 ? 0 : 4;
+    set_chr_bank(big, bank_registers[0] >> 1, 0x0800);
+    set_chr_bank(big + 2, bank_registers[1] >> 1, 0x0800);
+    for(int i=0; i<4; i++)
+        set_chr_bank(small + i, bank_registers[2 + i], CHR_SLOT_SIZE);
+}
+
+/** Clocked once per scanline, raises the IRQ when the counter reaches zero */
+void MMC3::scanline() {
+    if(irq_counter == 0 || irq_reload) {
+        irq_counter = irq_latch;
+        irq_reload = false;
+    } else {
+        irq_counter--;
+    }
+    if(irq_counter == 0 && irq_enabled)
+        set_irq(true);
+}
+
+/** A reload from a latch of 0 raises the IRQ on every line */
+int MMC3::scanlines_until_irq() {
+    if(!irq_enabled)
+        return -1;
+    if(irq_counter == 0 || irq_reload)
+        return irq_latch == 0 ? 1 : 1 + irq_latch;
+    return irq_counter;
+}
+
+template<typename State> void MMC3::serialize(State& state) {
+    state.value(bank_select);
+    state.bytes(bank_registers, sizeof(bank_registers));
+    state.value(irq_latch);
+    state.value(irq_counter);
+    state.value(irq_reload);
+    state.value(irq_enabled);
+}
+
+void MMC3::save_state(StateWriter& state) {
+    Mapper::save_state(state);
+    serialize(state);
+}
+
+void MMC3::load_state(StateReader& state) {
+    Mapper::load_state(state);
+    serialize(state);
+}
+
+AxROM::AxROM(ROM& rom, Bus& bus): Mapper(rom, bus) {}
+
+void AxROM::reset() {
+    Mapper::reset();
+    set_prg_bank(0, 0, 0x8000);
+    mirroring = ROM::MIRROR_SINGLE_LOW;
+}
+
+void AxROM::write(uint16_t addr, uint8_t value) {
+    set_prg_bank(0, value & 0x07, 0x8000);
+    mirroring = value & 0x10 ? ROM::MIRROR_SINGLE_HIGH : ROM::MIRROR_SINGLE_LOW;
+}
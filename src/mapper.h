@@ -0,0 +1,173 @@
+#ifndef NESEMU_MAPPER_H
+#define NESEMU_MAPPER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "bus.h"
+#include "rom.h"
+#include "state.h"
+#include "tile_cache.h"
+
+#define PRG_SLOT_SIZE 0x2000
+#define PRG_SLOTS 4
+#define CHR_SLOT_SIZE 0x0400
+#define CHR_SLOTS 8
+
+/**
+ * Cartridge hardware between the ROM chips and the CPU and PPU buses. The
+ * CPU side is four 8 KiB PRG slots at $8000-$FFFF plus PRG RAM at
+ * $6000-$7FFF, the PPU side eight 1 KiB CHR slots at $0000-$1FFF. A bank
+ * switch only repoints a slot, and PRG slots are mapped into the Bus
+ * directly, so reads never go through the mapper. Register writes to
+ * $8000-$FFFF reach write() through a Bus write handler. The CHR slots
+ * also have decoded copies for the PPU, dropped when a slot is switched.
+ */
+class Mapper {
+public:
+    /** Called with the new level when the cartridge raises or releases the CPU IRQ line */
+    typedef void (*IrqHandler)(void* context, bool asserted);
+
+protected:
+    ROM& rom;
+    Bus& bus;
+
+    uint8_t* prg_slots[PRG_SLOTS];
+    uint8_t* chr_slots[CHR_SLOTS];
+    TileCache tiles;
+    ROM::Mirroring mirroring;
+    bool irq;
+    IrqHandler irq_handler;
+    void* irq_context;
+
+    std::vector<uint8_t> prg_ram;
+    std::vector<uint8_t> chr_ram;   // Used instead of CHR ROM when the cartridge has none
+
+    uint8_t* chr_memory();
+    uint32_t prg_banks(uint32_t size);
+    uint32_t chr_banks(uint32_t size);
+
+    /** Bank switching. Bank numbers wrap around the ROM size, negative ones count from the end */
+    void set_prg_bank(int slot, int bank, uint32_t size);
+    void set_chr_bank(int slot, int bank, uint32_t size);
+    void map_prg_slot(int slot, uint8_t* ptr);
+    void map_chr_slot(int slot, uint8_t* ptr);
+    void set_irq(bool asserted);
+
+    static void write_register(void* mapper, uint16_t addr, uint8_t value);
+
+public:
+    Mapper(ROM& rom, Bus& bus);
+    virtual ~Mapper() {}
+
+    /** Creates the mapper the ROM asks for, nullptr if it is not supported */
+    static Mapper* create(ROM& rom, Bus& bus);
+    static bool is_supported(uint16_t number);
+
+    /** Puts the registers in their power up state and maps memory */
+    virtual void reset();
+    /** Write to a register in $8000-$FFFF */
+    virtual void write(uint16_t addr, uint8_t value) = 0;
+    /** Called by the PPU at the end of every rendered scanline */
+    virtual void scanline() {}
+    /** Number of scanline() calls until the one that raises the IRQ, -1 if none will */
+    virtual int scanlines_until_irq() { return -1; }
+    /**
+     * Banks, mirroring, the IRQ line and cartridge RAM. Mappers with
+     * registers of their own add them after these.
+     */
+    virtual void save_state(StateWriter& state);
+    virtual void load_state(StateReader& state);
+
+    /** Pattern table byte at a PPU address in $0000-$1FFF */
+    uint8_t read_chr(uint16_t addr) {
+        return chr_slots[addr >> 10][addr & (CHR_SLOT_SIZE - 1)];
+    }
+    void write_chr(uint16_t addr, uint8_t value);
+    /** The 8 decoded pixels (0-3) of the tile row at a PPU address in $0000-$1FFF */
+    const uint8_t* get_tile_row(uint16_t addr) {
+        return tiles.get_row(addr);
+    }
+    /** The 1 KiB of CHR memory a CHR slot currently points at */
+    uint8_t* get_chr_slot(int slot);
+    ROM::Mirroring get_mirroring();
+    /** True while the cartridge holds the CPU IRQ line low */
+    bool irq_pending();
+    void set_irq_handler(IrqHandler handler, void* context);
+};
+
+/** Mapper 0: fixed 16 or 32 KiB of PRG and 8 KiB of CHR */
+class NROM : public Mapper {
+public:
+    NROM(ROM& rom, Bus& bus);
+    void write(uint16_t addr, uint8_t value) override;
+};
+
+/** Mapper 1: serial 5 bit registers, switchable PRG and CHR modes */
+class MMC1 : public Mapper {
+private:
+    uint8_t shift;
+    uint8_t control;
+    uint8_t chr_bank0;
+    uint8_t chr_bank1;
+    uint8_t prg_bank;
+
+    void update_banks();
+    template<typename State> void serialize(State& state);
+
+public:
+    MMC1(ROM& rom, Bus& bus);
+    void reset() override;
+    void write(uint16_t addr, uint8_t value) override;
+    void save_state(StateWriter& state) override;
+    void load_state(StateReader& state) override;
+};
+
+/** Mapper 2: switchable 16 KiB PRG bank at $8000, last bank fixed at $C000 */
+class UxROM : public Mapper {
+public:
+    UxROM(ROM& rom, Bus& bus);
+    void reset() override;
+    void write(uint16_t addr, uint8_t value) override;
+};
+
+/** Mapper 3: fixed PRG, switchable 8 KiB CHR bank */
+class CNROM : public Mapper {
+public:
+    CNROM(ROM& rom, Bus& bus);
+    void write(uint16_t addr, uint8_t value) override;
+};
+
+/** Mapper 4: 8 KiB PRG and 1/2 KiB CHR banks, scanline counter IRQ */
+class MMC3 : public Mapper {
+private:
+    uint8_t bank_select;
+    uint8_t bank_registers[8];
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+
+    void update_banks();
+    template<typename State> void serialize(State& state);
+
+public:
+    MMC3(ROM& rom, Bus& bus);
+    void reset() override;
+    void write(uint16_t addr, uint8_t value) override;
+    void scanline() override;
+    int scanlines_until_irq() override;
+    void save_state(StateWriter& state) override;
+    void load_state(StateReader& state) override;
+};
+
+/** Mapper 7: switchable 32 KiB PRG bank and single screen mirroring */
+class AxROM : public Mapper {
+public:
+    AxROM(ROM& rom, Bus& bus);
+    void reset() override;
+    void write(uint16_t addr, uint8_t value) override;
+};
+
+
+#endif //NESEMU_MAPPER_H
@@ -0,0 +1,161 @@
+#include "nes.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+NES::NES(std::shared_ptr<ROM> rom, PPU::Mode ppu_mode): rom(rom), cpu(ram) {
+    error = nullptr;
+    mapper.reset(Mapper::create(*rom, cpu.get_bus()));
+    if(mapper == nullptr) {
+        error = "mapper is not supported";
+        return;
+    }
+    mapper->set_irq_handler(update_irq, this);
+    ppu.reset(new PPU(*mapper, ppu_mode));
+    ppu->attach(cpu);
+    apu.attach(cpu);
+    apu.set_irq_handler(update_irq, this);
+    controller.attach(cpu);
+    cpu.get_bus().map_io(0x8000, 0xFFFF, nullptr, write_cartridge, this);
+    cpu.reset();
+}
+
+/** The cartridge and the APU share the IRQ line, which is low while either pulls it */
+void NES::update_irq(void* nes, bool asserted) {
+    NES* self = (NES*)nes;
+    self->cpu.set_irq(self->mapper->irq_pending() || self->apu.irq_pending());
+}
+
+/**
+ * Takes mapper register writes over from the mapper's own handler. Bank
+ * switches change what the PPU fetches, so it is caught up first, and the
+ * IRQ counter registers move the mapper's event.
+ */
+void NES::write_cartridge(void* nes, uint16_t addr, uint8_t value) {
+    NES* self = (NES*)nes;
+    self->ppu->sync(self->cpu.get_cycles());
+    self->mapper->write(addr, value);
+    self->ppu->schedule_events();
+}
+
+bool NES::ok() {
+    return error == nullptr;
+}
+
+const char* NES::get_error() {
+    return error;
+}
+
+CPU& NES::get_cpu() {
+    return cpu;
+}
+
+PPU& NES::get_ppu() {
+    return *ppu;
+}
+
+APU& NES::get_apu() {
+    return apu;
+}
+
+Controller& NES::get_controller() {
+    return controller;
+}
+
+Mapper& NES::get_mapper() {
+    return *mapper;
+}
+
+/** The PPU's events run inside the CPU, which stops when one of them ends the frame */
+CPU::StopReason NES::run_frame() {
+    CPU::StopReason reason = cpu.run();
+    if(reason == CPU::STOP_FRAME_COMPLETE)
+        end_frame();
+    return reason;
+}
+
+void NES::end_frame() {
+    apu.end_frame(cpu.get_cycles());
+}
+
+CPU::StopReason NES::run() {
+    CPU::StopReason reason;
+    do {
+        reason = run_frame();
+    } while(reason == CPU::STOP_FRAME_COMPLETE);
+    return reason;
+}
+
+/** Every chip in a fixed order after the header, see STATE_VERSION */
+void NES::save_state(std::vector<uint8_t>& blob, uint32_t flags) {
+    StateHeader header = {};
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.rom_crc = rom->get_crc32();
+    header.flags = flags;
+
+    blob.clear();
+    StateWriter state(blob, flags);
+    state.bytes(&header, sizeof(header));
+    cpu.save_state(state);
+    ram.save_state(state);
+    ppu->save_state(state);
+    apu.save_state(state);
+    controller.save_state(state);
+    mapper->save_state(state);
+    uint32_t size = blob.size();
+    memcpy(&blob[offsetof(StateHeader, size)], &size, sizeof(size));
+}
+
+bool NES::load_state(const uint8_t* data, size_t size) {
+    StateHeader header;
+    if(size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0 || header.version != STATE_VERSION
+       || header.size != size || header.rom_crc != rom->get_crc32() || (header.flags & ~STATE_NO_FRAME) != 0)
+        return false;
+
+    StateReader state(data + sizeof(header), size - sizeof(header), header.flags);
+    cpu.load_state(state);
+    ram.load_state(state);
+    ppu->load_state(state);
+    apu.load_state(state);
+    controller.load_state(state);
+    mapper->load_state(state);
+    return state.ok();
+}
+
+bool NES::save_state_file(const char* filename) {
+    std::vector<uint8_t> blob;
+    save_state(blob);
+    FILE* file = fopen(filename, "wb");
+    if(file == nullptr) {
+        perror(filename);
+        return false;
+    }
+    bool written = fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+    if(fclose(file) != 0)
+        written = false;
+    return written;
+}
+
+bool NES::load_state_file(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if(file == nullptr) {
+        perror(filename);
+        return false;
+    }
+    std::vector<uint8_t> blob;
+    uint8_t buf[0x4000];
+    size_t count;
+    while((count = fread(buf, 1, sizeof(buf), file)) > 0)
+        blob.insert(blob.end(), buf, buf + count);
+    fclose(file);
+    if(!load_state(blob.data(), blob.size())) {
+        fprintf(stderr, "%s: not a version %d save state of this ROM\n", filename, STATE_VERSION);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef NESEMU_NES_H
+#define NESEMU_NES_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "apu.h"
+#include "controller.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "ram.h"
+#include "rom.h"
+#include "state.h"
+
+/**
+ * The whole console: CPU, RAM, PPU, APU, controllers and the cartridge's
+ * mapper, wired together. The CPU is the only clock. It runs uninterrupted
+ * up to the next event the other chips have put in its scheduler, and they
+ * catch up with it then, or earlier when the CPU touches their registers.
+ *
+ * Check ok() after construction, the ROM's mapper may not be supported.
+ */
+class NES {
+private:
+    std::shared_ptr<ROM> rom;
+    RAM ram;
+    CPU cpu;
+    std::unique_ptr<Mapper> mapper;
+    std::unique_ptr<PPU> ppu;
+    APU apu;
+    Controller controller;
+    const char* error;
+
+    static void update_irq(void* nes, bool asserted);
+    static void write_cartridge(void* nes, uint16_t addr, uint8_t value);
+
+public:
+    NES(std::shared_ptr<ROM> rom, PPU::Mode ppu_mode = PPU::MODE_SCANLINE);
+
+    /** False if the console could not be put together, get_error() says why */
+    bool ok();
+    const char* get_error();
+
+    CPU& get_cpu();
+    PPU& get_ppu();
+    APU& get_apu();
+    Controller& get_controller();
+    Mapper& get_mapper();
+
+    /**
+     * Runs until the PPU enters vblank, returning STOP_FRAME_COMPLETE, or
+     * the CPU stops. A complete frame also ends the APU's, whose samples
+     * are then in get_apu().get_samples().
+     */
+    CPU::StopReason run_frame();
+    /**
+     * Ends the APU's frame, for code that runs the CPU itself and has seen
+     * it stop with STOP_FRAME_COMPLETE. run_frame() calls it.
+     */
+    void end_frame();
+    /** Runs frame after frame until the CPU stops */
+    CPU::StopReason run();
+
+    /**
+     * Replaces the contents of blob with a snapshot of the whole machine,
+     * see state.h. Snapshots are taken between runs. Reusing the same blob
+     * keeps its allocation. flags can leave parts out, like STATE_NO_FRAME.
+     */
+    void save_state(std::vector<uint8_t>& blob, uint32_t flags = 0);
+    /**
+     * Restores a snapshot made by save_state() for the same ROM. Returns
+     * false, leaving the machine untouched, if it is from another ROM or
+     * version or has the wrong size. A snapshot that passes those checks
+     * but holds impossible values also returns false, and leaves the
+     * machine in an undefined state until a good one is loaded.
+     */
+    bool load_state(const uint8_t* data, size_t size);
+    /** save_state() and load_state() through a file */
+    bool save_state_file(const char* filename);
+    bool load_state_file(const char* filename);
+};
+
+
+#endif //NESEMU_NES_H
@@ -0,0 +1,27 @@
+/**
+ * nestrace: prints a binary trace written by nesemu --trace in the
+ * nestest.log text format.
+ */
+#include <cstdio>
+
+#include "trace.h"
+
+int main(int argc, char** argv) {
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s TRACE_FILE\n", argv[0]);
+        return 2;
+    }
+
+    TraceReader reader(argv[1]);
+    if(!reader.is_open())
+        return 1;
+
+    TraceRecord rec;
+    char line[TRACE_LINE_MAX];
+    while(reader.next(rec)) {
+        int len = format_trace_record(rec, line);
+        line[len++] = '\n';
+        fwrite(line, 1, len, stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+#ifndef NESEMU_OPCODES_H
+#define NESEMU_OPCODES_H
+
+/**
+ * The 6502 opcode matrix, one row per opcode from $00 to $FF in order.
+ * Each row names the CPU handler that executes the opcode, already
+ * specialized for its addressing mode, followed by its mnemonic, its size
+ * in bytes and its base cycle count. Opcodes that are not implemented are
+ * listed as B(opcode) and halt the CPU.
+ *
+ * Expand with macros X(opcode, handler, name, size, cycles) and B(opcode)
+ * to build the dispatch table, the opcode info table and the threaded
+ * interpreter from the same source.
+ */
+#define CPU_OPCODES(X, B) \
+    X(0x00, brk,           "BRK", 1, 7) \
+    X(0x01, ora<INDX>,     "ORA", 2, 6) \
+    B(0x02)                             \
+    B(0x03)                             \
+    X(0x04, ill_nop<ZP>,   "NOP", 2, 3) \
+    X(0x05, ora<ZP>,       "ORA", 2, 3) \
+    X(0x06, asl<ZP>,       "ASL", 2, 5) \
+    B(0x07)                             \
+    X(0x08, php,           "PHP", 1, 3) \
+    X(0x09, ora<IMM>,      "ORA", 2, 2) \
+    X(0x0A, asl<ACC>,      "ASL", 1, 2) \
+    B(0x0B)                             \
+    X(0x0C, ill_nop<ABS>,  "NOP", 3, 4) \
+    X(0x0D, ora<ABS>,      "ORA", 3, 4) \
+    X(0x0E, asl<ABS>,      "ASL", 3, 6) \
+    B(0x0F)                             \
+    X(0x10, bpl,           "BPL", 2, 2) \
+    X(0x11, ora<INDY>,     "ORA", 2, 5) \
+    B(0x12)                             \
+    B(0x13)                             \
+    X(0x14, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0x15, ora<ZPX>,      "ORA", 2, 4) \
+    X(0x16, asl<ZPX>,      "ASL", 2, 6) \
+    B(0x17)                             \
+    X(0x18, clc,           "CLC", 1, 2) \
+    X(0x19, ora<ABSY>,     "ORA", 3, 4) \
+    X(0x1A, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0x1B)                             \
+    X(0x1C, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0x1D, ora<ABSX>,     "ORA", 3, 4) \
+    X(0x1E, asl<ABSX>,     "ASL", 3, 7) \
+    B(0x1F)                             \
+    X(0x20, jsr,           "JSR", 3, 6) \
+    X(0x21, and_<INDX>,    "AND", 2, 6) \
+    B(0x22)                             \
+    B(0x23)                             \
+    X(0x24, bit<ZP>,       "BIT", 2, 3) \
+    X(0x25, and_<ZP>,      "AND", 2, 3) \
+    X(0x26, rol<ZP>,       "ROL", 2, 5) \
+    B(0x27)                             \
+    X(0x28, plp,           "PLP", 1, 4) \
+    X(0x29, and_<IMM>,     "AND", 2, 2) \
+    X(0x2A, rol<ACC>,      "ROL", 1, 2) \
+    B(0x2B)                             \
+    X(0x2C, bit<ABS>,      "BIT", 3, 4) \
+    X(0x2D, and_<ABS>,     "AND", 3, 4) \
+    X(0x2E, rol<ABS>,      "ROL", 3, 6) \
+    B(0x2F)                             \
+    X(0x30, bmi,           "BMI", 2, 2) \
+    X(0x31, and_<INDY>,    "AND", 2, 5) \
+    B(0x32)                             \
+    B(0x33)                             \
+    X(0x34, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0x35, and_<ZPX>,     "AND", 2, 4) \
+    X(0x36, rol<ZPX>,      "ROL", 2, 6) \
+    B(0x37)                             \
+    X(0x38, sec,           "SEC", 1, 2) \
+    X(0x39, and_<ABSY>,    "AND", 3, 4) \
+    X(0x3A, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0x3B)                             \
+    X(0x3C, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0x3D, and_<ABSX>,    "AND", 3, 4) \
+    X(0x3E, rol<ABSX>,     "ROL", 3, 7) \
+    B(0x3F)                             \
+    X(0x40, rti,           "RTI", 1, 6) \
+    X(0x41, eor<INDX>,     "EOR", 2, 6) \
+    B(0x42)                             \
+    B(0x43)                             \
+    X(0x44, ill_nop<ZP>,   "NOP", 2, 3) \
+    X(0x45, eor<ZP>,       "EOR", 2, 3) \
+    X(0x46, lsr<ZP>,       "LSR", 2, 5) \
+    B(0x47)                             \
+    X(0x48, pha,           "PHA", 1, 3) \
+    X(0x49, eor<IMM>,      "EOR", 2, 2) \
+    X(0x4A, lsr<ACC>,      "LSR", 1, 2) \
+    B(0x4B)                             \
+    X(0x4C, jmp<ABS>,      "JMP", 3, 3) \
+    X(0x4D, eor<ABS>,      "EOR", 3, 4) \
+    X(0x4E, lsr<ABS>,      "LSR", 3, 6) \
+    B(0x4F)                             \
+    X(0x50, bvc,           "BVC", 2, 2) \
+    X(0x51, eor<INDY>,     "EOR", 2, 5) \
+    B(0x52)                             \
+    B(0x53)                             \
+    X(0x54, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0x55, eor<ZPX>,      "EOR", 2, 4) \
+    X(0x56, lsr<ZPX>,      "LSR", 2, 6) \
+    B(0x57)                             \
+    X(0x58, cli,           "CLI", 1, 2) \
+    X(0x59, eor<ABSY>,     "EOR", 3, 4) \
+    X(0x5A, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0x5B)                             \
+    X(0x5C, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0x5D, eor<ABSX>,     "EOR", 3, 4) \
+    X(0x5E, lsr<ABSX>,     "LSR", 3, 7) \
+    B(0x5F)                             \
+    X(0x60, rts,           "RTS", 1, 6) \
+    X(0x61, adc<INDX>,     "ADC", 2, 6) \
+    B(0x62)                             \
+    B(0x63)                             \
+    X(0x64, ill_nop<ZP>,   "NOP", 2, 3) \
+    X(0x65, adc<ZP>,       "ADC", 2, 3) \
+    X(0x66, ror<ZP>,       "ROR", 2, 5) \
+    B(0x67)                             \
+    X(0x68, pla,           "PLA", 1, 4) \
+    X(0x69, adc<IMM>,      "ADC", 2, 2) \
+    X(0x6A, ror<ACC>,      "ROR", 1, 2) \
+    B(0x6B)                             \
+    X(0x6C, jmp<IND>,      "JMP", 3, 5) \
+    X(0x6D, adc<ABS>,      "ADC", 3, 4) \
+    X(0x6E, ror<ABS>,      "ROR", 3, 6) \
+    B(0x6F)                             \
+    X(0x70, bvs,           "BVS", 2, 2) \
+    X(0x71, adc<INDY>,     "ADC", 2, 5) \
+    B(0x72)                             \
+    B(0x73)                             \
+    X(0x74, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0x75, adc<ZPX>,      "ADC", 2, 4) \
+    X(0x76, ror<ZPX>,      "ROR", 2, 6) \
+    B(0x77)                             \
+    X(0x78, sei,           "SEI", 1, 2) \
+    X(0x79, adc<ABSY>,     "ADC", 3, 4) \
+    X(0x7A, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0x7B)                             \
+    X(0x7C, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0x7D, adc<ABSX>,     "ADC", 3, 4) \
+    X(0x7E, ror<ABSX>,     "ROR", 3, 7) \
+    B(0x7F)                             \
+    X(0x80, ill_nop<IMM>,  "NOP", 2, 2) \
+    X(0x81, sta<INDX>,     "STA", 2, 6) \
+    X(0x82, ill_nop<IMM>,  "NOP", 2, 2) \
+    B(0x83)                             \
+    X(0x84, sty<ZP>,       "STY", 2, 3) \
+    X(0x85, sta<ZP>,       "STA", 2, 3) \
+    X(0x86, stx<ZP>,       "STX", 2, 3) \
+    B(0x87)                             \
+    X(0x88, dey,           "DEY", 1, 2) \
+    X(0x89, ill_nop<IMM>,  "NOP", 2, 2) \
+    X(0x8A, txa,           "TXA", 1, 2) \
+    B(0x8B)                             \
+    X(0x8C, sty<ABS>,      "STY", 3, 4) \
+    X(0x8D, sta<ABS>,      "STA", 3, 4) \
+    X(0x8E, stx<ABS>,      "STX", 3, 4) \
+    B(0x8F)                             \
+    X(0x90, bcc,           "BCC", 2, 2) \
+    X(0x91, sta<INDY>,     "STA", 2, 6) \
+    B(0x92)                             \
+    B(0x93)                             \
+    X(0x94, sty<ZPX>,      "STY", 2, 4) \
+    X(0x95, sta<ZPX>,      "STA", 2, 4) \
+    X(0x96, stx<ZPY>,      "STX", 2, 4) \
+    B(0x97)                             \
+    X(0x98, tya,           "TYA", 1, 2) \
+    X(0x99, sta<ABSY>,     "STA", 3, 5) \
+    X(0x9A, txs,           "TXS", 1, 2) \
+    B(0x9B)                             \
+    B(0x9C)                             \
+    X(0x9D, sta<ABSX>,     "STA", 3, 5) \
+    B(0x9E)                             \
+    B(0x9F)                             \
+    X(0xA0, ldy<IMM>,      "LDY", 2, 2) \
+    X(0xA1, lda<INDX>,     "LDA", 2, 6) \
+    X(0xA2, ldx<IMM>,      "LDX", 2, 2) \
+    B(0xA3)                             \
+    X(0xA4, ldy<ZP>,       "LDY", 2, 3) \
+    X(0xA5, lda<ZP>,       "LDA", 2, 3) \
+    X(0xA6, ldx<ZP>,       "LDX", 2, 3) \
+    B(0xA7)                             \
+    X(0xA8, tay,           "TAY", 1, 2) \
+    X(0xA9, lda<IMM>,      "LDA", 2, 2) \
+    X(0xAA, tax,           "TAX", 1, 2) \
+    B(0xAB)                             \
+    X(0xAC, ldy<ABS>,      "LDY", 3, 4) \
+    X(0xAD, lda<ABS>,      "LDA", 3, 4) \
+    X(0xAE, ldx<ABS>,      "LDX", 3, 4) \
+    B(0xAF)                             \
+    X(0xB0, bcs,           "BCS", 2, 2) \
+    X(0xB1, lda<INDY>,     "LDA", 2, 5) \
+    B(0xB2)                             \
+    B(0xB3)                             \
+    X(0xB4, ldy<ZPX>,      "LDY", 2, 4) \
+    X(0xB5, lda<ZPX>,      "LDA", 2, 4) \
+    X(0xB6, ldx<ZPY>,      "LDX", 2, 4) \
+    B(0xB7)                             \
+    X(0xB8, clv,           "CLV", 1, 2) \
+    X(0xB9, lda<ABSY>,     "LDA", 3, 4) \
+    X(0xBA, tsx,           "TSX", 1, 2) \
+    B(0xBB)                             \
+    X(0xBC, ldy<ABSX>,     "LDY", 3, 4) \
+    X(0xBD, lda<ABSX>,     "LDA", 3, 4) \
+    X(0xBE, ldx<ABSY>,     "LDX", 3, 4) \
+    B(0xBF)                             \
+    X(0xC0, cpy<IMM>,      "CPY", 2, 2) \
+    X(0xC1, cmp<INDX>,     "CMP", 2, 6) \
+    X(0xC2, ill_nop<IMM>,  "NOP", 2, 2) \
+    B(0xC3)                             \
+    X(0xC4, cpy<ZP>,       "CPY", 2, 3) \
+    X(0xC5, cmp<ZP>,       "CMP", 2, 3) \
+    X(0xC6, dec<ZP>,       "DEC", 2, 5) \
+    B(0xC7)                             \
+    X(0xC8, iny,           "INY", 1, 2) \
+    X(0xC9, cmp<IMM>,      "CMP", 2, 2) \
+    X(0xCA, dex,           "DEX", 1, 2) \
+    B(0xCB)                             \
+    X(0xCC, cpy<ABS>,      "CPY", 3, 4) \
+    X(0xCD, cmp<ABS>,      "CMP", 3, 4) \
+    X(0xCE, dec<ABS>,      "DEC", 3, 6) \
+    B(0xCF)                             \
+    X(0xD0, bne,           "BNE", 2, 2) \
+    X(0xD1, cmp<INDY>,     "CMP", 2, 5) \
+    B(0xD2)                             \
+    B(0xD3)                             \
+    X(0xD4, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0xD5, cmp<ZPX>,      "CMP", 2, 4) \
+    X(0xD6, dec<ZPX>,      "DEC", 2, 6) \
+    B(0xD7)                             \
+    X(0xD8, cld,           "CLD", 1, 2) \
+    X(0xD9, cmp<ABSY>,     "CMP", 3, 4) \
+    X(0xDA, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0xDB)                             \
+    X(0xDC, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0xDD, cmp<ABSX>,     "CMP", 3, 4) \
+    X(0xDE, dec<ABSX>,     "DEC", 3, 7) \
+    B(0xDF)                             \
+    X(0xE0, cpx<IMM>,      "CPX", 2, 2) \
+    X(0xE1, sbc<INDX>,     "SBC", 2, 6) \
+    X(0xE2, ill_nop<IMM>,  "NOP", 2, 2) \
+    B(0xE3)                             \
+    X(0xE4, cpx<ZP>,       "CPX", 2, 3) \
+    X(0xE5, sbc<ZP>,       "SBC", 2, 3) \
+    X(0xE6, inc<ZP>,       "INC", 2, 5) \
+    B(0xE7)                             \
+    X(0xE8, inx,           "INX", 1, 2) \
+    X(0xE9, sbc<IMM>,      "SBC", 2, 2) \
+    X(0xEA, nop,           "NOP", 1, 2) \
+    B(0xEB)                             \
+    X(0xEC, cpx<ABS>,      "CPX", 3, 4) \
+    X(0xED, sbc<ABS>,      "SBC", 3, 4) \
+    X(0xEE, inc<ABS>,      "INC", 3, 6) \
+    B(0xEF)                             \
+    X(0xF0, beq,           "BEQ", 2, 2) \
+    X(0xF1, sbc<INDY>,     "SBC", 2, 5) \
+    B(0xF2)                             \
+    B(0xF3)                             \
+    X(0xF4, ill_nop<ZPX>,  "NOP", 2, 4) \
+    X(0xF5, sbc<ZPX>,      "SBC", 2, 4) \
+    X(0xF6, inc<ZPX>,      "INC", 2, 6) \
+    B(0xF7)                             \
+    X(0xF8, sed,           "SED", 1, 2) \
+    X(0xF9, sbc<ABSY>,     "SBC", 3, 4) \
+    X(0xFA, ill_nop<IMP>,  "NOP", 1, 2) \
+    B(0xFB)                             \
+    X(0xFC, ill_nop<ABSX>, "NOP", 3, 4) \
+    X(0xFD, sbc<ABSX>,     "SBC", 3, 4) \
+    X(0xFE, inc<ABSX>,     "INC", 3, 7) \
+    B(0xFF)
+
+#endif //NESEMU_OPCODES_H
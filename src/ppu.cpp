@@ -0,0 +1,761 @@
+#include "ppu.h"
+
+#include <cstdio>
+#include <cstring>
+
+#define VBLANK_SCANLINE 241
+#define PRE_RENDER_SCANLINE 261
+#define MAPPER_CLOCK_DOT 260
+
+#define CTRL_INCREMENT 0x04
+#define CTRL_SPRITE_TABLE 0x08
+#define CTRL_BACKGROUND_TABLE 0x10
+#define CTRL_SPRITE_SIZE 0x20
+#define CTRL_NMI 0x80
+
+#define MASK_GRAYSCALE 0x01
+#define MASK_BACKGROUND_LEFT 0x02
+#define MASK_SPRITES_LEFT 0x04
+#define MASK_BACKGROUND 0x08
+#define MASK_SPRITES 0x10
+
+#define STATUS_OVERFLOW 0x20
+#define STATUS_SPRITE0 0x40
+#define STATUS_VBLANK 0x80
+
+#define SPRITES_PER_SCANLINE 8
+#define SPRITE_BEHIND 0x40     // Pixel flag for sprites with background priority
+#define SPRITE_ZERO 0x80       // Pixel flag for opaque pixels of sprite 0
+
+/** RGB for each of the 64 color indices */
+static const uint8_t nes_palette[64][3] = {
+    {0x62,0x62,0x62}, {0x00,0x1F,0xB2}, {0x24,0x04,0xC8}, {0x52,0x00,0xB2},
+    {0x73,0x00,0x76}, {0x80,0x00,0x24}, {0x73,0x0B,0x00}, {0x52,0x28,0x00},
+    {0x24,0x44,0x00}, {0x00,0x57,0x00}, {0x00,0x5C,0x00}, {0x00,0x53,0x24},
+    {0x00,0x3C,0x76}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xAB,0xAB,0xAB}, {0x0D,0x57,0xFF}, {0x4B,0x30,0xFF}, {0x8A,0x13,0xFF},
+    {0xBC,0x08,0xD6}, {0xD2,0x12,0x69}, {0xC7,0x2E,0x00}, {0x9D,0x54,0x00},
+    {0x60,0x7B,0x00}, {0x20,0x98,0x00}, {0x00,0xA3,0x00}, {0x00,0x99,0x42},
+    {0x00,0x7D,0xB4}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xFF,0xFF,0xFF}, {0x53,0xAE,0xFF}, {0x90,0x85,0xFF}, {0xD3,0x65,0xFF},
+    {0xFF,0x57,0xFF}, {0xFF,0x5D,0xCF}, {0xFF,0x77,0x57}, {0xFA,0x9E,0x00},
+    {0xBD,0xC7,0x00}, {0x7A,0xE7,0x00}, {0x43,0xF6,0x11}, {0x26,0xEF,0x7E},
+    {0x2C,0xD5,0xF6}, {0x4E,0x4E,0x4E}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xFF,0xFF,0xFF}, {0xB6,0xE1,0xFF}, {0xCE,0xD1,0xFF}, {0xE9,0xC3,0xFF},
+    {0xFF,0xBC,0xFF}, {0xFF,0xBD,0xF4}, {0xFF,0xC6,0xC3}, {0xFF,0xD5,0x9A},
+    {0xE9,0xE6,0x81}, {0xCE,0xF4,0x81}, {0xB6,0xFB,0x9A}, {0xA9,0xFA,0xC3},
+    {0xA9,0xF0,0xF4}, {0xB8,0xB8,0xB8}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+};
+
+PPU::PPU(Mapper& mapper, Mode mode): mapper(mapper), mode(mode) {
+    cpu = nullptr;
+    vblank_event = -1;
+    mapper_event = -1;
+    scanline_start = 0;
+    reset();
+}
+
+void PPU::attach(CPU& cpu) {
+    this->cpu = &cpu;
+    if(mode == MODE_DOT)
+        cpu.get_bus().map_io(0x2000, 0x3FFF, read_register_dot, write_register_dot, this);
+    else
+        cpu.get_bus().map_io(0x2000, 0x3FFF, read_register, write_register, this);
+    cpu.get_bus().map_io(0x4014, 0x4014, nullptr, write_oam_dma, this);
+    vblank_event = cpu.get_scheduler().add_source(on_event, this);
+    mapper_event = cpu.get_scheduler().add_source(on_event, this);
+    schedule_events();
+}
+
+/** Power up state, the frame counter and timing carry on */
+void PPU::reset() {
+    ctrl = 0;
+    mask = 0;
+    status = 0;
+    oam_addr = 0;
+    read_buffer = 0;
+    io_latch = 0;
+    v = 0;
+    t = 0;
+    fine_x = 0;
+    w = false;
+    memset(oam, 0, sizeof(oam));
+    memset(palette, 0, sizeof(palette));
+    memset(nametables, 0, sizeof(nametables));
+    memset(frame_buffer, 0, sizeof(frame_buffer));
+    scanline = 0;
+    dot = 0;
+    frame = 0;
+    odd_frame = false;
+    next_name = 0;
+    next_group = 0;
+    next_lo = 0;
+    next_hi = 0;
+    shift_lo = 0;
+    shift_hi = 0;
+    shift_group_lo = 0;
+    shift_group_hi = 0;
+    memset(sprite_line, 0, sizeof(sprite_line));
+}
+
+PPU::Mode PPU::get_mode() {
+    return mode;
+}
+
+/**
+ * Register handlers, which bring the PPU up to the CPU before the access.
+ * The CPU has already counted the whole instruction, which for absolute
+ * loads and stores is also the cycle of the access. Of the writes only
+ * $2001 moves an event, turning rendering and with it the mapper clock on
+ * or off. Each mode has its own pair so the scanline mode never tests for
+ * the dot mode.
+ */
+uint8_t PPU::read_register(void* ppu, uint16_t addr) {
+    PPU* self = (PPU*)ppu;
+    self->run_scanlines(self->cpu->get_cycles());
+    return self->read(addr);
+}
+
+void PPU::write_register(void* ppu, uint16_t addr, uint8_t value) {
+    PPU* self = (PPU*)ppu;
+    self->run_scanlines(self->cpu->get_cycles());
+    self->write(addr, value);
+    if((addr & 0x0007) == 1)
+        self->schedule_events();
+}
+
+uint8_t PPU::read_register_dot(void* ppu, uint16_t addr) {
+    PPU* self = (PPU*)ppu;
+    self->run_dots(self->cpu->get_cycles());
+    return self->read(addr);
+}
+
+void PPU::write_register_dot(void* ppu, uint16_t addr, uint8_t value) {
+    PPU* self = (PPU*)ppu;
+    self->run_dots(self->cpu->get_cycles());
+    self->write(addr, value);
+    if((addr & 0x0007) == 1)
+        self->schedule_events();
+}
+
+/**
+ * OAM DMA copies the CPU page written to $4014 into OAM while the CPU is
+ * halted. Pages of plain memory are copied in one go, others (registers)
+ * are read a byte at a time through the bus. The PPU is caught up first so
+ * it renders the sprites it had, then the CPU is charged the whole stall,
+ * by which time the copy would have finished.
+ */
+void PPU::write_oam_dma(void* ppu, uint16_t addr, uint8_t value) {
+    PPU* self = (PPU*)ppu;
+    Bus& bus = self->cpu->get_bus();
+    uint16_t start = value << 8;
+    self->sync(self->cpu->get_cycles());
+
+    const uint8_t* page = bus.read_ptr(start, 0x100);
+    uint8_t buffer[0x100];
+    if(page == nullptr) {
+        for(int i=0; i<0x100; i++)
+            buffer[i] = bus.read8(start + i);
+        page = buffer;
+    }
+    self->write_oam(page);
+    self->cpu->stall(OAM_DMA_CYCLES + (self->cpu->get_cycles() & 1));
+}
+
+void PPU::write_oam(const uint8_t* page) {
+    memcpy(&oam[oam_addr], page, sizeof(oam) - oam_addr);
+    memcpy(oam, &page[sizeof(oam) - oam_addr], oam_addr);
+}
+
+/** Register read, $2000-$2007 mirrored every 8 bytes up to $3FFF */
+uint8_t PPU::read(uint16_t addr) {
+    switch(addr & 0x0007) {
+        case 2:
+            io_latch = (status & 0xE0) | (io_latch & 0x1F);
+            status &= ~STATUS_VBLANK;
+            w = false;
+            break;
+        case 4:
+            // The attribute byte has no bits 2-4
+            io_latch = (oam_addr & 0x03) == 2 ? oam[oam_addr] & 0xE3 : oam[oam_addr];
+            break;
+        case 7:
+            // Palette reads are not buffered, the buffer gets the nametable underneath
+            if((v & 0x3FFF) >= 0x3F00) {
+                io_latch = (read_palette(v) & 0x3F) | (io_latch & 0xC0);
+                read_buffer = read_vram(v - 0x1000);
+            } else {
+                io_latch = read_buffer;
+                read_buffer = read_vram(v);
+            }
+            v = (v + (ctrl & CTRL_INCREMENT ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+    return io_latch;
+}
+
+void PPU::write(uint16_t addr, uint8_t value) {
+    io_latch = value;
+    switch(addr & 0x0007) {
+        case 0: {
+            // Enabling NMIs during vblank raises one straight away
+            bool nmi = !(ctrl & CTRL_NMI) && (value & CTRL_NMI) && (status & STATUS_VBLANK);
+            ctrl = value;
+            t = (t & 0xF3FF) | ((value & 0x03) << 10);
+            if(nmi && cpu != nullptr)
+                cpu->nmi();
+            break;
+        }
+        case 1:
+            mask = value;
+            break;
+        case 3:
+            oam_addr = value;
+            break;
+        case 4:
+            oam[oam_addr++] = value;
+            break;
+        case 5:
+            if(!w) {
+                t = (t & 0xFFE0) | (value >> 3);
+                fine_x = value & 0x07;
+            } else {
+                t = (t & 0x8C1F) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+            }
+            w = !w;
+            break;
+        case 6:
+            if(!w) {
+                t = (t & 0x00FF) | ((value & 0x3F) << 8);
+            } else {
+                t = (t & 0xFF00) | value;
+                v = t;
+            }
+            w = !w;
+            break;
+        case 7:
+            write_vram(v, value);
+            v = (v + (ctrl & CTRL_INCREMENT ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+}
+
+bool PPU::rendering_enabled() {
+    return mask & (MASK_BACKGROUND | MASK_SPRITES);
+}
+
+/** Offset into the nametable memory for $2000-$2FFF, following the cartridge's mirroring */
+uint16_t PPU::nametable_addr(uint16_t addr) {
+    uint16_t table = (addr >> 10) & 0x03;
+    switch(mapper.get_mirroring()) {
+        case ROM::MIRROR_HORIZONTAL: table >>= 1; break;
+        case ROM::MIRROR_VERTICAL: table &= 0x01; break;
+        case ROM::MIRROR_SINGLE_LOW: table = 0; break;
+        case ROM::MIRROR_SINGLE_HIGH: table = 1; break;
+        case ROM::MIRROR_FOUR_SCREEN: break;
+    }
+    return (table << 10) | (addr & 0x03FF);
+}
+
+uint8_t PPU::read_vram(uint16_t addr) {
+    addr &= 0x3FFF;
+    if(addr < 0x2000)
+        return mapper.read_chr(addr);
+    if(addr < 0x3F00)
+        return nametables[nametable_addr(addr)];
+    return read_palette(addr);
+}
+
+void PPU::write_vram(uint16_t addr, uint8_t value) {
+    addr &= 0x3FFF;
+    if(addr < 0x2000)
+        mapper.write_chr(addr, value);
+    else if(addr < 0x3F00)
+        nametables[nametable_addr(addr)] = value;
+    else
+        write_palette(addr, value);
+}
+
+/** The backdrop entries of the sprite palettes mirror the background ones */
+uint8_t PPU::read_palette(uint16_t addr) {
+    addr &= 0x1F;
+    if((addr & 0x13) == 0x10)
+        addr &= 0x0F;
+    return palette[addr];
+}
+
+void PPU::write_palette(uint16_t addr, uint8_t value) {
+    addr &= 0x1F;
+    if((addr & 0x13) == 0x10)
+        addr &= 0x0F;
+    palette[addr] = value & 0x3F;
+}
+
+/** Moves v to the next tile across, wrapping into the nametable beside */
+void PPU::increment_x() {
+    if((v & 0x001F) == 31) {
+        v &= ~0x001F;
+        v ^= 0x0400;
+    } else {
+        v++;
+    }
+}
+
+/** Moves v down a pixel row, wrapping into the nametable below after row 29 */
+void PPU::increment_y() {
+    if((v & 0x7000) != 0x7000) {
+        v += 0x1000;
+        return;
+    }
+    v &= ~0x7000;
+    uint16_t coarse_y = (v & 0x03E0) >> 5;
+    if(coarse_y == 29) {
+        coarse_y = 0;
+        v ^= 0x0800;
+    } else if(coarse_y == 31) {
+        coarse_y = 0;
+    } else {
+        coarse_y++;
+    }
+    v = (v & ~0x03E0) | (coarse_y << 5);
+}
+
+/**
+ * Background palette indices (0-15) of the scanline at v, scrolled by
+ * fine_x. 33 whole tiles go into a wider line, so the last one covers the
+ * fine scroll, which is then cut out of it.
+ */
+void PPU::render_background(uint8_t* pixels) {
+    alignas(8) uint8_t tiles[33 * 8];
+    uint16_t addr = v;
+    uint16_t table = ctrl & CTRL_BACKGROUND_TABLE ? 0x1000 : 0x0000;
+    uint16_t fine_y = (addr >> 12) & 0x07;
+    for(int tile=0; tile<33; tile++) {
+        uint8_t name = nametables[nametable_addr(0x2000 | (addr & 0x0FFF))];
+        uint8_t attribute = nametables[nametable_addr(0x23C0 | (addr & 0x0C00)
+                                                      | ((addr >> 4) & 0x38) | ((addr >> 2) & 0x07))];
+        uint8_t group = (attribute >> (((addr >> 4) & 0x04) | (addr & 0x02))) & 0x03;
+
+        // All 8 pixels at once: opaque ones get the attribute group in bits 2-3
+        uint64_t row;
+        memcpy(&row, mapper.get_tile_row(table + name * 16 + fine_y), 8);
+        uint64_t opaque = (row | (row >> 1)) & 0x0101010101010101ULL;
+        row |= opaque * (group << 2);
+        memcpy(&tiles[tile * 8], &row, 8);
+
+        // Coarse x wraps into the next nametable across
+        if((addr & 0x001F) == 31) {
+            addr &= ~0x001F;
+            addr ^= 0x0400;
+        } else {
+            addr++;
+        }
+    }
+    memcpy(pixels, &tiles[fine_x], SCREEN_WIDTH);
+}
+
+/**
+ * Sprite palette indices (16-31, with SPRITE_BEHIND for background
+ * priority and SPRITE_ZERO for sprite 0) of the first eight sprites on a
+ * scanline. Earlier sprites are in front of later ones, whatever their
+ * priority. Also sets the overflow flag.
+ */
+void PPU::render_sprites(int line, uint8_t* pixels) {
+    int height = ctrl & CTRL_SPRITE_SIZE ? 16 : 8;
+    int found = 0;
+    for(int i=0; i<64; i++) {
+        const uint8_t* sprite = &oam[i * 4];
+        int row = line - 1 - sprite[0];
+        if(row < 0 || row >= height)
+            continue;
+        if(found++ == SPRITES_PER_SCANLINE) {
+            status |= STATUS_OVERFLOW;
+            break;
+        }
+
+        uint8_t tile = sprite[1];
+        uint8_t attributes = sprite[2];
+        if(attributes & 0x80)
+            row = height - 1 - row;
+        uint16_t addr;
+        if(height == 16) {
+            addr = (tile & 0x01 ? 0x1000 : 0x0000) + (tile & 0xFE) * 16;
+            if(row >= 8) {
+                addr += 16;
+                row -= 8;
+            }
+        } else {
+            addr = (ctrl & CTRL_SPRITE_TABLE ? 0x1000 : 0x0000) + tile * 16;
+        }
+        const uint8_t* colors = mapper.get_tile_row(addr + row);
+
+        for(int bit=0; bit<8; bit++) {
+            int px = sprite[3] + bit;
+            if(px >= SCREEN_WIDTH)
+                break;
+            uint8_t color = colors[attributes & 0x40 ? 7 - bit : bit];
+            if(color == 0 || pixels[px] != 0)
+                continue;
+            pixels[px] = 0x10 | ((attributes & 0x03) << 2) | color
+                         | (attributes & 0x20 ? SPRITE_BEHIND : 0) | (i == 0 ? SPRITE_ZERO : 0);
+        }
+    }
+}
+
+/**
+ * Color of a pixel from its background and sprite palette indices, after
+ * masking. Sets the sprite 0 hit flag where both are opaque.
+ */
+uint8_t PPU::compose_pixel(int x, uint8_t background, uint8_t sprite) {
+    if(!(mask & MASK_BACKGROUND) || (x < 8 && !(mask & MASK_BACKGROUND_LEFT)))
+        background = 0;
+    if(!(mask & MASK_SPRITES) || (x < 8 && !(mask & MASK_SPRITES_LEFT)))
+        sprite = 0;
+
+    uint8_t index = background & 0x03 ? background : 0;
+    if((sprite & SPRITE_ZERO) && index != 0 && x != 255)
+        status |= STATUS_SPRITE0;
+    if(sprite != 0 && (!(sprite & SPRITE_BEHIND) || index == 0))
+        index = sprite & 0x1F;
+    return read_palette(index) & (mask & MASK_GRAYSCALE ? 0x30 : 0x3F);
+}
+
+void PPU::render_scanline() {
+    uint8_t* line = &frame_buffer[scanline * SCREEN_WIDTH];
+    if(!rendering_enabled()) {
+        memset(line, read_palette(0) & (mask & MASK_GRAYSCALE ? 0x30 : 0x3F), SCREEN_WIDTH);
+        return;
+    }
+
+    uint8_t background[SCREEN_WIDTH] = {};
+    uint8_t sprites[SCREEN_WIDTH] = {};
+    if(mask & MASK_BACKGROUND)
+        render_background(background);
+    if(mask & MASK_SPRITES)
+        render_sprites(scanline, sprites);
+    for(int x=0; x<SCREEN_WIDTH; x++)
+        line[x] = compose_pixel(x, background[x], sprites[x]);
+}
+
+/**
+ * One step of the MODE_DOT fetch pipeline, for tiles in dots 1-256 and the
+ * first two tiles of the next line in 321-336. Every tile takes 8 dots:
+ * nametable, attribute, low and high pattern bytes, then coarse x moves on.
+ * The finished tile is loaded into the low byte of the shift registers at
+ * the start of the next one. The pattern bytes are read raw on their own
+ * dots rather than from the tile cache, as the hardware does.
+ */
+void PPU::fetch_background() {
+    switch((dot - 1) & 0x07) {
+        case 0:
+            shift_lo = (shift_lo & 0xFF00) | next_lo;
+            shift_hi = (shift_hi & 0xFF00) | next_hi;
+            shift_group_lo = (shift_group_lo & 0xFF00) | (next_group & 0x01 ? 0xFF : 0x00);
+            shift_group_hi = (shift_group_hi & 0xFF00) | (next_group & 0x02 ? 0xFF : 0x00);
+            next_name = nametables[nametable_addr(0x2000 | (v & 0x0FFF))];
+            break;
+        case 2: {
+            uint8_t attribute = nametables[nametable_addr(0x23C0 | (v & 0x0C00)
+                                                          | ((v >> 4) & 0x38) | ((v >> 2) & 0x07))];
+            next_group = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+            break;
+        }
+        case 4:
+            next_lo = mapper.read_chr((ctrl & CTRL_BACKGROUND_TABLE ? 0x1000 : 0x0000)
+                                      + next_name * 16 + ((v >> 12) & 0x07));
+            break;
+        case 6:
+            next_hi = mapper.read_chr((ctrl & CTRL_BACKGROUND_TABLE ? 0x1000 : 0x0000)
+                                      + next_name * 16 + ((v >> 12) & 0x07) + 8);
+            break;
+        case 7:
+            increment_x();
+            break;
+    }
+}
+
+/**
+ * Runs MODE_DOT for one dot. Scroll updates happen on the dots the
+ * hardware does them: y at 256, horizontal bits from t at 257 and vertical
+ * ones during 280-304 of the pre render line. Sprites for the next line are
+ * evaluated at 257, and the mapper is clocked at 260, where the sprite
+ * fetches first touch the upper pattern table.
+ */
+void PPU::step_dot() {
+    bool fetching = rendering_enabled() && (scanline < SCREEN_HEIGHT || scanline == PRE_RENDER_SCANLINE);
+    if(fetching) {
+        if((dot >= 2 && dot <= 257) || (dot >= 322 && dot <= 337)) {
+            shift_lo <<= 1;
+            shift_hi <<= 1;
+            shift_group_lo <<= 1;
+            shift_group_hi <<= 1;
+        }
+        if((dot >= 2 && dot <= 257) || (dot >= 321 && dot <= 337))
+            fetch_background();
+        if(dot == 256)
+            increment_y();
+        if(dot == 257)
+            v = (v & ~0x041F) | (t & 0x041F);
+        if(scanline == PRE_RENDER_SCANLINE && dot >= 280 && dot <= 304)
+            v = (v & 0x041F) | (t & ~0x041F);
+        if(dot == MAPPER_CLOCK_DOT)
+            mapper.scanline();
+    }
+    if(dot == 257 && (scanline < SCREEN_HEIGHT || scanline == PRE_RENDER_SCANLINE)) {
+        memset(sprite_line, 0, sizeof(sprite_line));
+        if(fetching)
+            render_sprites(scanline == PRE_RENDER_SCANLINE ? 0 : scanline + 1, sprite_line);
+    }
+
+    if(scanline < SCREEN_HEIGHT && dot >= 1 && dot <= SCREEN_WIDTH) {
+        int x = dot - 1;
+        uint8_t* pixel = &frame_buffer[scanline * SCREEN_WIDTH + x];
+        if(fetching) {
+            uint16_t bit = 0x8000 >> fine_x;
+            uint8_t color = (shift_lo & bit ? 0x01 : 0x00) | (shift_hi & bit ? 0x02 : 0x00);
+            uint8_t group = (shift_group_lo & bit ? 0x01 : 0x00) | (shift_group_hi & bit ? 0x02 : 0x00);
+            *pixel = compose_pixel(x, color ? (group << 2) | color : 0, sprite_line[x]);
+        } else {
+            *pixel = read_palette(0) & (mask & MASK_GRAYSCALE ? 0x30 : 0x3F);
+        }
+    }
+
+    if(dot == 1 && scanline == VBLANK_SCANLINE)
+        start_vblank();
+    else if(dot == 1 && scanline == PRE_RENDER_SCANLINE)
+        end_vblank();
+    dot++;
+}
+
+/** Runs MODE_SCANLINE over the scanlines that end by a CPU cycle */
+void PPU::run_scanlines(uint64_t cycle) {
+    while(scanline_end_cycle() <= cycle)
+        run_scanline();
+}
+
+/** Runs MODE_DOT up to the first dot of a CPU cycle */
+void PPU::run_dots(uint64_t cycle) {
+    uint64_t target = cycle * DOTS_PER_CPU_CYCLE;
+    while(scanline_start + dot < target) {
+        step_dot();
+        if(dot >= scanline_length())
+            run_scanline();
+    }
+}
+
+void PPU::sync(uint64_t cycle) {
+    if(mode == MODE_DOT)
+        run_dots(cycle);
+    else
+        run_scanlines(cycle);
+}
+
+/**
+ * Dots to go from the start of the current scanline to dot of line. The
+ * pre render line is counted one dot short whenever it is crossed, so the
+ * result may be early but is never late.
+ */
+uint64_t PPU::dots_until(int line, uint32_t dot) {
+    int lines = (line - scanline + SCANLINES_PER_FRAME) % SCANLINES_PER_FRAME;
+    if(lines == 0 && dot <= this->dot)
+        lines = SCANLINES_PER_FRAME;
+    uint64_t dots = (uint64_t)lines * DOTS_PER_SCANLINE + dot;
+    if(scanline + lines > PRE_RENDER_SCANLINE)
+        dots--;
+    return dots;
+}
+
+/**
+ * CPU cycle by which the mapper has been clocked clocks more times,
+ * assuming rendering stays on. Later pre render lines are counted one dot
+ * short, so like dots_until() this may be early but is never late.
+ */
+uint64_t PPU::mapper_clock_cycle(int clocks) {
+    int line = scanline;
+    uint64_t start = scanline_start;
+    uint32_t length = scanline_length();
+    bool pending = mode == MODE_SCANLINE || dot <= MAPPER_CLOCK_DOT;
+    for(;;) {
+        if(pending && (line < SCREEN_HEIGHT || line == PRE_RENDER_SCANLINE) && --clocks == 0)
+            break;
+        start += length;
+        line = (line + 1) % SCANLINES_PER_FRAME;
+        length = line == PRE_RENDER_SCANLINE ? DOTS_PER_SCANLINE - 1 : DOTS_PER_SCANLINE;
+        pending = true;
+    }
+    uint64_t event = start + (mode == MODE_DOT ? MAPPER_CLOCK_DOT + 1 : length);
+    return (event + DOTS_PER_CPU_CYCLE - 1) / DOTS_PER_CPU_CYCLE;
+}
+
+/**
+ * The events are the cycles at which the PPU has to be run for something
+ * the CPU sees without touching a register: vblank, with its NMI and the
+ * end of the frame, and the mapper clock that raises its IRQ. Until then
+ * the CPU can run without stopping.
+ */
+void PPU::schedule_events() {
+    if(cpu == nullptr)
+        return;
+    Scheduler& scheduler = cpu->get_scheduler();
+    uint64_t vblank = scanline_start + dots_until(VBLANK_SCANLINE, mode == MODE_DOT ? 2 : 0);
+    scheduler.schedule(vblank_event, (vblank + DOTS_PER_CPU_CYCLE - 1) / DOTS_PER_CPU_CYCLE);
+    int clocks = mapper.scanlines_until_irq();
+    if(clocks > 0 && rendering_enabled())
+        scheduler.schedule(mapper_event, mapper_clock_cycle(clocks));
+    else
+        scheduler.cancel(mapper_event);
+}
+
+/** Both events just catch up, the PPU and mapper raise the interrupts themselves */
+void PPU::on_event(void* ppu, uint64_t now) {
+    PPU* self = (PPU*)ppu;
+    self->sync(now);
+    self->schedule_events();
+}
+
+void PPU::start_vblank() {
+    status |= STATUS_VBLANK;
+    if((ctrl & CTRL_NMI) && cpu != nullptr)
+        cpu->nmi();
+}
+
+void PPU::end_vblank() {
+    status &= ~(STATUS_VBLANK | STATUS_SPRITE0 | STATUS_OVERFLOW);
+}
+
+/** Dots in the current scanline, one less on the pre render line of odd frames while rendering */
+uint32_t PPU::scanline_length() {
+    if(scanline == PRE_RENDER_SCANLINE && odd_frame && rendering_enabled())
+        return DOTS_PER_SCANLINE - 1;
+    return DOTS_PER_SCANLINE;
+}
+
+uint64_t PPU::scanline_end_cycle() {
+    uint64_t end = scanline_start + scanline_length();
+    return (end + DOTS_PER_CPU_CYCLE - 1) / DOTS_PER_CPU_CYCLE;
+}
+
+/**
+ * In MODE_SCANLINE, visible lines are drawn in one go from the state at
+ * their end, after which v moves down a row and gets the horizontal scroll
+ * back from t. The pre render line reloads all of v. The mapper sees every
+ * line that fetches tiles. MODE_DOT just runs out the line's dots.
+ */
+bool PPU::run_scanline() {
+    uint32_t length = scanline_length();
+    bool rendering = rendering_enabled();
+    if(mode == MODE_DOT) {
+        while(dot < scanline_length())
+            step_dot();
+        length = dot;
+        dot = 0;
+    } else if(scanline < SCREEN_HEIGHT) {
+        render_scanline();
+        if(rendering) {
+            increment_y();
+            v = (v & ~0x041F) | (t & 0x041F);
+        }
+    } else if(scanline == PRE_RENDER_SCANLINE && rendering) {
+        v = t;
+    }
+    if(mode == MODE_SCANLINE && rendering && (scanline < SCREEN_HEIGHT || scanline == PRE_RENDER_SCANLINE))
+        mapper.scanline();
+
+    scanline_start += length;
+    if(scanline == PRE_RENDER_SCANLINE) {
+        scanline = 0;
+        odd_frame = !odd_frame;
+    } else {
+        scanline++;
+    }
+
+    // MODE_DOT changes the flags on dot 1 instead
+    if(scanline == VBLANK_SCANLINE) {
+        frame++;
+        if(cpu != nullptr)
+            cpu->end_frame();
+        if(mode == MODE_SCANLINE)
+            start_vblank();
+        return true;
+    }
+    if(scanline == PRE_RENDER_SCANLINE && mode == MODE_SCANLINE)
+        end_vblank();
+    return false;
+}
+
+int PPU::get_scanline() {
+    return scanline;
+}
+
+uint64_t PPU::get_frame_count() {
+    return frame;
+}
+
+const uint8_t* PPU::get_frame() {
+    return frame_buffer;
+}
+
+bool PPU::save_frame(const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if(file == nullptr) {
+        perror(filename);
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+    for(int i=0; i<SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+        fwrite(nes_palette[frame_buffer[i] & 0x3F], 1, 3, file);
+    bool written = !ferror(file);
+    if(fclose(file) != 0)
+        written = false;
+    return written;
+}
+
+template<typename State> void PPU::serialize(State& state) {
+    state.value(ctrl);
+    state.value(mask);
+    state.value(status);
+    state.value(oam_addr);
+    state.value(read_buffer);
+    state.value(io_latch);
+    state.value(v);
+    state.value(t);
+    state.value(fine_x);
+    state.value(w);
+    state.bytes(oam, sizeof(oam));
+    state.bytes(palette, sizeof(palette));
+    state.bytes(nametables, sizeof(nametables));
+    state.value(scanline);
+    state.value(dot);
+    state.value(scanline_start);
+    state.value(frame);
+    state.value(odd_frame);
+    state.value(next_name);
+    state.value(next_group);
+    state.value(next_lo);
+    state.value(next_hi);
+    state.value(shift_lo);
+    state.value(shift_hi);
+    state.value(shift_group_lo);
+    state.value(shift_group_hi);
+    state.bytes(sprite_line, sizeof(sprite_line));
+    if(!(state.get_flags() & STATE_NO_FRAME))
+        state.bytes(frame_buffer, sizeof(frame_buffer));
+}
+
+void PPU::save_state(StateWriter& state) {
+    serialize(state);
+}
+
+/**
+ * The CPU is loaded first. The PPU catches up with it a scanline at a time,
+ * so a scanline start ahead of the CPU or more than a frame behind it
+ * cannot come from a save and fails the load.
+ */
+void PPU::load_state(StateReader& state) {
+    serialize(state);
+    if(scanline < 0 || scanline >= SCANLINES_PER_FRAME || dot >= DOTS_PER_SCANLINE || fine_x > 7)
+        state.fail();
+    uint64_t now = cpu != nullptr ? cpu->get_cycles() * DOTS_PER_CPU_CYCLE : scanline_start;
+    if(scanline_start > now || now - scanline_start > (uint64_t)SCANLINES_PER_FRAME * DOTS_PER_SCANLINE)
+        state.fail();
+}
@@ -0,0 +1,160 @@
+#ifndef NESEMU_PPU_H
+#define NESEMU_PPU_H
+
+#include <cstdint>
+
+#include "cpu.h"
+#include "mapper.h"
+
+#define SCREEN_WIDTH 256
+#define SCREEN_HEIGHT 240
+#define DOTS_PER_SCANLINE 341
+#define SCANLINES_PER_FRAME 262
+#define DOTS_PER_CPU_CYCLE 3
+#define OAM_DMA_CYCLES 513     // One more when started on an odd CPU cycle
+
+/**
+ * The picture processing unit. Timing is kept in PPU dots, three per CPU
+ * cycle, from the same power on as the CPU cycle counter. The PPU runs
+ * behind the CPU and catches up lazily, when a register is accessed, sync()
+ * is called or one of its events comes up in the CPU's scheduler: vblank,
+ * and the mapper clock that raises the cartridge's IRQ. Two modes
+ * share the registers and memory:
+ *
+ * MODE_SCANLINE renders a whole scanline at a time, once the CPU has run to
+ * the end of it, so register writes take effect at scanline granularity.
+ * MODE_DOT steps the hardware's fetch pipeline a dot at a time, and catches
+ * up to the CPU on every register access so mid scanline writes and sprite
+ * 0 hits land on the right pixel. The mode picks the register handlers at
+ * attach time, the scanline mode never checks for it per access.
+ *
+ * The frame buffer holds NES color indices (0-63), not RGB.
+ */
+class PPU {
+public:
+    enum Mode {
+        MODE_SCANLINE,  // Fast, a scanline per step
+        MODE_DOT,       // Cycle accurate, a dot per step
+    };
+
+private:
+    Mapper& mapper;
+    CPU* cpu;
+    Mode mode;
+    int vblank_event;
+    int mapper_event;
+
+    // $2000-$2007
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t status;
+    uint8_t oam_addr;
+    uint8_t read_buffer;    // $2007 reads lag one access behind
+    uint8_t io_latch;       // Last value on the PPU data bus, read back from write only registers
+
+    // Scroll and address registers, as in loopy's description
+    uint16_t v;     // Current VRAM address
+    uint16_t t;     // Temporary VRAM address, the top left of the screen
+    uint8_t fine_x;
+    bool w;         // Second write of $2005/$2006
+
+    uint8_t oam[256];
+    uint8_t palette[32];
+    uint8_t nametables[0x1000];     // Four screens' worth, most boards only use two
+
+    int scanline;           // 0-239 visible, 240 post render, 241-260 vblank, 261 pre render
+    uint32_t dot;           // Dots of the current scanline done, always 0 in MODE_SCANLINE
+    uint64_t scanline_start;    // Dot the current scanline started at, with dot where the PPU has run to
+    uint64_t frame;
+    bool odd_frame;
+
+    // MODE_DOT background pipeline: the tile being fetched and the 16 pixel shift registers
+    uint8_t next_name;
+    uint8_t next_group;
+    uint8_t next_lo;
+    uint8_t next_hi;
+    uint16_t shift_lo;
+    uint16_t shift_hi;
+    uint16_t shift_group_lo;
+    uint16_t shift_group_hi;
+    /** MODE_DOT sprite pixels of the scanline, evaluated during the one before */
+    uint8_t sprite_line[SCREEN_WIDTH];
+
+    uint8_t frame_buffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+    bool rendering_enabled();
+    uint16_t nametable_addr(uint16_t addr);
+    uint8_t read_vram(uint16_t addr);
+    void write_vram(uint16_t addr, uint8_t value);
+    uint8_t read_palette(uint16_t addr);
+    void write_palette(uint16_t addr, uint8_t value);
+    void increment_x();
+    void increment_y();
+    void start_vblank();
+    void end_vblank();
+
+    uint8_t compose_pixel(int x, uint8_t background, uint8_t sprite);
+    void render_scanline();
+    void render_background(uint8_t* pixels);
+    void render_sprites(int line, uint8_t* pixels);
+    uint32_t scanline_length();
+
+    void step_dot();
+    void fetch_background();
+    void run_scanlines(uint64_t cycle);
+    void run_dots(uint64_t cycle);
+    uint64_t dots_until(int line, uint32_t dot);
+    uint64_t mapper_clock_cycle(int clocks);
+
+    static void on_event(void* ppu, uint64_t now);
+    template<typename State> void serialize(State& state);
+
+    static uint8_t read_register(void* ppu, uint16_t addr);
+    static void write_register(void* ppu, uint16_t addr, uint8_t value);
+    static uint8_t read_register_dot(void* ppu, uint16_t addr);
+    static void write_register_dot(void* ppu, uint16_t addr, uint8_t value);
+    static void write_oam_dma(void* ppu, uint16_t addr, uint8_t value);
+
+public:
+    PPU(Mapper& mapper, Mode mode = MODE_SCANLINE);
+
+    /**
+     * Maps the registers at $2000-$3FFF and the OAM DMA register at $4014
+     * into the CPU's bus, sends NMIs and frame ends to it and schedules
+     * events.
+     */
+    void attach(CPU& cpu);
+    void reset();
+    Mode get_mode();
+
+    uint8_t read(uint16_t addr);
+    void write(uint16_t addr, uint8_t value);
+    /** Writes a 256 byte page to OAM as if through $2004, starting at OAMADDR */
+    void write_oam(const uint8_t* page);
+
+    /** CPU cycle the current scanline ends at */
+    uint64_t scanline_end_cycle();
+    /** Finishes the current scanline and starts the next, true when that starts vblank */
+    bool run_scanline();
+    /** Catches up with the CPU: runs everything up to a CPU cycle */
+    void sync(uint64_t cycle);
+    /** Puts the next vblank and mapper IRQ into the CPU's scheduler, after anything that can move them */
+    void schedule_events();
+
+    int get_scanline();
+    uint64_t get_frame_count();
+    /** The last rendered frame, SCREEN_WIDTH * SCREEN_HEIGHT color indices */
+    const uint8_t* get_frame();
+    /** Writes the last rendered frame as a binary PPM image */
+    bool save_frame(const char* filename);
+
+    /**
+     * Registers, memory, timing and, unless STATE_NO_FRAME, the last frame.
+     * The mode is a setting and is kept on load.
+     */
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
+};
+
+
+#endif //NESEMU_PPU_H
@@ -1,9 +1,7 @@
 #include "ram.h"
 
-#define RAM_SIZE 2048
-
 RAM::RAM() {
-    memory = new uint8_t[RAM_SIZE];
+    memory = new uint8_t[RAM_SIZE]();
 }
 
 RAM::~RAM() {
@@ -12,4 +10,16 @@ RAM::~RAM() {
 
 uint8_t* RAM::get_ram(uint16_t addr) {
     return &memory[addr];
-}
\ No newline at end of file
+}
+
+template<typename State> void RAM::serialize(State& state) {
+    state.bytes(memory, RAM_SIZE);
+}
+
+void RAM::save_state(StateWriter& state) {
+    serialize(state);
+}
+
+void RAM::load_state(StateReader& state) {
+    serialize(state);
+}
@@ -3,15 +3,23 @@
 
 #include <cstdint>
 
+#include "state.h"
+
+#define RAM_SIZE 2048
+
 class RAM {
 private:
     uint8_t* memory;
 
+    template<typename State> void serialize(State& state);
+
 public:
     RAM();
     ~RAM();
 
     uint8_t* get_ram(uint16_t addr);
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
 //    void store(uint16_t addr, uint8_t* buf, size_t size);
 };
 
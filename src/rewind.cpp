@@ -0,0 +1,103 @@
+#include "rewind.h"
+
+#include <cstring>
+
+#include "rle.h"
+
+Rewind::Rewind(NES& nes, int interval, size_t capacity): nes(nes), interval(interval), ring(capacity) {
+    frames = 0;
+}
+
+void Rewind::end_frame() {
+    if(++frames < interval)
+        return;
+    frames = 0;
+    capture();
+}
+
+/** States of one ROM always have the same size, anything else starts the history over */
+void Rewind::capture() {
+    nes.save_state(snapshot, STATE_NO_FRAME);
+    if(newest.size() != snapshot.size()) {
+        entries.clear();
+        newest.swap(snapshot);
+        return;
+    }
+
+    size_t size = snapshot.size();
+    delta.resize(size);
+    for(size_t i=0; i<size; i++)
+        delta[i] = snapshot[i] ^ newest[i];
+    // Deltas of RAM and PPU memory can be any bytes, the bound holds for all of them
+    encoded.resize(RLE_MAX_ENCODED(size));
+    store(encoded.data(), rle_encode(delta.data(), size, encoded.data()));
+    newest.swap(snapshot);
+}
+
+/**
+ * Puts a delta after the newest one, or at the start of the ring when the
+ * space left at the end is too small. The oldest deltas in the way are
+ * dropped. A delta larger than the whole ring drops the history.
+ */
+void Rewind::store(const uint8_t* data, size_t size) {
+    if(size > ring.size()) {
+        entries.clear();
+        return;
+    }
+    size_t offset = 0;
+    if(!entries.empty()) {
+        offset = entries.back().offset + entries.back().size;
+        if(offset + size > ring.size()) {
+            while(!entries.empty() && entries.front().offset >= offset)
+                entries.pop_front();
+            offset = 0;
+        }
+    }
+    while(!entries.empty() && entries.front().offset >= offset && entries.front().offset < offset + size)
+        entries.pop_front();
+    memcpy(&ring[offset], data, size);
+    entries.push_back({offset, size});
+}
+
+/** Undoing the newest delta turns the newest snapshot into the one before it */
+bool Rewind::step_back() {
+    if(newest.empty())
+        return false;
+    if(!nes.load_state(newest.data(), newest.size())) {
+        clear();
+        return false;
+    }
+    frames = 0;
+    if(entries.empty()) {
+        newest.clear();
+        return true;
+    }
+
+    Entry entry = entries.back();
+    entries.pop_back();
+    delta.resize(newest.size());
+    if(rle_decode(&ring[entry.offset], entry.size, delta.data(), delta.size()) != delta.size()) {
+        clear();
+        return true;
+    }
+    for(size_t i=0; i<newest.size(); i++)
+        newest[i] ^= delta[i];
+    return true;
+}
+
+void Rewind::clear() {
+    entries.clear();
+    newest.clear();
+    frames = 0;
+}
+
+size_t Rewind::get_count() {
+    return newest.empty() ? 0 : entries.size() + 1;
+}
+
+size_t Rewind::get_size() {
+    size_t size = 0;
+    for(const Entry& entry : entries)
+        size += entry.size;
+    return size;
+}
@@ -0,0 +1,65 @@
+#ifndef NESEMU_REWIND_H
+#define NESEMU_REWIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "nes.h"
+
+/**
+ * History of machine states to step back through. A snapshot is taken
+ * every interval frames, without the frame buffer, which the next frame
+ * draws again. The newest snapshot is kept whole and every older one as
+ * the RLE encoded XOR with the snapshot after it, so stepping back undoes
+ * one delta at a time and the oldest deltas can be dropped at any point.
+ * Between frames only a little RAM and a few registers change, so the
+ * deltas are mostly runs of zeros.
+ *
+ * The deltas share a fixed ring of capacity bytes. A new delta that does
+ * not fit overwrites the oldest ones, so the history is as long as the
+ * ring allows.
+ */
+class Rewind {
+private:
+    typedef struct entry {
+        size_t offset;      // Into ring
+        size_t size;
+    } Entry;
+
+    NES& nes;
+    int interval;
+    int frames;                     // Since the last snapshot
+    std::vector<uint8_t> newest;    // Empty until the first snapshot
+    std::vector<uint8_t> snapshot;  // Scratch for the next snapshot
+    std::vector<uint8_t> delta;
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> ring;
+    std::deque<Entry> entries;      // Oldest first
+
+    void store(const uint8_t* data, size_t size);
+
+public:
+    /** Snapshots nes every interval frames, keeping up to capacity bytes of deltas */
+    Rewind(NES& nes, int interval, size_t capacity);
+
+    /** Called after every frame, takes a snapshot once interval frames have passed */
+    void end_frame();
+    /** Takes a snapshot now */
+    void capture();
+    /**
+     * Loads the newest snapshot and drops it from the history, so the
+     * next call goes one snapshot further back. False once it is empty.
+     */
+    bool step_back();
+    void clear();
+
+    /** Snapshots held, the newest one included */
+    size_t get_count();
+    /** Bytes used by the deltas */
+    size_t get_size();
+};
+
+
+#endif //NESEMU_REWIND_H
@@ -0,0 +1,76 @@
+#ifndef NESEMU_RING_H
+#define NESEMU_RING_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Lock free ring buffer for exactly one producer thread and one consumer
+ * thread. The producer only writes head and the consumer only writes tail,
+ * each on its own cache line, so neither side ever waits on the other.
+ * Capacity must be a power of two.
+ */
+template<typename T>
+class SpscRing {
+private:
+    T* items;
+    size_t capacity;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> head;  // Next slot the producer fills
+    size_t cached_tail;                     // Producer's last look at tail
+    alignas(64) std::atomic<size_t> tail;  // Next slot the consumer reads
+
+public:
+    SpscRing(size_t capacity): capacity(capacity), mask(capacity - 1) {
+        items = new T[capacity];
+        head = 0;
+        tail = 0;
+        cached_tail = 0;
+    }
+
+    ~SpscRing() {
+        delete[] items;
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /** Producer side. Returns false without storing the item if the ring is full */
+    bool push(const T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h - cached_tail == capacity) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if(h - cached_tail == capacity)
+                return false;
+        }
+        items[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer side. Points first at the oldest item and returns how many
+     * items follow it contiguously, which is zero if the ring is empty.
+     */
+    size_t peek(const T** first) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t available = head.load(std::memory_order_acquire) - t;
+        size_t contiguous = capacity - (t & mask);
+        *first = &items[t & mask];
+        return available < contiguous ? available : contiguous;
+    }
+
+    /** True once the consumer has taken everything the producer pushed */
+    bool empty() {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+    /** Consumer side. Frees the first count items returned by peek() */
+    void consume(size_t count) {
+        tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+};
+
+
+#endif //NESEMU_RING_H
@@ -0,0 +1,72 @@
+#include "rle.h"
+
+#include <cstring>
+
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_RUN 2
+#define RLE_MAX_RUN 129
+
+size_t rle_encode(const uint8_t* in, size_t len, uint8_t* out) {
+    size_t i = 0;
+    size_t o = 0;
+    size_t literal_start = 0;
+
+    while(i < len) {
+        size_t run = 1;
+        while(i + run < len && run < RLE_MAX_RUN && in[i + run] == in[i])
+            run++;
+
+        if(run > RLE_MIN_RUN || (run == RLE_MIN_RUN && literal_start == i)) {
+            while(literal_start < i) {
+                size_t count = i - literal_start;
+                if(count > RLE_MAX_LITERAL)
+                    count = RLE_MAX_LITERAL;
+                out[o++] = count - 1;
+                memcpy(&out[o], &in[literal_start], count);
+                o += count;
+                literal_start += count;
+            }
+            out[o++] = 0x80 + run - RLE_MIN_RUN;
+            out[o++] = in[i];
+            i += run;
+            literal_start = i;
+        } else {
+            i++;
+        }
+    }
+
+    while(literal_start < len) {
+        size_t count = len - literal_start;
+        if(count > RLE_MAX_LITERAL)
+            count = RLE_MAX_LITERAL;
+        out[o++] = count - 1;
+        memcpy(&out[o], &in[literal_start], count);
+        o += count;
+        literal_start += count;
+    }
+    return o;
+}
+
+size_t rle_decode(const uint8_t* in, size_t len, uint8_t* out, size_t out_len) {
+    size_t i = 0;
+    size_t o = 0;
+
+    while(i < len) {
+        uint8_t control = in[i++];
+        if(control < 0x80) {
+            size_t count = control + 1;
+            if(i + count > len || o + count > out_len)
+                return 0;
+            memcpy(&out[o], &in[i], count);
+            i += count;
+            o += count;
+        } else {
+            size_t count = control - 0x80 + RLE_MIN_RUN;
+            if(i >= len || o + count > out_len)
+                return 0;
+            memset(&out[o], in[i++], count);
+            o += count;
+        }
+    }
+    return o;
+}
@@ -0,0 +1,35 @@
+#ifndef NESEMU_RLE_H
+#define NESEMU_RLE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Byte oriented run length coding. Cheap enough to run on every trace block,
+ * and effective on data that is mostly runs of the same byte, such as the
+ * XOR of two similar records or memory snapshots.
+ *
+ * The encoded data is a sequence of packets that start with a control byte c:
+ * c < 0x80 is followed by c + 1 literal bytes, c >= 0x80 by one byte that
+ * repeats c - 0x80 + 2 times.
+ *
+ * A run of two only becomes a packet where no literal is open, as cutting a
+ * literal for it would cost a control byte. Every literal short of 128 bytes
+ * is then either the last packet or followed by a run of at least three,
+ * which makes up for its control byte, so only full literals and the last
+ * one add to the size.
+ */
+
+/** Largest possible encoded size of len bytes */
+#define RLE_MAX_ENCODED(len) ((len) + (len) / 128 + 1)
+
+/** Encodes len bytes into out, which must hold RLE_MAX_ENCODED(len). Returns the encoded size */
+size_t rle_encode(const uint8_t* in, size_t len, uint8_t* out);
+/**
+ * Decodes len encoded bytes into out, writing at most out_len bytes. Returns
+ * the decoded size, or 0 if the input is corrupt or does not fit.
+ */
+size_t rle_decode(const uint8_t* in, size_t len, uint8_t* out, size_t out_len);
+
+
+#endif //NESEMU_RLE_H
@@ -1,41 +1,280 @@
 #include "rom.h"
+#include "crc32.h"
 
-#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define HEADER_SIZE 16
 #define TRAINER_SIZE 512
 #define PRG_ROM_PAGE_SIZE 16384
 #define CHR_ROM_PAGE_SIZE 8192
-#define PRG_ROM_ADDR 0x8000
+#define PRG_RAM_PAGE_SIZE 8192
+#define CHR_RAM_DEFAULT_SIZE 8192
+#define PRG_ROM_BANK_SIZE 8192      // Smallest bank mappers switch, PRG ROM comes in whole ones
+#define CHR_ROM_BANK_SIZE 1024
+#define NES2_MAX_EXPONENT 40        // Far beyond any image, small enough not to overflow
 
+#define FLAG6_VERTICAL 0x01
+#define FLAG6_BATTERY 0x02
+#define FLAG6_TRAINER 0x04
+#define FLAG6_FOUR_SCREEN 0x08
+#define FLAG7_NES2_MASK 0x0C
+#define FLAG7_NES2 0x08
 
+static const uint8_t ines_magic[4] = {'N', 'E', 'S', 0x1A};
+
+/**
+ * ROM size in bytes from an NES 2.0 size LSB and MSB nibble. An MSB of $F
+ * switches to exponent-multiplier notation, 2^E * (MM*2+1). Exponents too
+ * large for any image give UINT64_MAX, which the size checks then reject.
+ */
+static uint64_t nes2_rom_size(uint8_t lsb, uint8_t msb, uint32_t unit) {
+    if(msb == 0x0F && (lsb >> 2) > NES2_MAX_EXPONENT)
+        return UINT64_MAX;
+    if(msb == 0x0F)
+        return ((uint64_t)1 << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
+    return (uint64_t)((msb << 8) | lsb) * unit;
+}
+
+/** RAM size from an NES 2.0 shift count, 64 << shift bytes or none for 0 */
+static uint32_t nes2_ram_size(uint8_t shift) {
+    return shift == 0 ? 0 : 64u << shift;
+}
+
+void ROM::init() {
+    image = nullptr;
+    image_size = 0;
+    error = nullptr;
+    header = nullptr;
+    trainer = nullptr;
+    prg_rom = nullptr;
+    prg_rom_size = 0;
+    chr_rom = nullptr;
+    chr_rom_size = 0;
+    chr_ram_size = 0;
+    crc_valid = false;
+    crc = 0;
+    nes2 = false;
+    mapper = 0;
+    submapper = 0;
+    mirroring = MIRROR_HORIZONTAL;
+    battery = false;
+    prg_ram_size = 0;
+}
 
 ROM::ROM(const char* filename) {
-    std::ifstream rom_file(filename, std::ios::binary);
+    init();
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        fail(strerror(errno));
+        return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        fail(strerror(errno));
+        close(fd);
+        return;
+    }
+    if(st.st_size < HEADER_SIZE) {
+        fail("file too small for an iNES header");
+        close(fd);
+        return;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fail(strerror(errno));
+        return;
+    }
+    image = (uint8_t*)map;
+    image_size = st.st_size;
 
-    header = new uint8_t[HEADER_SIZE];
-    rom_file.read((char*)header, HEADER_SIZE);
+    if(!parse_header()) {
+        munmap(image, image_size);
+        image = nullptr;
+    }
+}
 
-    prg_rom_pages = new uint8_t*[header[4]];
-    for(int i=0; i<header[4]; i++) {
-        prg_rom_pages[i] = new uint8_t[PRG_ROM_PAGE_SIZE];
-        rom_file.read((char*)prg_rom_pages[i], PRG_ROM_PAGE_SIZE);
+ROM::ROM(void* map, size_t size) {
+    init();
+    image = (uint8_t*)map;
+    image_size = size;
+    if(image_size < HEADER_SIZE)
+        fail("file too small for an iNES header");
+    else
+        parse_header();
+    if(!ok()) {
+        munmap(image, image_size);
+        image = nullptr;
     }
+}
 
-    int chr_rom_size = header[5] * CHR_ROM_PAGE_SIZE;
-    chr_rom = new uint8_t[chr_rom_size];
-    rom_file.read((char*)chr_rom, chr_rom_size);
+ROM::~ROM() {
+    if(image != nullptr)
+        munmap(image, image_size);
+}
 
+bool ROM::fail(const char* message) {
+    error = message;
+    return false;
+}
+
+/** Reads the iNES or NES 2.0 header and points the banks into the image */
+bool ROM::parse_header() {
+    header = image;
+    if(memcmp(header, ines_magic, sizeof(ines_magic)) != 0)
+        return fail("not an iNES image");
+
+    uint8_t flags6 = header[6];
+    uint8_t flags7 = header[7];
+    nes2 = (flags7 & FLAG7_NES2_MASK) == FLAG7_NES2;
+
+    uint64_t prg_size;
+    uint64_t chr_size;
+    if(nes2) {
+        prg_size = nes2_rom_size(header[4], header[9] & 0x0F, PRG_ROM_PAGE_SIZE);
+        chr_size = nes2_rom_size(header[5], header[9] >> 4, CHR_ROM_PAGE_SIZE);
+        mapper = (flags6 >> 4) | (flags7 & 0xF0) | ((header[8] & 0x0F) << 8);
+        submapper = header[8] >> 4;
+        prg_ram_size = nes2_ram_size(header[10] & 0x0F) + nes2_ram_size(header[10] >> 4);
+        chr_ram_size = nes2_ram_size(header[11] & 0x0F) + nes2_ram_size(header[11] >> 4);
+    } else {
+        prg_size = (uint64_t)header[4] * PRG_ROM_PAGE_SIZE;
+        chr_size = (uint64_t)header[5] * CHR_ROM_PAGE_SIZE;
+        // Old dumping tools left text in bytes 7-15, the upper mapper nibble is garbage then
+        bool dirty = header[12] != 0 || header[13] != 0 || header[14] != 0 || header[15] != 0;
+        mapper = (flags6 >> 4) | (dirty ? 0 : (flags7 & 0xF0));
+        prg_ram_size = (header[8] == 0 ? 1 : header[8]) * PRG_RAM_PAGE_SIZE;
+        chr_ram_size = 0;
+    }
+    battery = flags6 & FLAG6_BATTERY;
+    if(flags6 & FLAG6_FOUR_SCREEN)
+        mirroring = MIRROR_FOUR_SCREEN;
+    else
+        mirroring = flags6 & FLAG6_VERTICAL ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+
+    if(prg_size == 0)
+        return fail("image has no PRG ROM");
+
+    uint64_t offset = HEADER_SIZE;
+    if(flags6 & FLAG6_TRAINER) {
+        if(TRAINER_SIZE > image_size - offset)
+            return fail("image is truncated in the trainer");
+        trainer = &image[offset];
+        offset += TRAINER_SIZE;
+    }
+    if(prg_size > image_size - offset)
+        return fail("image is truncated in PRG ROM");
+    // NES 2.0 exponent notation can give any size, mappers need whole banks
+    if(prg_size % PRG_ROM_BANK_SIZE != 0)
+        return fail("PRG ROM size is not a multiple of 8 KiB");
+    prg_rom = &image[offset];
+    prg_rom_size = prg_size;
+    offset += prg_size;
+    if(chr_size > image_size - offset)
+        return fail("image is truncated in CHR ROM");
+    if(chr_size % CHR_ROM_BANK_SIZE != 0)
+        return fail("CHR ROM size is not a multiple of 1 KiB");
+
+    if(chr_size > 0) {
+        chr_rom = &image[offset];
+        chr_rom_size = chr_size;
+        chr_ram_size = 0;
+    } else if(chr_ram_size == 0) {
+        chr_ram_size = CHR_RAM_DEFAULT_SIZE;
+    }
+    return true;
+}
+
+bool ROM::ok() {
+    return error == nullptr;
+}
+
+const char* ROM::get_error() {
+    return error;
 }
 
 uint8_t* ROM::get_prg_rom_lo(uint16_t addr) {
-    return &prg_rom_pages[0][addr];
+    return &prg_rom[addr];
 }
 
 uint8_t* ROM::get_prg_rom_hi(uint16_t addr) {
-    return &prg_rom_pages[header[4]-1][addr];
+    uint32_t last_page = prg_rom_size >= PRG_ROM_PAGE_SIZE ? prg_rom_size - PRG_ROM_PAGE_SIZE : 0;
+    return &prg_rom[last_page + addr];
 }
 
 uint8_t* ROM::get_chr_rom(uint16_t addr) {
     return &chr_rom[addr];
 }
+
+uint8_t* ROM::get_prg_rom() {
+    return prg_rom;
+}
+
+uint32_t ROM::get_prg_rom_size() {
+    return prg_rom_size;
+}
+
+uint8_t* ROM::get_chr() {
+    return chr_rom;
+}
+
+uint32_t ROM::get_chr_size() {
+    return chr_rom != nullptr ? chr_rom_size : chr_ram_size;
+}
+
+bool ROM::is_chr_ram() {
+    return chr_rom == nullptr;
+}
+
+uint8_t* ROM::get_trainer() {
+    return trainer;
+}
+
+bool ROM::is_nes2() {
+    return nes2;
+}
+
+uint16_t ROM::get_mapper() {
+    return mapper;
+}
+
+uint8_t ROM::get_submapper() {
+    return submapper;
+}
+
+ROM::Mirroring ROM::get_mirroring() {
+    return mirroring;
+}
+
+bool ROM::has_battery() {
+    return battery;
+}
+
+uint32_t ROM::get_prg_ram_size() {
+    return prg_ram_size;
+}
+
+uint8_t* ROM::get_image() {
+    return image;
+}
+
+size_t ROM::get_image_size() {
+    return image_size;
+}
+
+uint32_t ROM::get_crc32() {
+    if(!crc_valid) {
+        crc = crc32(prg_rom, prg_rom_size);
+        if(chr_rom != nullptr)
+            crc = crc32(chr_rom, chr_rom_size, crc);
+        crc_valid = true;
+    }
+    return crc;
+}
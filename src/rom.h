@@ -1,21 +1,96 @@
 #ifndef NESEMU_ROM_H
 #define NESEMU_ROM_H
 
+#include <cstddef>
 #include <cstdint>
 
+/**
+ * A cartridge image in iNES or NES 2.0 format. The file is memory mapped
+ * and the PRG and CHR banks point straight into the mapping, so loading
+ * copies nothing and identical images share pages in the page cache.
+ * Loading never throws: check ok() and get_error() after construction.
+ *
+ * A ROM is never written to once loaded, so one can be shared by several
+ * emulator instances (see RomCache). Anything writable on the cartridge,
+ * like CHR RAM, belongs to the instance.
+ */
 class ROM {
+public:
+    enum Mirroring {
+        MIRROR_HORIZONTAL,
+        MIRROR_VERTICAL,
+        MIRROR_FOUR_SCREEN,
+        MIRROR_SINGLE_LOW,      // Set by mappers, every nametable is the first one
+        MIRROR_SINGLE_HIGH,     // Set by mappers, every nametable is the second one
+    };
+
 private:
+    uint8_t* image;         // The mapped file
+    size_t image_size;
+    const char* error;
+
     uint8_t* header;
-//    uint8_t* trainer;
-    uint8_t** prg_rom_pages;
-    uint8_t* chr_rom;
+    uint8_t* trainer;       // nullptr without a trainer
+    uint8_t* prg_rom;
+    uint32_t prg_rom_size;
+    uint8_t* chr_rom;       // nullptr when the cartridge has CHR RAM instead
+    uint32_t chr_rom_size;
+    uint32_t chr_ram_size;
+    bool crc_valid;
+    uint32_t crc;
+
+    bool nes2;
+    uint16_t mapper;
+    uint8_t submapper;
+    Mirroring mirroring;
+    bool battery;
+    uint32_t prg_ram_size;
+
+    void init();
+    bool parse_header();
+    bool fail(const char* message);
 
 public:
     ROM(const char* filename);
+    /** Takes over a read only mmap of an image, which is unmapped with the ROM */
+    ROM(void* image, size_t size);
+    ~ROM();
+
+    ROM(const ROM&) = delete;
+    ROM& operator=(const ROM&) = delete;
+
+    /** False if the image could not be loaded, get_error() says why */
+    bool ok();
+    const char* get_error();
 
     uint8_t* get_prg_rom_lo(uint16_t addr);
     uint8_t* get_prg_rom_hi(uint16_t addr);
     uint8_t* get_chr_rom(uint16_t addr);
+
+    /** All of PRG ROM, get_prg_rom_size() bytes */
+    uint8_t* get_prg_rom();
+    uint32_t get_prg_rom_size();
+    /** CHR ROM, nullptr when is_chr_ram() */
+    uint8_t* get_chr();
+    uint32_t get_chr_size();
+    /** True if the cartridge has get_chr_size() bytes of CHR RAM instead of CHR ROM */
+    bool is_chr_ram();
+    /** The 512 byte trainer loaded at $7000, nullptr if there is none */
+    uint8_t* get_trainer();
+
+    bool is_nes2();
+    uint16_t get_mapper();
+    uint8_t get_submapper();
+    Mirroring get_mirroring();
+    bool has_battery();
+    /** Size of the PRG RAM at $6000, 8 KiB when an iNES header does not say */
+    uint32_t get_prg_ram_size();
+
+    /** The whole file, header included */
+    uint8_t* get_image();
+    size_t get_image_size();
+    /** CRC32 of PRG and CHR ROM, the usual checksum of ROM databases */
+    uint32_t get_crc32();
 };
 
 
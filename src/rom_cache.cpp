@@ -0,0 +1,138 @@
+#include "rom_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+
+#define SHM_NAME_FORMAT "/nesemu-rom-%s"
+#define SHM_NAME_MAX 128
+
+RomCache::RomCache() {
+    shared_memory = false;
+}
+
+RomCache& RomCache::get() {
+    static RomCache cache;
+    return cache;
+}
+
+void RomCache::set_shared_memory(bool enabled) {
+    std::lock_guard<std::mutex> guard(lock);
+    shared_memory = enabled;
+}
+
+size_t RomCache::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t live = 0;
+    for(auto& entry : roms) {
+        if(!entry.second.expired())
+            live++;
+    }
+    return live;
+}
+
+/**
+ * CRC32 of the banks and the image size, then the 16 header bytes and the
+ * trainer's CRC32 if there is one. The header is part of the key since the
+ * cached ROM carries its mapper and mirroring, and dumps with the same
+ * banks can have different (e.g. corrected) headers.
+ */
+static std::string content_key(ROM& rom) {
+    char key[96];
+    int length = snprintf(key, sizeof(key), "%08x-%zu-", rom.get_crc32(), rom.get_image_size());
+    for(int i=0; i<16; i++)
+        length += snprintf(key + length, sizeof(key) - length, "%02x", rom.get_image()[i]);
+    if(rom.get_trainer() != nullptr)
+        snprintf(key + length, sizeof(key) - length, "-%08x", crc32(rom.get_trainer(), 512));
+    return key;
+}
+
+static std::string file_key(const struct stat& st) {
+    char key[96];
+    snprintf(key, sizeof(key), "%llu:%llu:%lld:%lld.%09ld",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    return key;
+}
+
+std::shared_ptr<ROM> RomCache::load(const char* filename) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    struct stat st;
+    std::string identity;
+    if(stat(filename, &st) == 0) {
+        identity = file_key(st);
+        auto file = files.find(identity);
+        if(file != files.end()) {
+            std::shared_ptr<ROM> rom = roms[file->second].lock();
+            if(rom != nullptr)
+                return rom;
+        }
+    }
+
+    std::shared_ptr<ROM> rom = std::make_shared<ROM>(filename);
+    if(!rom->ok())
+        return rom;
+
+    std::string key = content_key(*rom);
+    if(!identity.empty())
+        files[identity] = key;
+    std::shared_ptr<ROM> cached = roms[key].lock();
+    if(cached != nullptr)
+        return cached;
+
+    if(shared_memory)
+        rom = share(rom, key);
+    roms[key] = rom;
+    return rom;
+}
+
+/**
+ * Moves a freshly loaded ROM into the shared memory object for its
+ * contents, creating the object if no other process has. Returns the ROM
+ * unchanged when shared memory is not available.
+ */
+std::shared_ptr<ROM> RomCache::share(const std::shared_ptr<ROM>& rom, const std::string& key) {
+    char name[SHM_NAME_MAX];
+    size_t size = rom->get_image_size();
+    snprintf(name, sizeof(name), SHM_NAME_FORMAT, key.c_str());
+
+    // The creator holds an exclusive lock until the image is written
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd >= 0) {
+        flock(fd, LOCK_EX);
+        bool written = ftruncate(fd, size) == 0
+                       && pwrite(fd, rom->get_image(), size, 0) == (ssize_t)size;
+        flock(fd, LOCK_UN);
+        if(!written) {
+            close(fd);
+            shm_unlink(name);
+            return rom;
+        }
+    } else {
+        fd = shm_open(name, O_RDONLY, 0);
+        if(fd < 0)
+            return rom;
+        flock(fd, LOCK_SH);
+    }
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+        map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return rom;
+
+    // Another process could have published different contents under the name
+    std::shared_ptr<ROM> shared = std::make_shared<ROM>(map, size);
+    if(!shared->ok() || content_key(*shared) != key)
+        return rom;
+    return shared;
+}
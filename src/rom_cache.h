@@ -0,0 +1,52 @@
+#ifndef NESEMU_ROM_CACHE_H
+#define NESEMU_ROM_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "rom.h"
+
+/**
+ * Process wide cache of loaded ROMs, keyed by the CRC32 and size of their
+ * contents and by their header. Every emulator instance running the same
+ * game gets the same read only ROM, which stays loaded for as long as one
+ * of them holds it. Files that were loaded before are recognized by device,
+ * inode, size and modification time, so they are not read again to be
+ * hashed.
+ *
+ * With shared memory turned on, images are also published as POSIX shared
+ * memory objects named after their key, and sibling processes map the
+ * same pages. The objects stay in /dev/shm (as nesemu-rom-*) after the
+ * processes exit, so later runs can start from them too.
+ */
+class RomCache {
+private:
+    std::mutex lock;
+    /** Live ROMs by content key */
+    std::map<std::string, std::weak_ptr<ROM>> roms;
+    /** Content key of files seen before, by file identity */
+    std::map<std::string, std::string> files;
+    bool shared_memory;
+
+    RomCache();
+
+    std::shared_ptr<ROM> share(const std::shared_ptr<ROM>& rom, const std::string& key);
+
+public:
+    static RomCache& get();
+
+    /**
+     * Loads a ROM, or returns the one already loaded with the same contents.
+     * Check ok() on the result; ROMs that failed to load are not cached.
+     */
+    std::shared_ptr<ROM> load(const char* filename);
+    void set_shared_memory(bool enabled);
+    /** Number of ROMs that are still in use */
+    size_t size();
+};
+
+
+#endif //NESEMU_ROM_CACHE_H
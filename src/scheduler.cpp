@@ -0,0 +1,107 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+// Stale entries beyond this many per source make the heap get rebuilt
+#define STALE_LIMIT 4
+
+Scheduler::Scheduler() {
+    wake = nullptr;
+    wake_context = nullptr;
+}
+
+/** std::push_heap and friends build max-heaps, so the order is reversed */
+bool Scheduler::later(const Entry& a, const Entry& b) {
+    return a.cycle > b.cycle;
+}
+
+int Scheduler::add_source(EventHandler handler, void* context) {
+    sources.push_back({handler, context, NO_EVENT});
+    return sources.size() - 1;
+}
+
+void Scheduler::set_wake_handler(WakeHandler handler, void* context) {
+    wake = handler;
+    wake_context = context;
+}
+
+bool Scheduler::is_stale(const Entry& entry) {
+    return sources[entry.source].cycle != entry.cycle;
+}
+
+void Scheduler::pop() {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    heap.pop_back();
+}
+
+/** Rebuilds the heap from the pending times, once replaced entries pile up */
+void Scheduler::compact() {
+    heap.clear();
+    for(size_t i=0; i<sources.size(); i++) {
+        if(sources[i].cycle != NO_EVENT)
+            heap.push_back({sources[i].cycle, (int)i});
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+}
+
+void Scheduler::schedule(int source, uint64_t cycle) {
+    if(sources[source].cycle == cycle)
+        return;
+    sources[source].cycle = cycle;
+    if(cycle == NO_EVENT)
+        return;
+    if(heap.size() >= (sources.size() + 1) * STALE_LIMIT)
+        compact();
+    else {
+        heap.push_back({cycle, source});
+        std::push_heap(heap.begin(), heap.end(), later);
+    }
+    if(wake != nullptr)
+        wake(wake_context, cycle);
+}
+
+void Scheduler::cancel(int source) {
+    schedule(source, NO_EVENT);
+}
+
+uint64_t Scheduler::next_cycle() {
+    while(!heap.empty() && is_stale(heap.front()))
+        pop();
+    return heap.empty() ? NO_EVENT : heap.front().cycle;
+}
+
+/**
+ * Handlers may schedule their source again, but for a later cycle than
+ * now. Events they schedule for now or earlier run in the same call.
+ */
+void Scheduler::run_due(uint64_t now) {
+    while(!heap.empty() && heap.front().cycle <= now) {
+        Entry entry = heap.front();
+        pop();
+        if(is_stale(entry))
+            continue;
+        Source& source = sources[entry.source];
+        source.cycle = NO_EVENT;
+        source.handler(source.context, now);
+    }
+}
+
+template<typename State> void Scheduler::serialize(State& state) {
+    uint32_t count = sources.size();
+    state.value(count);
+    if(count != sources.size()) {
+        state.fail();
+        return;
+    }
+    for(Source& source : sources)
+        state.value(source.cycle);
+}
+
+void Scheduler::save_state(StateWriter& state) {
+    serialize(state);
+}
+
+void Scheduler::load_state(StateReader& state) {
+    serialize(state);
+    compact();
+}
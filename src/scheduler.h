@@ -0,0 +1,76 @@
+#ifndef NESEMU_SCHEDULER_H
+#define NESEMU_SCHEDULER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "state.h"
+
+#define NO_EVENT UINT64_MAX
+
+/**
+ * Timed events keyed on the CPU cycle counter. Devices register a source
+ * once and then schedule it for the cycle their next interrupt, DMA or
+ * other deadline falls on. Each source has at most one pending time, and
+ * scheduling it again replaces that. The times are kept in a binary
+ * min-heap, so the CPU only compares its cycle counter with the earliest
+ * one. Replaced entries stay in the heap and are dropped when they reach
+ * the top.
+ */
+class Scheduler {
+public:
+    /** Called once the event's cycle has passed, with the CPU's current cycle */
+    typedef void (*EventHandler)(void* context, uint64_t now);
+    /** Called when an event is scheduled, so a running CPU can stop earlier for it */
+    typedef void (*WakeHandler)(void* context, uint64_t cycle);
+
+private:
+    typedef struct source {
+        EventHandler handler;
+        void* context;
+        uint64_t cycle;     // NO_EVENT when nothing is pending
+    } Source;
+
+    typedef struct entry {
+        uint64_t cycle;
+        int source;
+    } Entry;
+
+    std::vector<Source> sources;
+    std::vector<Entry> heap;
+    WakeHandler wake;
+    void* wake_context;
+
+    static bool later(const Entry& a, const Entry& b);
+    bool is_stale(const Entry& entry);
+    void pop();
+    void compact();
+
+    template<typename State> void serialize(State& state);
+
+public:
+    Scheduler();
+
+    /** Registers an event source, returns its id for schedule() and cancel() */
+    int add_source(EventHandler handler, void* context);
+    void set_wake_handler(WakeHandler handler, void* context);
+
+    /** Sets the cycle of the source's next event, replacing any pending one */
+    void schedule(int source, uint64_t cycle);
+    void cancel(int source);
+
+    /** Cycle of the earliest pending event, NO_EVENT if there is none */
+    uint64_t next_cycle();
+    /** Runs the handlers of all events due by now, earliest first */
+    void run_due(uint64_t now);
+
+    /**
+     * Saves the pending time of every source. Loading needs the same
+     * sources registered in the same order, and replaces the whole heap.
+     */
+    void save_state(StateWriter& state);
+    void load_state(StateReader& state);
+};
+
+
+#endif //NESEMU_SCHEDULER_H
@@ -0,0 +1,115 @@
+#ifndef NESEMU_STATE_H
+#define NESEMU_STATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#define STATE_MAGIC "NESSTATE"
+#define STATE_VERSION 3
+
+/** Header flag: the PPU's frame buffer was left out, and is kept as it is on load */
+#define STATE_NO_FRAME 0x01
+
+/**
+ * Save states are a StateHeader followed by the fields of every chip, each
+ * chip in a fixed order and each field at its own width, in host byte
+ * order. There are no tags or padding, so a change to what any chip saves
+ * needs a new STATE_VERSION.
+ */
+typedef struct state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;      // The whole state, header included
+    uint32_t rom_crc;   // CRC32 of the ROM the state belongs to
+    uint32_t flags;
+} StateHeader;
+
+static_assert(sizeof(StateHeader) == 24, "state headers are 24 bytes");
+
+/**
+ * Appends fields to a state. The chips share one function for saving and
+ * loading, a template over StateWriter and StateReader, so both always
+ * agree on the layout.
+ */
+class StateWriter {
+private:
+    std::vector<uint8_t>& blob;
+    uint32_t flags;
+
+public:
+    StateWriter(std::vector<uint8_t>& blob, uint32_t flags = 0): blob(blob), flags(flags) {}
+
+    /** The header flags, which leave parts of the state out */
+    uint32_t get_flags() {
+        return flags;
+    }
+
+    template<typename T> void value(T& value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "only scalars are saved as values");
+        bytes(&value, sizeof(T));
+    }
+
+    void bytes(const void* data, size_t size) {
+        size_t at = blob.size();
+        blob.resize(at + size);
+        memcpy(&blob[at], data, size);
+    }
+
+    /** Writers never fail, this is for the templates shared with StateReader */
+    void fail() {}
+};
+
+/** Reads fields back from a state. Reading past the end, or a chip rejecting a value, makes ok() false */
+class StateReader {
+private:
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint32_t flags;
+    bool failed;
+
+public:
+    StateReader(const uint8_t* data, size_t size, uint32_t flags = 0)
+        : pos(data), end(data + size), flags(flags), failed(false) {}
+
+    uint32_t get_flags() {
+        return flags;
+    }
+
+    template<typename T> void value(T& value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "only scalars are saved as values");
+        bytes(&value, sizeof(T));
+    }
+
+    /** A bool is saved as a byte, anything but 0 or 1 fails the load */
+    void value(bool& value) {
+        uint8_t byte = 0;
+        bytes(&byte, 1);
+        if(byte > 1)
+            failed = true;
+        value = byte != 0;
+    }
+
+    void bytes(void* data, size_t size) {
+        if(size > (size_t)(end - pos)) {
+            failed = true;
+            pos = end;
+            return;
+        }
+        memcpy(data, pos, size);
+        pos += size;
+    }
+
+    void fail() {
+        failed = true;
+    }
+
+    /** True if every read was in bounds and accepted, and the whole state was read */
+    bool ok() {
+        return !failed && pos == end;
+    }
+};
+
+
+#endif //NESEMU_STATE_H
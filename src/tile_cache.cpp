@@ -0,0 +1,82 @@
+#include "tile_cache.h"
+
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+/**
+ * Each 32 byte half holds four rows. The planes are broadcast to both lanes,
+ * a shuffle repeats each row byte eight times, and comparing against the
+ * bit of each pixel turns them into 0 or 0xFF masks.
+ */
+void decode_tile(const uint8_t* chr, uint8_t* pixels) {
+    const __m256i bits = _mm256_set1_epi64x((long long)0x0102040810204080ULL);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i*)chr));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i*)(chr + 8)));
+    for(int half=0; half<2; half++) {
+        int row = half * 4;
+        __m256i rows = _mm256_setr_epi8(
+            row, row, row, row, row, row, row, row,
+            row+1, row+1, row+1, row+1, row+1, row+1, row+1, row+1,
+            row+2, row+2, row+2, row+2, row+2, row+2, row+2, row+2,
+            row+3, row+3, row+3, row+3, row+3, row+3, row+3, row+3);
+        // The shuffle works within lanes, so the upper lane indexes from 0 again
+        __m256i lo_rows = _mm256_shuffle_epi8(lo, rows);
+        __m256i hi_rows = _mm256_shuffle_epi8(hi, rows);
+        __m256i lo_set = _mm256_cmpeq_epi8(_mm256_and_si256(lo_rows, bits), bits);
+        __m256i hi_set = _mm256_cmpeq_epi8(_mm256_and_si256(hi_rows, bits), bits);
+        __m256i out = _mm256_or_si256(_mm256_and_si256(lo_set, one), _mm256_and_si256(hi_set, two));
+        _mm256_storeu_si256((__m256i*)(pixels + half * 32), out);
+    }
+}
+#elif defined(__SSE2__)
+/**
+ * Unpacking the planes with themselves three times repeats each row byte
+ * eight times, two rows to a register. Comparing against the bit of each
+ * pixel turns them into 0 or 0xFF masks.
+ */
+void decode_tile(const uint8_t* chr, uint8_t* pixels) {
+    const __m128i bits = _mm_set1_epi64x((long long)0x0102040810204080ULL);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    __m128i lo = _mm_loadl_epi64((const __m128i*)chr);
+    __m128i hi = _mm_loadl_epi64((const __m128i*)(chr + 8));
+    lo = _mm_unpacklo_epi8(lo, lo);
+    hi = _mm_unpacklo_epi8(hi, hi);
+    __m128i lo_quads[2] = {_mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo)};
+    __m128i hi_quads[2] = {_mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi)};
+    for(int i=0; i<4; i++) {
+        __m128i lo_rows = i & 1 ? _mm_unpackhi_epi32(lo_quads[i >> 1], lo_quads[i >> 1])
+                                : _mm_unpacklo_epi32(lo_quads[i >> 1], lo_quads[i >> 1]);
+        __m128i hi_rows = i & 1 ? _mm_unpackhi_epi32(hi_quads[i >> 1], hi_quads[i >> 1])
+                                : _mm_unpacklo_epi32(hi_quads[i >> 1], hi_quads[i >> 1]);
+        __m128i lo_set = _mm_cmpeq_epi8(_mm_and_si128(lo_rows, bits), bits);
+        __m128i hi_set = _mm_cmpeq_epi8(_mm_and_si128(hi_rows, bits), bits);
+        __m128i out = _mm_or_si128(_mm_and_si128(lo_set, one), _mm_and_si128(hi_set, two));
+        _mm_storeu_si128((__m128i*)(pixels + i * 16), out);
+    }
+}
+#else
+void decode_tile(const uint8_t* chr, uint8_t* pixels) {
+    for(int row=0; row<8; row++) {
+        uint8_t lo = chr[row];
+        uint8_t hi = chr[row + 8];
+        for(int bit=0; bit<8; bit++)
+            pixels[row * 8 + bit] = ((lo >> (7 - bit)) & 0x01) | (((hi >> (7 - bit)) & 0x01) << 1);
+    }
+}
+#endif
+
+TileCache::TileCache(uint8_t* const* slots): slots(slots) {
+    memset(valid, 0, sizeof(valid));
+}
+
+void TileCache::decode(int slot, int tile) {
+    decode_tile(slots[slot] + tile * TILE_SIZE, pixels[slot][tile]);
+    valid[slot] |= 1ULL << tile;
+}
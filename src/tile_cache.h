@@ -0,0 +1,54 @@
+#ifndef NESEMU_TILE_CACHE_H
+#define NESEMU_TILE_CACHE_H
+
+#include <cstdint>
+
+#define TILE_SIZE 16            // Bytes of CHR per tile, two 8 byte bit planes
+#define TILE_PIXELS 64
+#define TILE_CACHE_SLOTS 8      // One per 1 KiB CHR slot
+#define TILES_PER_SLOT 64
+
+/**
+ * Expands a 16 byte CHR tile into 64 pixels of 0-3, row by row. Uses AVX2
+ * or SSE2 when the build targets them, with a portable fallback.
+ */
+void decode_tile(const uint8_t* chr, uint8_t* pixels);
+
+/**
+ * Decoded pattern tables. Tiles are decoded the first time they are fetched
+ * and kept until the CHR slot they are in is switched to another bank, or
+ * the tile is written to in CHR RAM, so the PPU reads a row of pixels with
+ * one load instead of picking bits out of both planes.
+ */
+class TileCache {
+private:
+    alignas(64) uint8_t pixels[TILE_CACHE_SLOTS][TILES_PER_SLOT][TILE_PIXELS];
+    uint64_t valid[TILE_CACHE_SLOTS];  // Bit per decoded tile
+    uint8_t* const* slots;
+
+    void decode(int slot, int tile);
+
+public:
+    /** slots are the CHR slot pointers the tiles are decoded from */
+    TileCache(uint8_t* const* slots);
+
+    void invalidate_slot(int slot) {
+        valid[slot] = 0;
+    }
+    /** Drops the tile at an offset into a slot */
+    void invalidate_tile(int slot, uint16_t offset) {
+        valid[slot] &= ~(1ULL << ((offset >> 4) & (TILES_PER_SLOT - 1)));
+    }
+
+    /** The 8 pixels of the tile row at a pattern table address, the row being bits 0-2 */
+    const uint8_t* get_row(uint16_t addr) {
+        int slot = addr >> 10;
+        int tile = (addr >> 4) & (TILES_PER_SLOT - 1);
+        if(!((valid[slot] >> tile) & 1))
+            decode(slot, tile);
+        return &pixels[slot][tile][(addr & 0x07) * 8];
+    }
+};
+
+
+#endif //NESEMU_TILE_CACHE_H
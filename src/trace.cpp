@@ -0,0 +1,339 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "rle.h"
+
+#define TRACE_BUFFER_RECORDS 65536
+#define TRACE_BLOCK_RECORDS 4096
+#define TRACE_RING_RECORDS (1 << 18)
+#define TRACE_IDLE_SLEEP_US 100
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static char* put_hex8(char* p, uint8_t value) {
+    p[0] = hex_digits[value >> 4];
+    p[1] = hex_digits[value & 0x0F];
+    return p + 2;
+}
+
+static char* put_reg(char* p, const char* name, uint8_t value) {
+    size_t len = strlen(name);
+    memcpy(p, name, len);
+    return put_hex8(p + len, value);
+}
+
+int format_trace_record(const TraceRecord& rec, char* buf) {
+    const CPU::InstInfo& info = CPU::get_inst_info(rec.inst[0]);
+    char* p = buf;
+
+    p = put_hex8(p, rec.pc >> 8);
+    p = put_hex8(p, rec.pc & 0xFF);
+    *p++ = ' ';
+    *p++ = ' ';
+    for(int i=0; i<3; i++) {
+        if(i<info.inst_size) {
+            p = put_hex8(p, rec.inst[i]);
+        } else {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+        *p++ = ' ';
+    }
+    *p++ = ' ';
+    memcpy(p, info.inst_name, 3);
+    p += 3;
+    p = put_reg(p, "  A:", rec.a);
+    p = put_reg(p, " X:", rec.x);
+    p = put_reg(p, " Y:", rec.y);
+    p = put_reg(p, " P:", rec.p);
+    p = put_reg(p, " SP:", rec.sp);
+    p += snprintf(p, TRACE_LINE_MAX - (p - buf), " CYC:%llu", (unsigned long long)rec.cycles);
+    return p - buf;
+}
+
+TextTraceSink::TextTraceSink(FILE* out): out(out) {}
+
+void TextTraceSink::record(const TraceRecord& rec) {
+    char line[TRACE_LINE_MAX];
+    int len = format_trace_record(rec, line);
+    line[len++] = '\n';
+    fwrite(line, 1, len, out);
+}
+
+void TextTraceSink::flush() {
+    fflush(out);
+}
+
+/**
+ * XORs each record with the one before it into out, the first one with
+ * *previous, which is left holding the last record.
+ */
+static void xor_records(const TraceRecord* records, size_t count, TraceRecord* previous, TraceRecord* out) {
+    uint64_t prev[3];
+    memcpy(prev, previous, sizeof(prev));
+    for(size_t i=0; i<count; i++) {
+        uint64_t cur[3];
+        memcpy(cur, &records[i], sizeof(cur));
+        for(int j=0; j<3; j++) {
+            uint64_t delta = cur[j] ^ prev[j];
+            prev[j] = cur[j];
+            cur[j] = delta;
+        }
+        memcpy(&out[i], cur, sizeof(cur));
+    }
+    memcpy(previous, prev, sizeof(prev));
+}
+
+/** Undoes xor_records in place */
+static void unxor_records(TraceRecord* records, size_t count, TraceRecord* previous) {
+    uint64_t prev[3];
+    memcpy(prev, previous, sizeof(prev));
+    for(size_t i=0; i<count; i++) {
+        uint64_t cur[3];
+        memcpy(cur, &records[i], sizeof(cur));
+        for(int j=0; j<3; j++) {
+            cur[j] ^= prev[j];
+            prev[j] = cur[j];
+        }
+        memcpy(&records[i], cur, sizeof(cur));
+    }
+    memcpy(previous, prev, sizeof(prev));
+}
+
+TraceFile::TraceFile(const char* filename, bool compress): compress(compress) {
+    previous = {};
+    delta = new uint8_t[TRACE_BLOCK_RECORDS * sizeof(TraceRecord)];
+    encoded = new uint8_t[RLE_MAX_ENCODED(TRACE_BLOCK_RECORDS * sizeof(TraceRecord))];
+    file = fopen(filename, "wb");
+    if(file == nullptr) {
+        perror(filename);
+        return;
+    }
+
+    TraceHeader header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.flags = compress ? TRACE_COMPRESSED : 0;
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+TraceFile::~TraceFile() {
+    if(file != nullptr)
+        fclose(file);
+    delete[] delta;
+    delete[] encoded;
+}
+
+bool TraceFile::is_open() {
+    return file != nullptr;
+}
+
+void TraceFile::write(const TraceRecord* records, size_t count) {
+    if(file == nullptr)
+        return;
+    if(!compress) {
+        fwrite(records, sizeof(TraceRecord), count, file);
+        return;
+    }
+
+    while(count > 0) {
+        size_t block_records = count < TRACE_BLOCK_RECORDS ? count : TRACE_BLOCK_RECORDS;
+        xor_records(records, block_records, &previous, (TraceRecord*)delta);
+
+        TraceBlock block;
+        block.records = block_records;
+        block.encoded_size = rle_encode(delta, block_records * sizeof(TraceRecord), encoded);
+        fwrite(&block, sizeof(block), 1, file);
+        fwrite(encoded, 1, block.encoded_size, file);
+        records += block_records;
+        count -= block_records;
+    }
+}
+
+void TraceFile::flush() {
+    if(file != nullptr)
+        fflush(file);
+}
+
+TraceReader::TraceReader(const char* filename) {
+    data = nullptr;
+    size = 0;
+    offset = sizeof(TraceHeader);
+    compressed = false;
+    previous = {};
+    block = new TraceRecord[TRACE_BLOCK_RECORDS];
+    block_records = 0;
+    block_next = 0;
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+    if((size_t)st.st_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "%s: not a trace file\n", filename);
+        close(fd);
+        return;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror(filename);
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const TraceHeader* header = (const TraceHeader*)map;
+    if(memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+       || header->version != TRACE_VERSION
+       || header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a version %d trace file\n", filename, TRACE_VERSION);
+        munmap(map, st.st_size);
+        return;
+    }
+    data = (uint8_t*)map;
+    size = st.st_size;
+    compressed = header->flags & TRACE_COMPRESSED;
+}
+
+TraceReader::~TraceReader() {
+    if(data != nullptr)
+        munmap(data, size);
+    delete[] block;
+}
+
+bool TraceReader::is_open() {
+    return data != nullptr;
+}
+
+/** Decodes the next compressed block, false at the end of the file or on corrupt data */
+bool TraceReader::next_block() {
+    TraceBlock header;
+    if(offset + sizeof(header) > size)
+        return false;
+    memcpy(&header, &data[offset], sizeof(header));
+    offset += sizeof(header);
+    if(header.records > TRACE_BLOCK_RECORDS || offset + header.encoded_size > size)
+        return false;
+
+    size_t expected = header.records * sizeof(TraceRecord);
+    if(rle_decode(&data[offset], header.encoded_size, (uint8_t*)block, expected) != expected)
+        return false;
+    offset += header.encoded_size;
+
+    unxor_records(block, header.records, &previous);
+    block_records = header.records;
+    block_next = 0;
+    return true;
+}
+
+bool TraceReader::next(TraceRecord& rec) {
+    if(data == nullptr)
+        return false;
+    if(!compressed) {
+        if(offset + sizeof(TraceRecord) > size)
+            return false;
+        memcpy(&rec, &data[offset], sizeof(TraceRecord));
+        offset += sizeof(TraceRecord);
+        return true;
+    }
+
+    if(block_next == block_records && !next_block())
+        return false;
+    rec = block[block_next++];
+    return true;
+}
+
+TraceWriter::TraceWriter(const char* filename, bool compress): file(filename, compress) {
+    buffer = new TraceRecord[TRACE_BUFFER_RECORDS];
+    used = 0;
+}
+
+TraceWriter::~TraceWriter() {
+    flush();
+    delete[] buffer;
+}
+
+bool TraceWriter::is_open() {
+    return file.is_open();
+}
+
+void TraceWriter::record(const TraceRecord& rec) {
+    buffer[used++] = rec;
+    if(used == TRACE_BUFFER_RECORDS)
+        flush();
+}
+
+void TraceWriter::flush() {
+    file.write(buffer, used);
+    file.flush();
+    used = 0;
+}
+
+AsyncTraceWriter::AsyncTraceWriter(const char* filename, FullPolicy policy, bool compress):
+        file(filename, compress), ring(TRACE_RING_RECORDS), policy(policy) {
+    dropped = 0;
+    running = true;
+    writer = std::thread(&AsyncTraceWriter::drain, this);
+}
+
+AsyncTraceWriter::~AsyncTraceWriter() {
+    running = false;
+    writer.join();
+    file.flush();
+}
+
+bool AsyncTraceWriter::is_open() {
+    return file.is_open();
+}
+
+void AsyncTraceWriter::record(const TraceRecord& rec) {
+    if(ring.push(rec))
+        return;
+    if(policy == TRACE_DROP) {
+        dropped++;
+        return;
+    }
+    while(!ring.push(rec))
+        std::this_thread::yield();
+}
+
+void AsyncTraceWriter::flush() {
+    while(!ring.empty())
+        std::this_thread::yield();
+    file.flush();
+}
+
+uint64_t AsyncTraceWriter::get_dropped() {
+    return dropped;
+}
+
+/** Body of the writer thread. Keeps going until stopped and the ring is empty */
+void AsyncTraceWriter::drain() {
+    for(;;) {
+        // Look at running first, so a stop never hides records pushed before it
+        bool stopping = !running;
+        const TraceRecord* records;
+        size_t count = ring.peek(&records);
+        if(count == 0) {
+            if(stopping)
+                return;
+            std::this_thread::sleep_for(std::chrono::microseconds(TRACE_IDLE_SLEEP_US));
+            continue;
+        }
+        file.write(records, count);
+        ring.consume(count);
+    }
+}
@@ -0,0 +1,177 @@
+#ifndef NESEMU_TRACE_H
+#define NESEMU_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+#include "ring.h"
+
+#define TRACE_MAGIC "NESTRACE"
+#define TRACE_VERSION 2
+#define TRACE_LINE_MAX 80
+
+/** Header flag: records are stored in RLE compressed blocks */
+#define TRACE_COMPRESSED 0x01
+
+/**
+ * CPU state before an instruction executes. Trace files are a TraceHeader
+ * followed by these fixed size records, in host byte order. Compressed files
+ * hold blocks instead, each a TraceBlock followed by the RLE encoded XOR of
+ * every record with the one before it.
+ */
+typedef struct trace_record {
+    uint64_t cycles;
+    uint16_t pc;
+    uint8_t inst[3];    // Instruction bytes, unused ones are zero
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t sp;
+    uint8_t reserved[6];
+} TraceRecord;
+
+static_assert(sizeof(TraceRecord) == 24, "trace records are 24 bytes on disk");
+
+typedef struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t flags;
+    uint32_t reserved;
+} TraceHeader;
+
+typedef struct trace_block {
+    uint32_t records;
+    uint32_t encoded_size;
+} TraceBlock;
+
+/**
+ * Renders a record the way nestest.log lays out a line, without the newline.
+ * buf must hold TRACE_LINE_MAX bytes. Returns the length of the line.
+ */
+int format_trace_record(const TraceRecord& rec, char* buf);
+
+/** Receives a record for every instruction the CPU executes while tracing */
+class TraceSink {
+public:
+    virtual ~TraceSink() {}
+    virtual void record(const TraceRecord& rec) = 0;
+    virtual void flush() {}
+};
+
+/** Prints records as nestest style text */
+class TextTraceSink : public TraceSink {
+private:
+    FILE* out;
+
+public:
+    TextTraceSink(FILE* out);
+
+    void record(const TraceRecord& rec) override;
+    void flush() override;
+};
+
+/** The writing end of a trace file, compressing blocks if asked to */
+class TraceFile {
+private:
+    FILE* file;
+    bool compress;
+    TraceRecord previous;
+    uint8_t* delta;
+    uint8_t* encoded;
+
+public:
+    TraceFile(const char* filename, bool compress);
+    ~TraceFile();
+
+    /** False if the file could not be created */
+    bool is_open();
+    void write(const TraceRecord* records, size_t count);
+    void flush();
+};
+
+/** Reads back a trace file written by TraceFile */
+class TraceReader {
+private:
+    uint8_t* data;
+    size_t size;
+    size_t offset;
+    bool compressed;
+    TraceRecord previous;
+    TraceRecord* block;
+    size_t block_records;
+    size_t block_next;
+
+    bool next_block();
+
+public:
+    TraceReader(const char* filename);
+    ~TraceReader();
+
+    /** False if the file could not be read or is not a trace */
+    bool is_open();
+    /** Copies the next record into rec, returns false at the end of the trace */
+    bool next(TraceRecord& rec);
+};
+
+/**
+ * Writes records to a binary trace file. Records are collected in a large
+ * buffer and written out a block at a time, so tracing costs a copy per
+ * instruction. nestrace turns the file back into text.
+ */
+class TraceWriter : public TraceSink {
+private:
+    TraceFile file;
+    TraceRecord* buffer;
+    size_t used;
+
+public:
+    TraceWriter(const char* filename, bool compress = false);
+    ~TraceWriter();
+
+    bool is_open();
+    void record(const TraceRecord& rec) override;
+    void flush() override;
+};
+
+/**
+ * Writes records to a binary trace file from a background thread. The CPU
+ * only pushes records into a lock free ring; the writer thread drains it,
+ * compresses and does the file I/O.
+ */
+class AsyncTraceWriter : public TraceSink {
+public:
+    /** What record() does when the writer thread falls behind and the ring is full */
+    enum FullPolicy {
+        TRACE_DROP,     // Throw the record away and count it
+        TRACE_BLOCK,    // Wait for the writer thread to make room
+    };
+
+private:
+    TraceFile file;
+    SpscRing<TraceRecord> ring;
+    FullPolicy policy;
+    uint64_t dropped;
+    std::atomic<bool> running;
+    std::thread writer;
+
+    void drain();
+
+public:
+    AsyncTraceWriter(const char* filename, FullPolicy policy, bool compress = false);
+    /** Writes out whatever is still queued and stops the writer thread */
+    ~AsyncTraceWriter();
+
+    bool is_open();
+    void record(const TraceRecord& rec) override;
+    /** Waits until every queued record has been written */
+    void flush() override;
+    /** Records thrown away under TRACE_DROP */
+    uint64_t get_dropped();
+};
+
+
+#endif //NESEMU_TRACE_H
@@ -0,0 +1,222 @@
+#include "verify.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Finds key in [p, end), returns a pointer past it or nullptr */
+static const char* find_field(const char* p, const char* end, const char* key) {
+    size_t len = strlen(key);
+    for(; p + len <= end; p++) {
+        if(memcmp(p, key, len) == 0)
+            return p + len;
+    }
+    return nullptr;
+}
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/** Parses digits hex digits at p, false if there are not that many */
+static bool parse_hex(const char* p, const char* end, int digits, uint16_t& value) {
+    if(p == nullptr || p + digits > end)
+        return false;
+    value = 0;
+    for(int i=0; i<digits; i++) {
+        int digit = hex_value(p[i]);
+        if(digit < 0)
+            return false;
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+TraceVerifier::TraceVerifier(const char* filename, CPU& cpu): cpu(cpu) {
+    data = nullptr;
+    size = 0;
+    offset = 0;
+    checked = 0;
+    diverged = false;
+    exhausted = false;
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+    if(st.st_size == 0) {
+        fprintf(stderr, "%s: empty reference log\n", filename);
+        close(fd);
+        return;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror(filename);
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    data = (const char*)map;
+    size = st.st_size;
+}
+
+TraceVerifier::~TraceVerifier() {
+    if(data != nullptr)
+        munmap((void*)data, size);
+}
+
+bool TraceVerifier::is_open() {
+    return data != nullptr;
+}
+
+uint64_t TraceVerifier::get_checked() {
+    return checked;
+}
+
+bool TraceVerifier::has_diverged() {
+    return diverged;
+}
+
+bool TraceVerifier::is_exhausted() {
+    skip_blank_lines();
+    return offset == size;
+}
+
+/** Moves past blank lines, the reference may end with one or use CRLF */
+void TraceVerifier::skip_blank_lines() {
+    while(offset < size && (data[offset] == '\n' || data[offset] == '\r'))
+        offset++;
+}
+
+/**
+ * Reads the state out of a reference line. The disassembly between the
+ * instruction bytes and the registers is not compared, so logs from other
+ * emulators with their own disassembler can be used as well.
+ */
+bool TraceVerifier::parse_line(const char* line, const char* end, ExpectedState& state) {
+    uint16_t value;
+    if(!parse_hex(line, end, 4, state.pc))
+        return false;
+
+    const char* p = find_field(line + 4, end, "A:");
+    if(!parse_hex(p, end, 2, value))
+        return false;
+    state.a = value;
+    p = find_field(p, end, "X:");
+    if(!parse_hex(p, end, 2, value))
+        return false;
+    state.x = value;
+    p = find_field(p, end, "Y:");
+    if(!parse_hex(p, end, 2, value))
+        return false;
+    state.y = value;
+    p = find_field(p, end, "P:");
+    if(!parse_hex(p, end, 2, value))
+        return false;
+    state.p = value;
+    p = find_field(p, end, "SP:");
+    if(!parse_hex(p, end, 2, value))
+        return false;
+    state.sp = value;
+
+    p = find_field(p, end, "CYC:");
+    state.has_cycles = p != nullptr && p < end && *p >= '0' && *p <= '9';
+    state.cycles = 0;
+    if(state.has_cycles) {
+        for(; p < end && *p >= '0' && *p <= '9'; p++)
+            state.cycles = state.cycles * 10 + (*p - '0');
+    }
+    return true;
+}
+
+void TraceVerifier::record(const TraceRecord& rec) {
+    if(diverged || exhausted)
+        return;
+
+    skip_blank_lines();
+    if(offset == size) {
+        exhausted = true;
+        cpu.request_stop();
+        return;
+    }
+
+    const char* line = &data[offset];
+    const char* end = (const char*)memchr(line, '\n', size - offset);
+    if(end == nullptr)
+        end = &data[size];
+
+    ExpectedState expected;
+    const char* reason = nullptr;
+    if(!parse_line(line, end, expected))
+        reason = "unreadable reference line";
+    else if(expected.pc != rec.pc)
+        reason = "PC differs";
+    else if(expected.a != rec.a)
+        reason = "A differs";
+    else if(expected.x != rec.x)
+        reason = "X differs";
+    else if(expected.y != rec.y)
+        reason = "Y differs";
+    else if(expected.p != rec.p)
+        reason = "P differs";
+    else if(expected.sp != rec.sp)
+        reason = "SP differs";
+    else if(expected.has_cycles && expected.cycles != rec.cycles)
+        reason = "CYC differs";
+
+    if(reason != nullptr) {
+        report(rec, reason);
+        diverged = true;
+        cpu.request_stop();
+        return;
+    }
+
+    history[checked % VERIFY_CONTEXT] = rec;
+    line_starts[checked % VERIFY_CONTEXT] = offset;
+    checked++;
+    offset = end - data;
+}
+
+void TraceVerifier::print_line(size_t start) {
+    const char* end = (const char*)memchr(&data[start], '\n', size - start);
+    size_t len = (end == nullptr ? &data[size] : end) - &data[start];
+    if(len > 0 && data[start + len - 1] == '\r')
+        len--;
+    printf("%.*s\n", (int)len, &data[start]);
+}
+
+void TraceVerifier::report(const TraceRecord& rec, const char* reason) {
+    uint64_t first = checked > VERIFY_CONTEXT ? checked - VERIFY_CONTEXT : 0;
+    char line[TRACE_LINE_MAX];
+
+    printf("Trace diverged at instruction %llu: %s\n", (unsigned long long)checked + 1, reason);
+    printf("Reference:\n");
+    for(uint64_t i=first; i<checked; i++) {
+        printf("   ");
+        print_line(line_starts[i % VERIFY_CONTEXT]);
+    }
+    printf(" > ");
+    print_line(offset);
+
+    printf("Emulator:\n");
+    for(uint64_t i=first; i<checked; i++) {
+        int len = format_trace_record(history[i % VERIFY_CONTEXT], line);
+        printf("   %.*s\n", len, line);
+    }
+    int len = format_trace_record(rec, line);
+    printf(" > %.*s\n", len, line);
+}
@@ -0,0 +1,68 @@
+#ifndef NESEMU_VERIFY_H
+#define NESEMU_VERIFY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu.h"
+#include "trace.h"
+
+/** Instructions of context printed before a divergence */
+#define VERIFY_CONTEXT 8
+
+/**
+ * Checks every executed instruction against a reference log in the
+ * nestest.log text format, memory mapped so the check runs at emulation
+ * speed. PC, A, X, Y, P and SP are compared on every line, and the cycle
+ * count too when the reference has a CYC column. On the first difference
+ * the recent history of both sides is printed and the CPU is stopped, and
+ * so it is when the reference runs out.
+ */
+class TraceVerifier : public TraceSink {
+private:
+    typedef struct expected_state {
+        uint16_t pc;
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t p;
+        uint8_t sp;
+        bool has_cycles;
+        uint64_t cycles;
+    } ExpectedState;
+
+    CPU& cpu;
+    const char* data;
+    size_t size;
+    size_t offset;
+    uint64_t checked;
+    bool diverged;
+    bool exhausted;
+
+    /** Last VERIFY_CONTEXT records and reference lines, indexed by checked */
+    TraceRecord history[VERIFY_CONTEXT];
+    size_t line_starts[VERIFY_CONTEXT];
+
+    void skip_blank_lines();
+    bool parse_line(const char* line, const char* end, ExpectedState& state);
+    void report(const TraceRecord& rec, const char* reason);
+    void print_line(size_t start);
+
+public:
+    TraceVerifier(const char* filename, CPU& cpu);
+    ~TraceVerifier();
+
+    /** False if the reference log could not be read */
+    bool is_open();
+    void record(const TraceRecord& rec) override;
+
+    /** Instructions that matched the reference */
+    uint64_t get_checked();
+    /** True once an instruction differed from the reference */
+    bool has_diverged();
+    /** True once every line of the reference was matched */
+    bool is_exhausted();
+};
+
+
+#endif //NESEMU_VERIFY_H
@@ -0,0 +1,68 @@
+#include "wav.h"
+
+#include <cstring>
+
+typedef struct wav_header {
+    char riff[4];
+    uint32_t riff_size;     // File size minus the first 8 bytes
+    char wave[4];
+    char fmt[4];
+    uint32_t fmt_size;
+    uint16_t format;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits_per_sample;
+    char data[4];
+    uint32_t data_size;
+} WavHeader;
+
+#define WAV_FORMAT_PCM 1
+
+WavWriter::WavWriter(const char* filename, int sample_rate): sample_rate(sample_rate) {
+    samples = 0;
+    file = fopen(filename, "wb");
+    if(file == nullptr) {
+        perror(filename);
+        return;
+    }
+    write_header();
+}
+
+WavWriter::~WavWriter() {
+    if(file == nullptr)
+        return;
+    fseek(file, 0, SEEK_SET);
+    write_header();
+    fclose(file);
+}
+
+bool WavWriter::is_open() {
+    return file != nullptr;
+}
+
+void WavWriter::write_header() {
+    WavHeader header;
+    memcpy(header.riff, "RIFF", 4);
+    header.riff_size = sizeof(WavHeader) - 8 + samples * sizeof(int16_t);
+    memcpy(header.wave, "WAVE", 4);
+    memcpy(header.fmt, "fmt ", 4);
+    header.fmt_size = 16;
+    header.format = WAV_FORMAT_PCM;
+    header.channels = 1;
+    header.sample_rate = sample_rate;
+    header.byte_rate = sample_rate * sizeof(int16_t);
+    header.block_align = sizeof(int16_t);
+    header.bits_per_sample = 16;
+    memcpy(header.data, "data", 4);
+    header.data_size = samples * sizeof(int16_t);
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+void WavWriter::write(const int16_t* samples, size_t count) {
+    if(file == nullptr)
+        return;
+    fwrite(samples, sizeof(int16_t), count, file);
+    this->samples += count;
+}
@@ -0,0 +1,28 @@
+#ifndef NESEMU_WAV_H
+#define NESEMU_WAV_H
+
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Writes mono 16 bit PCM to a WAV file. The sizes in the header are only
+ * known at the end, so they are filled in when the writer is destroyed.
+ */
+class WavWriter {
+private:
+    FILE* file;
+    int sample_rate;
+    uint32_t samples;
+
+    void write_header();
+
+public:
+    WavWriter(const char* filename, int sample_rate);
+    ~WavWriter();
+
+    bool is_open();
+    void write(const int16_t* samples, size_t count);
+};
+
+
+#endif //NESEMU_WAV_H
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../src/rle.h"
+
+/**
+ * Encodes the patterns that grow the most under rle_encode at every length
+ * up to a few trace blocks, and at the sizes of rewind deltas, and checks
+ * that each fits RLE_MAX_ENCODED and decodes back to itself. Exits with 1
+ * on the first that does not.
+ */
+
+#define CHECK_MAX_LEN 4096
+#define CHECK_DELTA_LEN (128 << 10)    // More than the machine state a rewind delta covers
+
+static std::vector<uint8_t> pattern(size_t len, int kind) {
+    std::vector<uint8_t> data(len);
+    for(size_t i=0; i<len; i++) {
+        switch(kind) {
+            case 0: data[i] = i % 3 == 0 ? 0x55 : 0; break;     // x 0 0 x 0 0 ..., a literal byte between runs of two
+            case 1: data[i] = i / 2; break;                     // a a b b c c ..., runs of two only
+            case 2: data[i] = i % 4 == 0 ? 0x55 : 0; break;     // x 0 0 0 x 0 0 0 ..., literals between runs of three
+            case 3: data[i] = i; break;
+            default: data[i] = rand() % 3; break;
+        }
+    }
+    return data;
+}
+
+static const char* pattern_names[] = {"x 0 0", "a a b b", "x 0 0 0", "distinct", "random"};
+
+static bool check(const char* name, const std::vector<uint8_t>& data) {
+    size_t len = data.size();
+    // Room past the bound, so an encoder that overruns it is caught rather than corrupting the heap
+    std::vector<uint8_t> encoded(2 * len + 16);
+    size_t size = rle_encode(data.data(), len, encoded.data());
+    if(size > RLE_MAX_ENCODED(len)) {
+        fprintf(stderr, "%s: %zu bytes encoded to %zu, more than the %zu allowed\n",
+                name, len, size, (size_t)RLE_MAX_ENCODED(len));
+        return false;
+    }
+    std::vector<uint8_t> decoded(len);
+    if(rle_decode(encoded.data(), size, decoded.data(), len) != len || decoded != data) {
+        fprintf(stderr, "%s: %zu bytes do not decode back\n", name, len);
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    srand(1);
+    for(size_t len=0; len<=CHECK_MAX_LEN; len++) {
+        for(int kind=0; kind<5; kind++) {
+            if(!check(pattern_names[kind], pattern(len, kind)))
+                return 1;
+        }
+    }
+
+    // Rewind deltas XOR whole states, RAM and PPU memory included, so any of these can turn up in one
+    for(size_t len=CHECK_DELTA_LEN-3; len<=CHECK_DELTA_LEN; len++) {
+        for(int kind=0; kind<5; kind++) {
+            if(!check(pattern_names[kind], pattern(len, kind)))
+                return 1;
+        }
+        std::vector<uint8_t> mixed(len);
+        for(size_t i=0; i<len; i+=CHECK_MAX_LEN) {
+            std::vector<uint8_t> part = pattern(CHECK_MAX_LEN, rand() % 5);
+            for(size_t j=0; j<CHECK_MAX_LEN && i+j<len; j++)
+                mixed[i + j] = part[j];
+        }
+        if(!check("mixed", mixed))
+            return 1;
+    }
+    printf("rle: all patterns fit RLE_MAX_ENCODED up to %d bytes and at %d\n", CHECK_MAX_LEN, CHECK_DELTA_LEN);
+    return 0;
+}